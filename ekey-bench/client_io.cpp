@@ -0,0 +1,84 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <SKLib/sklib.hpp>
+#include "client_io.h"
+#include "../ekey-model/emulation_socket.h"
+#include "../ekey-model/serial_port.h"
+
+#ifdef EMULATION_SOCKET
+
+static constexpr int CONNECT_WAIT_MS = 2000;
+
+static thread_local socket_stream_type SOCKET_IO;
+
+// --serial: the serial line instead of TCP, it has one client
+static serial_port_type SERIAL_IO;
+static std::string SERIAL_PATH;
+static unsigned SERIAL_BAUD = SERIAL_SPEED;
+
+static bool serial() { return !SERIAL_PATH.empty(); }
+
+void cli_use_serial(const char* path, unsigned baud)
+{
+    SERIAL_PATH = path;
+    SERIAL_BAUD = baud;
+}
+
+static constexpr unsigned OUTPUT_SIZE = 4096;
+static thread_local uint8_t OUTPUT[OUTPUT_SIZE];
+static thread_local unsigned OUTPUT_LENGTH = 0;
+
+bool cli_connect(const char* host, unsigned port)
+{
+    OUTPUT_LENGTH = 0;
+    if (serial()) return SERIAL_IO.open(SERIAL_PATH.c_str(), SERIAL_BAUD);
+    return SOCKET_IO.connect(host, port, CONNECT_WAIT_MS);
+}
+
+void cli_close()
+{
+    if (serial()) SERIAL_IO.close();
+    else SOCKET_IO.close();
+}
+
+bool cli_connected()
+{
+    return serial() ? SERIAL_IO.is_open() : SOCKET_IO.is_connected();
+}
+
+bool cli_getbyte(int& ch)
+{
+    uint8_t c = 0;
+    if (!(serial() ? SERIAL_IO.read(c, READ_DELAY_MS) : SOCKET_IO.read(c, READ_DELAY_MS))) return false;
+    ch = c;
+    return true;
+}
+
+bool cli_getchar(int& ch)
+{
+    if (!cli_getbyte(ch)) return false;
+    if (ch < ' ' || ch > '~') ch = EOF;    // the emulator ends the frame with (uint8_t)EOF
+    return true;
+}
+
+void cli_putchar(int ch)
+{
+    if (OUTPUT_LENGTH == OUTPUT_SIZE) cli_flush();
+    OUTPUT[OUTPUT_LENGTH++] = (ch < 0) ? '\n' : (uint8_t)ch;
+}
+
+void cli_flush()
+{
+    if (serial()) SERIAL_IO.write(OUTPUT, OUTPUT_LENGTH);
+    else SOCKET_IO.write(OUTPUT, OUTPUT_LENGTH);
+    OUTPUT_LENGTH = 0;
+}
+
+#endif
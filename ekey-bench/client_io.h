@@ -0,0 +1,26 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#pragma once
+#include "../ekey-model/interface.h"
+
+// communications counterpart for ekey-model, one connection per thread, so every worker has its own client;
+// same semantics as hdw_getchar() & co in ekey-model/hardware_model.h
+
+// connect then opens this serial port instead (ekey-model --pty, or the device); one client only
+void cli_use_serial(const char* path, unsigned baud);
+
+bool cli_connect(const char* host, unsigned port);
+void cli_close();
+bool cli_connected();
+
+bool cli_getchar(int& ch);      // control characters are EOF, for base64 framing
+bool cli_getbyte(int& ch);      // any byte is data, for binary framing
+void cli_putchar(int ch);       // collects the frame
+void cli_flush();               // sends the frame in one write
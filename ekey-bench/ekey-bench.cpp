@@ -0,0 +1,814 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// Protocol benchmark: drives the commands against the emulator (or device) and reports latency and throughput.
+//
+// ekey-bench [options]
+//   --host A.B.C.D      emulator address, default 127.0.0.1
+//   --port N            default SOCKET_EKEY_PORT
+//   --serial DEV        the device on the serial port instead (/dev/ttyACM0, COM3, ekey-model --pty); one thread, no --pipeline
+//   --baud N            of the serial port, default SERIAL_SPEED
+//   --threads N         concurrent clients, each with its own connection, default 1
+//   --seconds S         run time, default 5
+//   --keys N            keys written before the run, exchange searches them, default 256 (at most KEY_COUNT)
+//   --mix op:w,...      weights of the commands, default exchange:1
+//                       op is exchange, batch, prime, write, erase, noise, get, put, getrange, putrange, sync, status
+//   --cobs              binary framing on all connections
+//   --cache N           with --pipeline: the client caches up to N exchange answers, hits and misses are reported
+//   --two-frames        commands in the older form: opcode frame, then parameters frame
+//   --pipeline N        every client keeps N requests in flight, through ekey_client_type (COBS with request IDs);
+//                       latency is from the call to the answer; getrange and putrange are not available
+//   --devices N         with --pipeline: N emulators on the ports from --port up, through ekey_pool_type; the keys are
+//                       on all of them, lookups go to any; every client keeps its --pipeline requests in flight
+//                       to the pool, the pool as many to every device; ops are exchange, batch, prime, write, erase
+//   --partitioned       with --devices: every key is on one device, see ekey_pool.h
+//   --reply-wait MS     how long the reply may take to start, default READ_DELAY_MS; on a slow link
+//                       (ekey-model --link) long frames take longer than that to reach the device
+//   --histogram         add histogram buckets to the output
+//   --replay FILE       instead of the benchmark, plays back a capture of ekey-model --capture, see replay.h
+//   --paced             replay with the recorded pauses between the requests, not as fast as possible
+//
+// Output is one JSON object per line: one per command in the mix, then "all". Count is the answered requests,
+// nak is how many of them were NAK; failed ones (no answer, wrong answer) are not in the latency, the client reconnects.
+// Latency is in microseconds, percentile is the upper bound of its histogram bucket (3% resolution).
+// With --devices, one more line per device: requests sent to it, how many of them it stole from others, failed.
+// NB: erase in the mix makes the following exchanges miss, they are counted as "nak", not as errors.
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <SKLib/sklib.hpp>
+
+// Shared IO settings, common IO functions, KEY, BLOCK sizes, counts
+#include "../ekey-model/interface.h"
+
+// connection per thread
+#include "client_io.h"
+
+// pipelined client
+#include "../ekey-client/ekey_client.h"
+
+// --devices
+#include "../ekey-client/ekey_pool.h"
+
+// latency_histogram_type
+#include "latency_histogram.h"
+
+// --replay
+#include "replay.h"
+
+// -------------------------------------------------------------
+
+enum class OpResult { ok, nak, failed };
+
+static constexpr unsigned BUFFER_SIZE = 1536;
+static constexpr unsigned BUFFER_LENGTH = std::max({ BUFFER_SIZE, Interface::read_buffer_size(KEY_ADDR_SIZE + 2*KEY_SIZE), Interface::read_buffer_size(RECORD_ADDR_SIZE + BLOCK_SIZE) });
+static constexpr unsigned RANGE_COUNT = 8;      // blocks in getrange/putrange
+static constexpr unsigned BATCH_LIMIT = (BUFFER_LENGTH - Interface::read_buffer_size(0)) / (KEY_SIZE + 1);    // response fits into BUFFER
+
+// what the workers share, written before they start
+static std::vector<uint8_t> KEYS;           // key, payload; KEY_ADDR_SIZE + 2*KEY_SIZE per key, as write_key takes it
+static unsigned KEY_TOTAL = 256;
+static uint8_t PERMUTATION[KEY_SIZE];
+static unsigned BATCH_MAX = 1;              // asked from the server
+static bool COBS = false;
+static bool TWO_FRAMES = false;             // older form of the commands, opcode and parameters in separate frames
+static unsigned REPLY_WAIT_MS = READ_DELAY_MS;
+static bool SERIAL_LINE = false;            // --serial
+
+static const uint8_t* key_record(unsigned k) { return KEYS.data() + k * (KEY_ADDR_SIZE + 2*KEY_SIZE); }
+static const uint8_t* key_pattern(unsigned k) { return key_record(k) + KEY_ADDR_SIZE; }
+static const uint8_t* key_payload(unsigned k) { return key_record(k) + KEY_ADDR_SIZE + KEY_SIZE; }
+
+struct worker_type
+{
+    Interface Serial{ cli_getchar, cli_putchar, cli_flush, cli_getbyte };
+    std::mt19937 Random;
+    uint8_t BUFFER[BUFFER_LENGTH];
+    std::vector<uint8_t> Batch;         // count, patterns
+    std::vector<uint8_t> Frame;         // command being sent
+
+    explicit worker_type(unsigned seed) : Random(seed) {}
+
+    unsigned pick(unsigned n) { return (unsigned)(Random() % n); }
+
+    // opcode and parameters in one frame, or in two with --two-frames
+    void command(KeyFunction f, const uint8_t* data = nullptr, unsigned length = 0)
+    {
+        const uint8_t code = (uint8_t)f;
+        if (TWO_FRAMES)
+        {
+            Serial.write_output(&code, 1);
+            if (length) Serial.write_output(data, length);
+            return;
+        }
+
+        Frame.assign(1, code);
+        Frame.insert(Frame.end(), data, data + length);
+        Serial.write_output(Frame.data(), (unsigned)Frame.size());
+    }
+
+    // frame of the reply, up to max_len; Interface alone waits for it to start only read_delay
+    unsigned reply(unsigned max_len)
+    {
+        const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(REPLY_WAIT_MS);
+        do
+        {
+            const auto L = Serial.read_input_variable_wait(BUFFER, max_len);
+            if (L) return L;
+        }
+        while (std::chrono::steady_clock::now() < until && cli_connected());
+        return 0;
+    }
+
+    OpResult ack()
+    {
+        if (reply(1) != 1) return OpResult::failed;
+        if (BUFFER[0] == (uint8_t)KeyResponse::ACK) return OpResult::ok;
+        return (BUFFER[0] == (uint8_t)KeyResponse::NAK) ? OpResult::nak : OpResult::failed;
+    }
+};
+
+static OpResult op_exchange(worker_type& W)
+{
+    const unsigned k = W.pick(KEY_TOTAL);
+    W.Serial.write_output(key_pattern(k), KEY_SIZE);
+    const auto L = W.reply(KEY_SIZE);
+    if (L == 1 && W.BUFFER[0] == (uint8_t)KeyResponse::NAK) return OpResult::nak;
+    return (L == KEY_SIZE && !memcmp(W.BUFFER, key_payload(k), KEY_SIZE)) ? OpResult::ok : OpResult::failed;
+}
+
+static OpResult op_batch(worker_type& W)
+{
+    unsigned index[BATCH_LIMIT];
+
+    W.Batch.resize(1 + BATCH_MAX * KEY_SIZE);
+    W.Batch[0] = (uint8_t)BATCH_MAX;
+    for (unsigned n = 0; n < BATCH_MAX; n++)
+    {
+        index[n] = W.pick(KEY_TOTAL);
+        memcpy(W.Batch.data() + 1 + n*KEY_SIZE, key_pattern(index[n]), KEY_SIZE);
+    }
+
+    W.command(KeyFunction::exchange_batch, W.Batch.data(), (unsigned)W.Batch.size());
+    const auto L = W.reply(BATCH_MAX * (KEY_SIZE + 1));
+    if (!L) return OpResult::failed;
+
+    bool miss = false;
+    unsigned pos = 0;
+    for (unsigned n = 0; n < BATCH_MAX; n++)
+    {
+        if (pos >= L) return OpResult::failed;
+        if (W.BUFFER[pos] == (uint8_t)KeyResponse::NAK)
+        {
+            miss = true;
+            pos++;
+            continue;
+        }
+        if (W.BUFFER[pos] != (uint8_t)KeyResponse::ACK || pos + 1 + KEY_SIZE > L ||
+            memcmp(W.BUFFER + pos + 1, key_payload(index[n]), KEY_SIZE)) return OpResult::failed;
+        pos += 1 + KEY_SIZE;
+    }
+
+    return miss ? OpResult::nak : OpResult::ok;
+}
+
+static OpResult op_prime(worker_type& W)
+{
+    W.command(KeyFunction::prime_keys, PERMUTATION, KEY_SIZE);
+    return W.ack();
+}
+
+// rewrites a key with the same content, so exchanges stay valid
+static OpResult op_write(worker_type& W)
+{
+    W.command(KeyFunction::write_key, key_record(W.pick(KEY_TOTAL)), KEY_ADDR_SIZE + 2*KEY_SIZE);
+    return W.ack();
+}
+
+static OpResult op_erase(worker_type& W)
+{
+    W.command(KeyFunction::erase_keys);
+    return W.ack();
+}
+
+static OpResult op_noise(worker_type& W)
+{
+    W.command(KeyFunction::get_noise);
+    return (W.reply(KEY_SIZE) == KEY_SIZE) ? OpResult::ok : OpResult::failed;
+}
+
+static void put_record_address(uint8_t* dest, unsigned address)
+{
+    dest[0] = (uint8_t)(address >> 8);
+    dest[1] = (uint8_t)address;
+}
+
+static OpResult op_get(worker_type& W)
+{
+    uint8_t address[RECORD_ADDR_SIZE];
+    put_record_address(address, W.pick(BLOCK_COUNT));
+    W.command(KeyFunction::get_record, address, RECORD_ADDR_SIZE);
+    return (W.reply(BLOCK_SIZE) == BLOCK_SIZE) ? OpResult::ok : OpResult::failed;
+}
+
+static OpResult op_put(worker_type& W)
+{
+    put_record_address(W.BUFFER, W.pick(BLOCK_COUNT));
+    for (unsigned k = 0; k < BLOCK_SIZE; k++) W.BUFFER[RECORD_ADDR_SIZE + k] = (uint8_t)W.Random();
+    W.command(KeyFunction::put_record, W.BUFFER, RECORD_ADDR_SIZE + BLOCK_SIZE);
+    return W.ack();
+}
+
+static OpResult op_sync(worker_type& W)
+{
+    W.command(KeyFunction::sync_records);
+    return W.ack();
+}
+
+static OpResult op_status(worker_type& W)
+{
+    W.command(KeyFunction::get_status);
+    return W.reply(BUFFER_LENGTH - Interface::read_buffer_size(0)) ? OpResult::ok : OpResult::failed;
+}
+
+static OpResult op_getrange(worker_type& W)
+{
+    uint8_t range[RECORD_RANGE_SIZE];
+    put_record_address(range, W.pick(BLOCK_COUNT - RANGE_COUNT + 1));
+    range[RECORD_ADDR_SIZE] = (uint8_t)RANGE_COUNT;
+    W.command(KeyFunction::get_record_range, range, RECORD_RANGE_SIZE);
+
+    for (unsigned k = 0; k < RANGE_COUNT; k++)
+    {
+        const auto L = W.reply(BLOCK_SIZE);
+        if (L == 1 && W.BUFFER[0] == (uint8_t)KeyResponse::NAK) return OpResult::nak;
+        if (L != BLOCK_SIZE) return OpResult::failed;
+    }
+    return W.ack();
+}
+
+static OpResult op_putrange(worker_type& W)
+{
+    uint8_t range[RECORD_RANGE_SIZE];
+    put_record_address(range, W.pick(BLOCK_COUNT - RANGE_COUNT + 1));
+    range[RECORD_ADDR_SIZE] = (uint8_t)RANGE_COUNT;
+    W.command(KeyFunction::put_record_range, range, RECORD_RANGE_SIZE);
+
+    for (unsigned k = 0; k < RANGE_COUNT; k++)
+    {
+        for (unsigned b = 0; b < BLOCK_SIZE; b++) W.BUFFER[b] = (uint8_t)W.Random();
+        W.Serial.write_output(W.BUFFER, BLOCK_SIZE);
+    }
+    return W.ack();
+}
+
+// same commands through ekey_client_type; key is the index of the pattern, for the check of the answer
+
+typedef std::future<ClientReply> async_reply_type;
+
+static async_reply_type async_exchange(ekey_client_type& C, worker_type& W, unsigned& key)
+{
+    key = W.pick(KEY_TOTAL);
+    return C.exchange(key_pattern(key));
+}
+
+static async_reply_type async_batch(ekey_client_type& C, worker_type& W, unsigned&)
+{
+    W.Batch.resize(BATCH_MAX * KEY_SIZE);
+    for (unsigned n = 0; n < BATCH_MAX; n++) memcpy(W.Batch.data() + n*KEY_SIZE, key_pattern(W.pick(KEY_TOTAL)), KEY_SIZE);
+    return C.exchange_batch(W.Batch.data(), BATCH_MAX);
+}
+
+static async_reply_type async_prime(ekey_client_type& C, worker_type&, unsigned&)
+{
+    return C.prime(PERMUTATION);
+}
+
+static async_reply_type async_write(ekey_client_type& C, worker_type& W, unsigned& key)
+{
+    key = W.pick(KEY_TOTAL);
+    return C.write_key(key, key_pattern(key), key_payload(key));
+}
+
+static async_reply_type async_erase(ekey_client_type& C, worker_type&, unsigned&)
+{
+    return C.erase();
+}
+
+static async_reply_type async_noise(ekey_client_type& C, worker_type&, unsigned&)
+{
+    return C.noise();
+}
+
+static async_reply_type async_get(ekey_client_type& C, worker_type& W, unsigned&)
+{
+    return C.get_record(W.pick(BLOCK_COUNT));
+}
+
+static async_reply_type async_put(ekey_client_type& C, worker_type& W, unsigned&)
+{
+    for (unsigned k = 0; k < BLOCK_SIZE; k++) W.BUFFER[k] = (uint8_t)W.Random();
+    return C.put_record(W.pick(BLOCK_COUNT), W.BUFFER);
+}
+
+static async_reply_type async_sync(ekey_client_type& C, worker_type&, unsigned&)
+{
+    return C.sync_records();
+}
+
+static async_reply_type async_status(ekey_client_type& C, worker_type&, unsigned&)
+{
+    return C.status();
+}
+
+// lookups and table changes through ekey_pool_type
+
+static async_reply_type pooled_exchange(ekey_pool_type& P, worker_type& W, unsigned& key)
+{
+    key = W.pick(KEY_TOTAL);
+    return P.exchange(key_pattern(key));
+}
+
+static async_reply_type pooled_batch(ekey_pool_type& P, worker_type& W, unsigned&)
+{
+    W.Batch.resize(BATCH_MAX * KEY_SIZE);
+    for (unsigned n = 0; n < BATCH_MAX; n++) memcpy(W.Batch.data() + n*KEY_SIZE, key_pattern(W.pick(KEY_TOTAL)), KEY_SIZE);
+    return P.exchange_batch(W.Batch.data(), BATCH_MAX);
+}
+
+static async_reply_type pooled_prime(ekey_pool_type& P, worker_type&, unsigned&)
+{
+    return P.prime(PERMUTATION);
+}
+
+static async_reply_type pooled_write(ekey_pool_type& P, worker_type& W, unsigned& key)
+{
+    key = W.pick(KEY_TOTAL);
+    return P.write_key(key, key_pattern(key), key_payload(key));
+}
+
+static async_reply_type pooled_erase(ekey_pool_type& P, worker_type&, unsigned&)
+{
+    return P.erase();
+}
+
+struct op_type
+{
+    const char* name;
+    OpResult (*run)(worker_type&);
+    async_reply_type (*submit)(ekey_client_type&, worker_type&, unsigned&);     // nullptr if not available
+    async_reply_type (*pooled)(ekey_pool_type&, worker_type&, unsigned&);       // same, --devices
+};
+
+static const op_type OPS[] =
+{
+    { "exchange", op_exchange, async_exchange, pooled_exchange },
+    { "batch",    op_batch,    async_batch,    pooled_batch    },
+    { "prime",    op_prime,    async_prime,    pooled_prime    },
+    { "write",    op_write,    async_write,    pooled_write    },
+    { "erase",    op_erase,    async_erase,    pooled_erase    },
+    { "noise",    op_noise,    async_noise,    nullptr         },
+    { "get",      op_get,      async_get,      nullptr         },
+    { "put",      op_put,      async_put,      nullptr         },
+    { "getrange", op_getrange, nullptr,        nullptr         },
+    { "putrange", op_putrange, nullptr,        nullptr         },
+    { "sync",     op_sync,     async_sync,     nullptr         },
+    { "status",   op_status,   async_status,   nullptr         },
+};
+
+static constexpr unsigned OP_COUNT = sizeof(OPS) / sizeof(OPS[0]);
+
+struct op_stats_type
+{
+    latency_histogram_type Latency;
+    uint64_t Nak = 0;
+    uint64_t Failed = 0;
+};
+
+// -------------------------------------------------------------
+
+static const char* HOST = "127.0.0.1";
+static unsigned PORT = SOCKET_EKEY_PORT;
+static unsigned WEIGHT[OP_COUNT] = { 1 };
+static unsigned PIPELINE = 0;
+static unsigned CACHE = 0;
+static std::mutex CACHE_LOCK;
+static ExchangeCacheStats CACHE_STATS;      // all clients
+static std::unique_ptr<ekey_pool_type> POOL;     // --devices, all clients share it
+
+static bool connect_client(worker_type& W)
+{
+    if (!cli_connect(HOST, PORT)) return false;
+    if (!COBS) return true;
+
+    const uint8_t mode = (uint8_t)FrameMode::cobs;
+    W.command(KeyFunction::set_framing, &mode, 1);
+    if (W.ack() != OpResult::ok) return false;
+    return W.Serial.set_frame_mode(FrameMode::cobs);
+}
+
+// unlike TCP connection, the serial line keeps the framing between clients: base64 is left for the next one
+static void disconnect_client(worker_type& W)
+{
+    if (SERIAL_LINE && COBS && cli_connected())
+    {
+        const uint8_t mode = (uint8_t)FrameMode::base64;
+        W.command(KeyFunction::set_framing, &mode, 1);
+        if (W.ack() == OpResult::ok) W.Serial.set_frame_mode(FrameMode::base64);
+    }
+    cli_close();
+}
+
+static void make_keys()
+{
+    std::mt19937 Random(12345);     // fixed seed, runs are repeatable
+    for (unsigned k = 0; k < KEY_SIZE; k++) PERMUTATION[k] = (uint8_t)k;
+    std::shuffle(PERMUTATION, PERMUTATION + KEY_SIZE, Random);
+
+    KEYS.resize(KEY_TOTAL * (KEY_ADDR_SIZE + 2*KEY_SIZE));
+    for (unsigned k = 0; k < KEY_TOTAL; k++)
+    {
+        uint8_t* record = KEYS.data() + k * (KEY_ADDR_SIZE + 2*KEY_SIZE);
+        for (unsigned b = 0; b < KEY_ADDR_SIZE; b++) record[b] = (uint8_t)(k >> 8*(KEY_ADDR_SIZE - 1 - b));
+        for (unsigned b = KEY_ADDR_SIZE; b < KEY_ADDR_SIZE + 2*KEY_SIZE; b++) record[b] = (uint8_t)Random();
+    }
+}
+
+// one connection: erase, prime, write the keys, ask for the batch size
+static bool prepare_device()
+{
+    worker_type W(1);
+    if (!connect_client(W)) return false;
+
+    make_keys();
+    if (op_erase(W) != OpResult::ok || op_prime(W) != OpResult::ok) return false;
+
+    for (unsigned k = 0; k < KEY_TOTAL; k++)
+    {
+        W.command(KeyFunction::write_key, key_record(k), KEY_ADDR_SIZE + 2*KEY_SIZE);
+        if (W.ack() != OpResult::ok) return false;
+    }
+
+    const uint8_t zero = 0;
+    W.command(KeyFunction::exchange_batch, &zero, 1);
+    if (W.reply(1) != 1 || !W.BUFFER[0]) return false;
+    BATCH_MAX = std::min((unsigned)W.BUFFER[0], BATCH_LIMIT);
+
+    disconnect_client(W);
+    return true;
+}
+
+// same through the pool, the keys go where its mode puts them
+static bool prepare_pool()
+{
+    make_keys();
+    if (POOL->erase().get().Status != ReplyStatus::ack || POOL->prime(PERMUTATION).get().Status != ReplyStatus::ack) return false;
+
+    std::deque<async_reply_type> written;
+    for (unsigned k = 0; k < KEY_TOTAL; k++) written.push_back(POOL->write_key(k, key_pattern(k), key_payload(k)));
+    for (auto& R : written) if (R.get().Status != ReplyStatus::ack) return false;
+
+    const auto R = POOL->exchange_batch(key_pattern(0), 0).get();     // count 0 asks for the batch size
+    if (R.Status != ReplyStatus::ack || R.Data.size() != 1 || !R.Data[0]) return false;
+    BATCH_MAX = std::min((unsigned)R.Data[0], BATCH_LIMIT);
+    return true;
+}
+
+static void run_worker(unsigned seed, std::chrono::steady_clock::time_point until,
+                       const std::atomic<bool>& go, op_stats_type* stats, bool* connected)
+{
+    worker_type W(seed);
+    *connected = connect_client(W);
+    if (!*connected) return;
+
+    unsigned weight_total = 0;
+    for (unsigned k = 0; k < OP_COUNT; k++) weight_total += WEIGHT[k];
+
+    while (!go) std::this_thread::yield();
+
+    while (std::chrono::steady_clock::now() < until)
+    {
+        unsigned r = W.pick(weight_total), op = 0;
+        while (r >= WEIGHT[op]) r -= WEIGHT[op++];
+
+        const auto T = std::chrono::steady_clock::now();
+        const auto R = OPS[op].run(W);
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - T).count();
+
+        if (R == OpResult::failed)
+        {
+            stats[op].Failed++;
+            // the stream may be out of step, start over
+            cli_close();
+            if (!connect_client(W)) return;
+            continue;
+        }
+
+        if (R == OpResult::nak) stats[op].Nak++;
+        stats[op].Latency.add((uint64_t)ns);
+    }
+
+    disconnect_client(W);
+}
+
+static OpResult async_result(unsigned op, const ClientReply& R, unsigned key)
+{
+    if (R.Status == ReplyStatus::failed) return OpResult::failed;
+    if (R.Status == ReplyStatus::nak) return OpResult::nak;
+    if (OPS[op].submit == async_exchange)
+        return (R.Data.size() == KEY_SIZE && !memcmp(R.Data.data(), key_payload(key), KEY_SIZE)) ? OpResult::ok : OpResult::failed;
+    return OpResult::ok;
+}
+
+// --pipeline: keeps PIPELINE requests in flight on one connection, or to the pool, answers are taken in order
+static void run_pipelined_worker(unsigned seed, std::chrono::steady_clock::time_point until,
+                                 const std::atomic<bool>& go, op_stats_type* stats, bool* connected)
+{
+    worker_type W(seed);
+    ekey_client_type C;
+    C.set_cache(CACHE);
+    *connected = POOL || C.connect(HOST, PORT, PIPELINE);
+    if (!*connected) return;
+
+    unsigned weight_total = 0;
+    for (unsigned k = 0; k < OP_COUNT; k++) weight_total += WEIGHT[k];
+
+    struct Request
+    {
+        unsigned op;
+        unsigned key;
+        std::chrono::steady_clock::time_point sent;
+        async_reply_type reply;
+    };
+    std::deque<Request> Flight;
+
+    while (!go) std::this_thread::yield();
+
+    while (true)
+    {
+        while (Flight.size() < PIPELINE && std::chrono::steady_clock::now() < until)
+        {
+            unsigned r = W.pick(weight_total), op = 0;
+            while (r >= WEIGHT[op]) r -= WEIGHT[op++];
+
+            Request Q = { op, 0, std::chrono::steady_clock::now(), async_reply_type() };
+            Q.reply = POOL ? OPS[op].pooled(*POOL, W, Q.key) : OPS[op].submit(C, W, Q.key);
+            Flight.push_back(std::move(Q));
+        }
+        if (Flight.empty()) break;
+
+        Request& Q = Flight.front();
+        const auto R = async_result(Q.op, Q.reply.get(), Q.key);
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Q.sent).count();
+
+        if (R == OpResult::failed) stats[Q.op].Failed++;
+        else
+        {
+            if (R == OpResult::nak) stats[Q.op].Nak++;
+            stats[Q.op].Latency.add((uint64_t)ns);
+        }
+        Flight.pop_front();
+    }
+
+    const auto S = C.cache_stats();
+    std::lock_guard<std::mutex> L(CACHE_LOCK);
+    CACHE_STATS.hits += S.hits;
+    CACHE_STATS.misses += S.misses;
+    CACHE_STATS.evictions += S.evictions;
+    CACHE_STATS.invalidations += S.invalidations;
+}
+
+static bool parse_mix(const char* text)
+{
+    memset(WEIGHT, 0, sizeof(WEIGHT));
+    std::string mix(text);
+
+    size_t pos = 0;
+    while (pos < mix.size())
+    {
+        size_t end = mix.find(',', pos);
+        if (end == std::string::npos) end = mix.size();
+        const std::string item = mix.substr(pos, end - pos);
+        pos = end + 1;
+
+        const size_t colon = item.find(':');
+        const std::string name = item.substr(0, colon);
+        const unsigned weight = (colon == std::string::npos) ? 1 : (unsigned)strtoul(item.c_str() + colon + 1, nullptr, 10);
+
+        unsigned op = 0;
+        while (op < OP_COUNT && name != OPS[op].name) op++;
+        if (op == OP_COUNT) return false;
+        WEIGHT[op] = weight;
+    }
+
+    for (unsigned k = 0; k < OP_COUNT; k++) if (WEIGHT[k]) return true;
+    return false;
+}
+
+static void print_stats(const char* name, const op_stats_type& S, double seconds, bool histogram)
+{
+    const auto& H = S.Latency;
+    printf("{\"op\":\"%s\",\"count\":%llu,\"nak\":%llu,\"failed\":%llu,\"ops_per_s\":%.1f,"
+           "\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f",
+           name, (unsigned long long)H.total(), (unsigned long long)S.Nak, (unsigned long long)S.Failed,
+           (double)H.total() / seconds, H.percentile(0.5) / 1e3, H.percentile(0.99) / 1e3,
+           H.percentile(0.999) / 1e3, H.max() / 1e3);
+
+    if (histogram)
+    {
+        // [upper bound us, count] of non-empty buckets
+        printf(",\"histogram\":[");
+        bool first = true;
+        for (unsigned k = 0; k < latency_histogram_type::BUCKETS; k++)
+        {
+            if (!H.count_at(k)) continue;
+            printf("%s[%.3f,%llu]", first ? "" : ",", latency_histogram_type::upper(k) / 1e3, (unsigned long long)H.count_at(k));
+            first = false;
+        }
+        printf("]");
+    }
+
+    printf("}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned threads = 1;
+    double seconds = 5;
+    bool histogram = false;
+    const char* replay = nullptr;
+    bool paced = false;
+    const char* serial = nullptr;
+    unsigned baud = SERIAL_SPEED;
+    unsigned devices = 0;
+    PoolMode pool_mode = PoolMode::replicated;
+
+    for (int k = 1; k < argc; k++)
+    {
+        const bool more = (k+1 < argc);
+        if (!strcmp(argv[k], "--host") && more) HOST = argv[++k];
+        else if (!strcmp(argv[k], "--port") && more) PORT = (unsigned)atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--serial") && more) serial = argv[++k];
+        else if (!strcmp(argv[k], "--baud") && more) baud = (unsigned)atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--threads") && more) threads = std::max(1, atoi(argv[++k]));
+        else if (!strcmp(argv[k], "--seconds") && more) seconds = atof(argv[++k]);
+        else if (!strcmp(argv[k], "--keys") && more) KEY_TOTAL = (unsigned)atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--mix") && more)
+        {
+            if (!parse_mix(argv[++k]))
+            {
+                fprintf(stderr, "Invalid --mix: %s\n", argv[k]);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[k], "--pipeline") && more) PIPELINE = (unsigned)std::max(1, atoi(argv[++k]));
+        else if (!strcmp(argv[k], "--cache") && more) CACHE = (unsigned)std::max(0, atoi(argv[++k]));
+        else if (!strcmp(argv[k], "--cobs")) COBS = true;
+        else if (!strcmp(argv[k], "--two-frames")) TWO_FRAMES = true;
+        else if (!strcmp(argv[k], "--devices") && more) devices = (unsigned)std::max(1, atoi(argv[++k]));
+        else if (!strcmp(argv[k], "--partitioned")) pool_mode = PoolMode::partitioned;
+        else if (!strcmp(argv[k], "--reply-wait") && more) REPLY_WAIT_MS = (unsigned)std::max(0, atoi(argv[++k]));
+        else if (!strcmp(argv[k], "--histogram")) histogram = true;
+        else if (!strcmp(argv[k], "--replay") && more) replay = argv[++k];
+        else if (!strcmp(argv[k], "--paced")) paced = true;
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", argv[k]);
+            return -1;
+        }
+    }
+
+    if (serial)
+    {
+        if (threads > 1 || PIPELINE || replay)
+        {
+            fprintf(stderr, "--serial is one client: no --threads, --pipeline or --replay\n");
+            return -1;
+        }
+        cli_use_serial(serial, baud);
+        SERIAL_LINE = true;
+    }
+
+    if (replay) return run_replay(replay, HOST, PORT, paced);
+
+    KEY_TOTAL = std::max(1u, std::min(KEY_TOTAL, KEY_COUNT));
+
+    if (CACHE && !PIPELINE)
+    {
+        fprintf(stderr, "--cache needs --pipeline\n");
+        return -1;
+    }
+
+    if (devices && (!PIPELINE || CACHE || serial))
+    {
+        fprintf(stderr, "--devices needs --pipeline, and no --cache or --serial\n");
+        return -1;
+    }
+
+    for (unsigned op = 0; op < OP_COUNT; op++)
+    {
+        if (PIPELINE && WEIGHT[op] && !OPS[op].submit)
+        {
+            fprintf(stderr, "%s is not available with --pipeline\n", OPS[op].name);
+            return -1;
+        }
+        if (devices && WEIGHT[op] && !OPS[op].pooled)
+        {
+            fprintf(stderr, "%s is not available with --devices\n", OPS[op].name);
+            return -1;
+        }
+    }
+
+    if (devices)
+    {
+        POOL.reset(new ekey_pool_type(pool_mode, devices));
+        if (POOL->discover(HOST, PORT, devices, PIPELINE) != devices || !prepare_pool())
+        {
+            fprintf(stderr, "Cannot connect to %u EKeys at %s:%u and up, or they do not accept the keys\n", devices, HOST, PORT);
+            return -1;
+        }
+    }
+    else if (!prepare_device())
+    {
+        if (serial) fprintf(stderr, "Cannot open EKey at %s, or it does not accept the keys\n", serial);
+        else fprintf(stderr, "Cannot connect to EKey at %s:%u, or it does not accept the keys\n", HOST, PORT);
+        return -1;
+    }
+
+    std::vector<std::vector<op_stats_type>> stats(threads, std::vector<op_stats_type>(OP_COUNT));
+    std::unique_ptr<bool[]> connected(new bool[threads]());
+    std::vector<std::thread> workers;
+    std::atomic<bool> go(false);
+
+    const auto start = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);     // time to connect
+    const auto until = start + std::chrono::microseconds((long long)(seconds * 1e6));
+    for (unsigned t = 0; t < threads; t++)
+        workers.emplace_back(PIPELINE ? run_pipelined_worker : run_worker, 1000 + t, until, std::cref(go), stats[t].data(), &connected[t]);
+
+    std::this_thread::sleep_until(start);
+    go = true;
+    for (auto& w : workers) w.join();
+
+    for (unsigned t = 0; t < threads; t++)
+    {
+        if (!connected[t])
+        {
+            fprintf(stderr, "Client %u could not connect\n", t);
+            return -1;
+        }
+    }
+
+    op_stats_type all;
+    for (unsigned op = 0; op < OP_COUNT; op++)
+    {
+        if (!WEIGHT[op]) continue;
+
+        op_stats_type S;
+        for (unsigned t = 0; t < threads; t++)
+        {
+            S.Latency.merge(stats[t][op].Latency);
+            S.Nak += stats[t][op].Nak;
+            S.Failed += stats[t][op].Failed;
+        }
+        print_stats(OPS[op].name, S, seconds, histogram);
+
+        all.Latency.merge(S.Latency);
+        all.Nak += S.Nak;
+        all.Failed += S.Failed;
+    }
+    print_stats("all", all, seconds, histogram);
+
+    if (POOL)
+    {
+        for (const auto& D : POOL->stats())
+        {
+            printf("{\"device\":\"%s\",\"connected\":%s,\"sent\":%llu,\"stolen\":%llu,\"failed\":%llu}\n", D.Name.c_str(),
+                   D.Connected ? "true" : "false", (unsigned long long)D.Sent, (unsigned long long)D.Stolen, (unsigned long long)D.Failed);
+        }
+        POOL.reset();
+    }
+
+    if (CACHE)
+    {
+        printf("{\"cache\":%u,\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,\"invalidations\":%llu}\n", CACHE,
+               (unsigned long long)CACHE_STATS.hits, (unsigned long long)CACHE_STATS.misses,
+               (unsigned long long)CACHE_STATS.evictions, (unsigned long long)CACHE_STATS.invalidations);
+    }
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+
+// log-linear histogram of nanoseconds: 32 buckets per power of 2
+class latency_histogram_type
+{
+public:
+    static constexpr unsigned SUB_BITS = 5;
+    static constexpr unsigned SUB_COUNT = 1 << SUB_BITS;
+    static constexpr unsigned BUCKETS = (64 - SUB_BITS) * SUB_COUNT + SUB_COUNT;
+
+    void add(uint64_t ns)
+    {
+        Count[bucket(ns)]++;
+        Total++;
+        if (ns > Max) Max = ns;
+    }
+
+    void merge(const latency_histogram_type& other)
+    {
+        for (unsigned k = 0; k < BUCKETS; k++) Count[k] += other.Count[k];
+        Total += other.Total;
+        Max = std::max(Max, other.Max);
+    }
+
+    uint64_t total() const { return Total; }
+    uint64_t max() const { return Max; }
+
+    // q in 0..1
+    uint64_t percentile(double q) const
+    {
+        if (!Total) return 0;
+        const uint64_t rank = (uint64_t)(q * (double)(Total - 1)) + 1;
+        uint64_t seen = 0;
+        for (unsigned k = 0; k < BUCKETS; k++)
+        {
+            seen += Count[k];
+            if (seen >= rank) return std::min(upper(k), Max);
+        }
+        return Max;
+    }
+
+    static unsigned bucket(uint64_t ns)
+    {
+        if (ns < SUB_COUNT) return (unsigned)ns;
+        unsigned msb = 63;
+        while (!(ns >> msb)) msb--;
+        const unsigned shift = msb - SUB_BITS;
+        return shift * SUB_COUNT + (unsigned)(ns >> shift);
+    }
+
+    static uint64_t upper(unsigned idx)
+    {
+        if (idx < 2 * SUB_COUNT) return idx;
+        const unsigned shift = idx / SUB_COUNT - 1;
+        return (((uint64_t)(idx % SUB_COUNT + SUB_COUNT) + 1) << shift) - 1;
+    }
+
+    uint64_t count_at(unsigned idx) const { return Count[idx]; }
+
+private:
+    uint64_t Count[BUCKETS] = {};
+    uint64_t Total = 0;
+    uint64_t Max = 0;
+};
@@ -0,0 +1,208 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <chrono>
+#include <future>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include <SKLib/sklib.hpp>
+#include "replay.h"
+#include "latency_histogram.h"
+#include "../ekey-model/capture.h"
+#include "../ekey-model/emulation_socket.h"
+
+static constexpr int CONNECT_WAIT_MS = 2000;
+static constexpr int REPLY_WAIT_MS = 2000;      // from the last byte of the request to the complete reply
+
+// requests to the device, then what it answered
+struct replay_frame_type
+{
+    std::vector<uint64_t> SendAt_us;                // per request record
+    std::vector<std::vector<uint8_t>> Requests;
+    std::vector<uint8_t> Reply;
+    uint64_t Recorded_us = 0;
+};
+
+struct replay_connection_type
+{
+    uint32_t Id = 0;
+    uint64_t Opened_us = 0;
+    uint64_t Closed_us = 0;                         // last record
+    std::vector<replay_frame_type> Frames;
+    std::vector<unsigned> After;                    // connections that closed before this one opened
+};
+
+struct replay_result_type
+{
+    unsigned RequestBytes;
+    unsigned ReplyBytes;
+    uint64_t Recorded_us;
+    uint64_t Replay_ns;
+    bool Complete;          // all reply bytes have arrived
+    bool Match;
+};
+
+static std::vector<replay_connection_type> split_connections(const std::vector<CaptureRecord>& records)
+{
+    std::map<uint32_t, replay_connection_type> C;
+    std::map<uint32_t, uint64_t> last_request_us;
+
+    for (const auto& R : records)
+    {
+        auto it = C.find(R.Connection);
+        if (it == C.end())      // connection starts with its first record, "opened" or not
+        {
+            it = C.emplace(R.Connection, replay_connection_type()).first;
+            it->second.Id = R.Connection;
+            it->second.Opened_us = R.Time_us;
+        }
+        auto& T = it->second;
+        T.Closed_us = R.Time_us;
+
+        if (R.Kind == CaptureKind::to_device)
+        {
+            if (T.Frames.empty() || !T.Frames.back().Reply.empty()) T.Frames.emplace_back();
+            T.Frames.back().SendAt_us.push_back(R.Time_us);
+            T.Frames.back().Requests.push_back(R.Data);
+            last_request_us[R.Connection] = R.Time_us;
+        }
+        else if (R.Kind == CaptureKind::from_device && !T.Frames.empty())     // nothing is answered before the first request
+        {
+            auto& F = T.Frames.back();
+            F.Reply.insert(F.Reply.end(), R.Data.begin(), R.Data.end());
+            F.Recorded_us = R.Time_us - last_request_us[R.Connection];
+        }
+    }
+
+    std::vector<replay_connection_type> result;
+    for (auto& c : C) result.push_back(std::move(c.second));
+
+    for (auto& T : result)
+        for (unsigned k = 0; k < (unsigned)result.size(); k++)
+            if (result[k].Closed_us <= T.Opened_us && &result[k] != &T) T.After.push_back(k);
+
+    return result;
+}
+
+// as fast as possible, the connection still waits for the ones that were closed before it was opened
+static void replay_connection(const replay_connection_type& T, const char* host, unsigned port, bool paced,
+                              std::chrono::steady_clock::time_point start, std::vector<replay_result_type>* results,
+                              const std::vector<std::shared_future<void>>* finished)
+{
+    const auto at = [start](uint64_t us) { return start + std::chrono::microseconds(us); };
+
+    std::this_thread::sleep_until(at(paced ? T.Opened_us : 0));
+    if (!paced) for (unsigned k : T.After) (*finished)[k].wait();
+
+    socket_stream_type S;
+    if (!S.connect(host, port, CONNECT_WAIT_MS)) return;
+
+    std::vector<uint8_t> reply;
+    for (const auto& F : T.Frames)
+    {
+        replay_result_type R = { 0, (unsigned)F.Reply.size(), F.Recorded_us, 0, true, true };
+
+        for (unsigned k = 0; k < (unsigned)F.Requests.size(); k++)
+        {
+            if (paced) std::this_thread::sleep_until(at(F.SendAt_us[k]));
+            S.write(F.Requests[k].data(), (unsigned)F.Requests[k].size());
+            R.RequestBytes += (unsigned)F.Requests[k].size();
+        }
+
+        const auto sent = std::chrono::steady_clock::now();
+        const auto until = sent + std::chrono::milliseconds(REPLY_WAIT_MS);
+        auto last = sent;
+
+        reply.clear();
+        while (reply.size() < F.Reply.size() && std::chrono::steady_clock::now() < until)
+        {
+            uint8_t c = 0;
+            if (!S.read(c, READ_DELAY_MS))
+            {
+                if (!S.is_connected()) break;
+                continue;
+            }
+            reply.push_back(c);
+            last = std::chrono::steady_clock::now();
+        }
+
+        R.Replay_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(last - sent).count();
+        R.Complete = (reply.size() == F.Reply.size());
+        R.Match = R.Complete && reply == F.Reply;
+        results->push_back(R);
+
+        if (!R.Complete) break;     // the rest of the connection would be out of step
+    }
+}
+
+int run_replay(const char* path, const char* host, unsigned port, bool paced)
+{
+    std::vector<CaptureRecord> records;
+    if (!capture_load(path, records))
+    {
+        fprintf(stderr, "Cannot read capture %s\n", path);
+        return -1;
+    }
+
+    const auto connections = split_connections(records);
+    std::vector<std::vector<replay_result_type>> results(connections.size());
+    std::vector<std::thread> threads;
+
+    std::vector<std::promise<void>> done(connections.size());
+    std::vector<std::shared_future<void>> finished;
+    for (auto& d : done) finished.push_back(d.get_future().share());
+
+    const auto start = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+    for (unsigned k = 0; k < (unsigned)connections.size(); k++)
+    {
+        threads.emplace_back([&, k]()
+        {
+            replay_connection(connections[k], host, port, paced, start, &results[k], &finished);
+            done[k].set_value();
+        });
+    }
+    for (auto& t : threads) t.join();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    latency_histogram_type Recorded, Replayed;
+    unsigned frames = 0, mismatch = 0, incomplete = 0, lost = 0;
+
+    for (unsigned c = 0; c < (unsigned)connections.size(); c++)
+    {
+        lost += (unsigned)(connections[c].Frames.size() - results[c].size());
+
+        for (unsigned f = 0; f < (unsigned)results[c].size(); f++)
+        {
+            const auto& R = results[c][f];
+            printf("{\"connection\":%u,\"frame\":%u,\"request_bytes\":%u,\"reply_bytes\":%u,\"recorded_us\":%llu,\"replay_us\":%.2f,\"match\":%s}\n",
+                   connections[c].Id, f, R.RequestBytes, R.ReplyBytes, (unsigned long long)R.Recorded_us, R.Replay_ns / 1e3,
+                   R.Match ? "true" : (R.Complete ? "false" : "\"incomplete\""));
+
+            frames++;
+            if (!R.Match) mismatch++;
+            if (!R.Complete) incomplete++;
+            if (R.ReplyBytes)
+            {
+                Recorded.add(R.Recorded_us * 1000);
+                Replayed.add(R.Replay_ns);
+            }
+        }
+    }
+
+    printf("{\"replay\":\"%s\",\"paced\":%s,\"connections\":%u,\"frames\":%u,\"mismatch\":%u,\"incomplete\":%u,\"not_sent\":%u,\"seconds\":%.3f,"
+           "\"recorded_p50_us\":%.2f,\"recorded_p99_us\":%.2f,\"replay_p50_us\":%.2f,\"replay_p99_us\":%.2f,\"replay_max_us\":%.2f}\n",
+           path, paced ? "true" : "false", (unsigned)connections.size(), frames, mismatch, incomplete, lost, seconds,
+           Recorded.percentile(0.50) / 1e3, Recorded.percentile(0.99) / 1e3,
+           Replayed.percentile(0.50) / 1e3, Replayed.percentile(0.99) / 1e3, Replayed.max() / 1e3);
+
+    return (incomplete || lost) ? 1 : 0;
+}
@@ -0,0 +1,21 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// ekey-bench --replay FILE: sends the frames of a capture (see ekey-model/capture.h) to the emulator again.
+// Every recorded connection gets its own connection and thread. Requests go out as fast as possible, or with
+// the recorded pauses (paced); after the requests the replay waits for as many bytes as the device answered.
+//
+// Output is one JSON line per frame: connection, frame number, request and reply bytes, recorded and replayed
+// time from the last request byte to the last reply byte, and whether the reply is the same as recorded;
+// then the summary. Replies match only if the emulator starts from the same state (--store image, --noise-seed).
+
+#pragma once
+
+// returns exit code of the program
+int run_replay(const char* path, const char* host, unsigned port, bool paced);
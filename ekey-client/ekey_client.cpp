@@ -0,0 +1,387 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <SKLib/sklib.hpp>
+#include "ekey_client.h"
+
+static constexpr int CONNECT_WAIT_MS = 2000;
+
+// longest frame on the line: requests and answers are below REPLY_MAX, plus COBS, request ID, CRC, delimiter
+static constexpr unsigned LINE_FRAME_MAX = ekey_client_type::REPLY_MAX + ekey_client_type::REPLY_MAX / 254 + 8;
+static constexpr unsigned LINE_BITS_PER_BYTE = 10;     // start, 8 data, stop
+
+static uint8_t code_of(KeyFunction f) { return (uint8_t)f; }
+
+// client that the Interface functions of this thread work with: the caller, while it holds SendLock
+// or while it connects, and the receiving thread, all its life
+static thread_local ekey_client_type* BOUND = nullptr;
+
+bool ekey_client_type::bridge_getbyte(int& ch)
+{
+    uint8_t c = 0;
+    ekey_client_type* C = BOUND;
+    if (!(C->Serial.is_open() ? C->Serial.read(c, READ_DELAY_MS) : C->Socket.read(c, READ_DELAY_MS))) return false;
+    ch = c;
+    return true;
+}
+
+bool ekey_client_type::bridge_getchar(int& ch)
+{
+    if (!bridge_getbyte(ch)) return false;
+    if (ch < ' ' || ch > '~') ch = EOF;    // the emulator ends the frame with (uint8_t)EOF
+    return true;
+}
+
+void ekey_client_type::bridge_putchar(int ch)
+{
+    BOUND->OutBuffer.push_back((ch < 0) ? '\n' : (uint8_t)ch);
+}
+
+void ekey_client_type::bridge_flush()
+{
+    ekey_client_type* C = BOUND;
+    if (C->Serial.is_open()) C->Serial.write(C->OutBuffer.data(), (unsigned)C->OutBuffer.size());
+    else C->Socket.write(C->OutBuffer.data(), (unsigned)C->OutBuffer.size());
+    C->OutBuffer.clear();
+}
+
+// -------------------------------------------------------------
+
+ekey_client_type::ekey_client_type()
+    : Output(bridge_getchar, bridge_putchar, bridge_flush, bridge_getbyte)
+    , Input(bridge_getchar, bridge_putchar, bridge_flush, bridge_getbyte)
+    , Running(false)
+{}
+
+unsigned ekey_client_type::line_timeout_ms(unsigned baud, unsigned in_flight)
+{
+    const uint64_t bits = (uint64_t)std::max(1u, in_flight) * 2 * LINE_FRAME_MAX * LINE_BITS_PER_BYTE;
+    return REPLY_TIMEOUT_MS + (unsigned)(bits * 1000 / std::max(1u, baud));
+}
+
+bool ekey_client_type::connect(const char* host, unsigned port, unsigned in_flight, unsigned reply_timeout_ms)
+{
+    close();
+    if (!Socket.connect(host, port, CONNECT_WAIT_MS)) return false;
+    return start(in_flight, reply_timeout_ms ? reply_timeout_ms : REPLY_TIMEOUT_MS);
+}
+
+bool ekey_client_type::connect_serial(const char* path, unsigned baud, unsigned in_flight, unsigned reply_timeout_ms)
+{
+    close();
+    if (!Serial.open(path, baud)) return false;
+    return start(in_flight, reply_timeout_ms ? reply_timeout_ms : line_timeout_ms(baud, in_flight));
+}
+
+bool ekey_client_type::start(unsigned in_flight, unsigned reply_timeout_ms)
+{
+    // the new connection is in base64, untagged
+    for (Interface* I : { &Output, &Input })
+    {
+        I->set_frame_mode(FrameMode::base64);
+        I->set_tagged(false);
+    }
+    OutBuffer.clear();
+
+    BOUND = this;
+    const uint8_t command[2] = { (uint8_t)KeyFunction::set_framing, (uint8_t)FrameMode::cobs | FRAME_TAGGED };
+    Output.write_output(command, sizeof(command));
+    const bool accepted = (Input.read_input_wait(InBuffer, 1) == 1 && InBuffer[0] == (uint8_t)KeyResponse::ACK);
+    BOUND = nullptr;
+
+    if (!accepted)
+    {
+        Socket.close();
+        Serial.close();
+        return false;
+    }
+
+    for (Interface* I : { &Output, &Input })
+    {
+        I->set_frame_mode(FrameMode::cobs);
+        I->set_tagged(true);
+    }
+
+    Limit = std::max(1u, std::min(in_flight, MAX_IN_FLIGHT));
+    ReplyTimeout = std::chrono::milliseconds(reply_timeout_ms);
+    InFlight = 0;
+    Running = true;
+    Receiver = std::thread([this]() { receive_loop(); });
+    return true;
+}
+
+void ekey_client_type::set_cache(unsigned entries)
+{
+    Cache.reset(entries ? new exchange_cache_type(entries) : nullptr);
+}
+
+ExchangeCacheStats ekey_client_type::cache_stats()
+{
+    return Cache ? Cache->stats() : ExchangeCacheStats();
+}
+
+void ekey_client_type::close()
+{
+    if (Receiver.joinable())
+    {
+        if (Serial.is_open() && Running)
+        {
+            const uint8_t code = code_of(KeyFunction::set_framing);
+            const uint8_t mode = (uint8_t)FrameMode::base64;
+            submit(ReplyKind::ack, &code, &mode, 1).wait_for(ReplyTimeout);
+        }
+
+        Running = false;
+        Socket.shutdown();      // wakes the receiving thread; on the serial port, it sees Running in READ_DELAY_MS
+        Receiver.join();
+    }
+    Socket.close();
+    Serial.close();
+    fail_all();
+}
+
+// -------------------------------------------------------------
+
+std::future<ClientReply> ekey_client_type::submit(ReplyKind kind, const uint8_t* command, const uint8_t* data, unsigned length, CacheUse cache)
+{
+    std::unique_lock<std::mutex> L(PendingLock);
+    Room.wait(L, [this]() { return InFlight < Limit || !Running; });
+
+    if (!Running)
+    {
+        std::promise<ClientReply> failed;
+        failed.set_value(ClientReply());
+        return failed.get_future();
+    }
+
+    while (Pending[NextTag].Active || Pending[NextTag].Sending) NextTag++;     // there are free IDs, Limit < 256
+    const uint8_t tag = NextTag++;
+
+    PendingRequest& P = Pending[tag];
+    P.Active = true;
+    P.Sending = true;
+    P.Kind = kind;
+    P.Promise = std::promise<ClientReply>();
+    P.Cached = false;
+    auto R = P.Promise.get_future();
+    InFlight++;
+    L.unlock();
+
+    // opcode and parameters in one frame
+    std::lock_guard<std::mutex> S(SendLock);
+
+    // epoch changes in the order the requests go out
+    if (Cache && cache == CacheUse::invalidate) Cache->invalidate();
+    if (Cache && cache == CacheUse::store)
+    {
+        std::lock_guard<std::mutex> C(PendingLock);
+        P.Cached = true;
+        P.Epoch = Cache->epoch();
+        memcpy(P.Pattern, data, KEY_SIZE);
+    }
+
+    BOUND = this;
+    Output.set_output_tag(tag);
+    if (command)
+    {
+        Frame.assign(1, *command);
+        Frame.insert(Frame.end(), data, data + length);
+        Output.write_output(Frame.data(), (unsigned)Frame.size());
+    }
+    else
+    {
+        Output.write_output(data, length);
+    }
+    BOUND = nullptr;
+
+    // the time waiting for SendLock is not counted; the answer may have come already
+    std::lock_guard<std::mutex> C(PendingLock);
+    P.Sent = std::chrono::steady_clock::now();
+    P.Sending = false;
+    return R;
+}
+
+void ekey_client_type::complete(uint8_t tag, const uint8_t* data, unsigned length)
+{
+    ClientReply R;
+    if (length == 1 && data[0] == (uint8_t)KeyResponse::NAK)
+    {
+        R.Status = ReplyStatus::nak;
+    }
+    else
+    {
+        R.Status = ReplyStatus::ack;
+        R.Data.assign(data, data + length);
+    }
+
+    std::unique_lock<std::mutex> L(PendingLock);
+    PendingRequest& P = Pending[tag];
+    if (!P.Active) return;      // late answer, the request has expired
+
+    if (P.Kind == ReplyKind::ack && R.Status == ReplyStatus::ack)
+    {
+        if (length != 1 || data[0] != (uint8_t)KeyResponse::ACK) R.Status = ReplyStatus::failed;
+        R.Data.clear();
+    }
+
+    if (P.Cached && Cache && (R.Status == ReplyStatus::nak || R.Data.size() == KEY_SIZE)) Cache->store(P.Pattern, R.Data.data(), (unsigned)R.Data.size(), P.Epoch);    // NAK is stored empty
+
+    P.Active = false;
+    InFlight--;
+    auto promise = std::move(P.Promise);
+    L.unlock();
+
+    promise.set_value(std::move(R));
+    Room.notify_one();
+}
+
+void ekey_client_type::expire_overdue()
+{
+    const auto now = std::chrono::steady_clock::now();
+    std::vector<std::promise<ClientReply>> expired;
+
+    {
+        std::lock_guard<std::mutex> L(PendingLock);
+        for (auto& P : Pending)
+        {
+            if (!P.Active || P.Sending || now - P.Sent < ReplyTimeout) continue;
+            P.Active = false;
+            InFlight--;
+            expired.push_back(std::move(P.Promise));
+        }
+    }
+
+    for (auto& promise : expired) promise.set_value(ClientReply());
+    if (!expired.empty()) Room.notify_all();
+}
+
+void ekey_client_type::fail_all()
+{
+    std::vector<std::promise<ClientReply>> failed;
+
+    {
+        std::lock_guard<std::mutex> L(PendingLock);
+        Running = false;
+        for (auto& P : Pending)
+        {
+            if (!P.Active) continue;
+            P.Active = false;
+            failed.push_back(std::move(P.Promise));
+        }
+        InFlight = 0;
+    }
+
+    for (auto& promise : failed) promise.set_value(ClientReply());
+    Room.notify_all();
+}
+
+void ekey_client_type::receive_loop()
+{
+    BOUND = this;
+
+    while (Running)
+    {
+        const auto L = Input.read_input_variable(InBuffer, REPLY_MAX);
+        if (L)
+        {
+            complete(Input.get_input_tag(), InBuffer, L);
+            continue;
+        }
+
+        if (!Serial.is_open() && !Socket.is_connected()) break;
+        expire_overdue();
+    }
+
+    fail_all();
+}
+
+// -------------------------------------------------------------
+
+std::future<ClientReply> ekey_client_type::exchange(const uint8_t* pattern)
+{
+    ClientReply R;
+    if (Cache && Cache->find(pattern, R.Data))
+    {
+        R.Status = R.Data.empty() ? ReplyStatus::nak : ReplyStatus::ack;
+        std::promise<ClientReply> cached;
+        cached.set_value(std::move(R));
+        return cached.get_future();
+    }
+
+    return submit(ReplyKind::data, nullptr, pattern, KEY_SIZE, CacheUse::store);
+}
+
+std::future<ClientReply> ekey_client_type::exchange_batch(const uint8_t* patterns, unsigned count)
+{
+    std::vector<uint8_t> packet(1 + count * KEY_SIZE);
+    packet[0] = (uint8_t)count;
+    memcpy(packet.data() + 1, patterns, count * KEY_SIZE);
+
+    const uint8_t code = code_of(KeyFunction::exchange_batch);
+    return submit(ReplyKind::data, &code, packet.data(), (unsigned)packet.size());
+}
+
+std::future<ClientReply> ekey_client_type::prime(const uint8_t* permutation)
+{
+    const uint8_t code = code_of(KeyFunction::prime_keys);
+    return submit(ReplyKind::ack, &code, permutation, KEY_SIZE, CacheUse::invalidate);
+}
+
+std::future<ClientReply> ekey_client_type::write_key(unsigned idx, const uint8_t* key, const uint8_t* payload)
+{
+    uint8_t packet[KEY_ADDR_SIZE + 2*KEY_SIZE];
+    for (unsigned k = 0; k < KEY_ADDR_SIZE; k++) packet[k] = (uint8_t)(idx >> 8*(KEY_ADDR_SIZE - 1 - k));
+    memcpy(packet + KEY_ADDR_SIZE, key, KEY_SIZE);
+    memcpy(packet + KEY_ADDR_SIZE + KEY_SIZE, payload, KEY_SIZE);
+
+    const uint8_t code = code_of(KeyFunction::write_key);
+    return submit(ReplyKind::ack, &code, packet, sizeof(packet), CacheUse::invalidate);
+}
+
+std::future<ClientReply> ekey_client_type::erase()
+{
+    const uint8_t code = code_of(KeyFunction::erase_keys);
+    return submit(ReplyKind::ack, &code, nullptr, 0, CacheUse::invalidate);
+}
+
+std::future<ClientReply> ekey_client_type::noise()
+{
+    const uint8_t code = code_of(KeyFunction::get_noise);
+    return submit(ReplyKind::data, &code, nullptr, 0);
+}
+
+std::future<ClientReply> ekey_client_type::get_record(unsigned address)
+{
+    const uint8_t packet[RECORD_ADDR_SIZE] = { (uint8_t)(address >> 8), (uint8_t)address };
+    const uint8_t code = code_of(KeyFunction::get_record);
+    return submit(ReplyKind::data, &code, packet, RECORD_ADDR_SIZE);
+}
+
+std::future<ClientReply> ekey_client_type::put_record(unsigned address, const uint8_t* block)
+{
+    std::vector<uint8_t> packet(RECORD_ADDR_SIZE + BLOCK_SIZE);
+    packet[0] = (uint8_t)(address >> 8);
+    packet[1] = (uint8_t)address;
+    memcpy(packet.data() + RECORD_ADDR_SIZE, block, BLOCK_SIZE);
+
+    const uint8_t code = code_of(KeyFunction::put_record);
+    return submit(ReplyKind::ack, &code, packet.data(), (unsigned)packet.size());
+}
+
+std::future<ClientReply> ekey_client_type::sync_records()
+{
+    const uint8_t code = code_of(KeyFunction::sync_records);
+    return submit(ReplyKind::ack, &code, nullptr, 0);
+}
+
+std::future<ClientReply> ekey_client_type::status()
+{
+    const uint8_t code = code_of(KeyFunction::get_status);
+    return submit(ReplyKind::data, &code, nullptr, 0);
+}
@@ -0,0 +1,141 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// Host side client of EKey: one connection, several requests in flight.
+// Every call sends the request and returns std::future of the answer at once; any thread may call.
+// The connection uses COBS framing with request IDs (FRAME_TAGGED), the receiving thread of the client
+// matches every answer to its request by the ID. Requests are answered in the order they are sent,
+// the IDs guard against lost or late answers: request without answer in the reply timeout fails. The timeout
+// counts from the moment the request is written, and it is given to connect: the requests in flight are
+// answered one after another, on a slow line the last of them waits for all the others.
+// When in_flight requests wait for answers, the next call blocks until one of them is answered.
+// Record ranges (several answers to one request) are not supported here.
+// Optional cache of exchange answers (set_cache): repeated patterns are answered without the request,
+// until this client changes the key table, see exchange_cache.h.
+// The connection is TCP to the emulator, or the serial port of the device (connect_serial); the serial line
+// keeps the framing between clients, so close() sets base64 back for the next one.
+// Several devices at once: ekey_pool_type, see ekey_pool.h.
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../ekey-model/interface.h"
+#include "../ekey-model/emulation_socket.h"
+#include "../ekey-model/serial_port.h"
+#include "exchange_cache.h"
+
+enum class ReplyStatus { ack, nak, failed };
+
+struct ClientReply
+{
+    ReplyStatus Status = ReplyStatus::failed;
+    std::vector<uint8_t> Data;      // answer of the commands that return data; empty for ACK/NAK
+};
+
+class ekey_client_type
+{
+public:
+    static constexpr unsigned MAX_IN_FLIGHT = 128;      // request ID is 1 byte
+    static constexpr unsigned REPLY_TIMEOUT_MS = 2000;   // default, and the least
+    static constexpr unsigned REPLY_MAX = 1536;         // longest answer, not including CRC
+
+    ekey_client_type();
+    ~ekey_client_type() { close(); }
+
+    ekey_client_type(const ekey_client_type&) = delete;
+    ekey_client_type& operator=(const ekey_client_type&) = delete;
+
+    // connects, switches the connection to COBS with request IDs, starts the receiving thread;
+    // reply_timeout_ms 0 is REPLY_TIMEOUT_MS over TCP, and line_timeout_ms() on the serial port
+    bool connect(const char* host, unsigned port = SOCKET_EKEY_PORT, unsigned in_flight = 16, unsigned reply_timeout_ms = 0);
+    bool connect_serial(const char* path, unsigned baud = SERIAL_SPEED, unsigned in_flight = 16, unsigned reply_timeout_ms = 0);
+
+    // enough for in_flight longest requests and answers at baud, plus REPLY_TIMEOUT_MS
+    static unsigned line_timeout_ms(unsigned baud, unsigned in_flight);
+
+    // requests that wait for answers fail
+    void close();
+    bool is_connected() const { return Running; }
+
+    // cache of exchange answers, up to entries patterns; 0 turns it off; call before the requests
+    void set_cache(unsigned entries);
+    ExchangeCacheStats cache_stats();
+
+    std::future<ClientReply> exchange(const uint8_t* pattern);
+    std::future<ClientReply> exchange_batch(const uint8_t* patterns, unsigned count);
+    std::future<ClientReply> prime(const uint8_t* permutation);
+    std::future<ClientReply> write_key(unsigned idx, const uint8_t* key, const uint8_t* payload);
+    std::future<ClientReply> erase();
+    std::future<ClientReply> noise();
+    std::future<ClientReply> get_record(unsigned address);
+    std::future<ClientReply> put_record(unsigned address, const uint8_t* block);
+    std::future<ClientReply> sync_records();        // blocks acknowledged by put_record are stored when this is
+    std::future<ClientReply> status();
+
+private:
+    enum class ReplyKind : uint8_t { ack, data };
+    enum class CacheUse : uint8_t { none, store, invalidate };     // answer goes to the cache; command changes the keys
+
+    struct PendingRequest
+    {
+        bool Active = false;
+        bool Sending = false;           // submit has not written it yet: does not expire, ID is not reused
+        ReplyKind Kind = ReplyKind::ack;
+        std::chrono::steady_clock::time_point Sent;
+        std::promise<ClientReply> Promise;
+        bool Cached = false;
+        uint64_t Epoch = 0;
+        uint8_t Pattern[KEY_SIZE];
+    };
+
+    // sets COBS with request IDs on the new connection, starts the receiving thread
+    bool start(unsigned in_flight, unsigned reply_timeout_ms);
+
+    // command code (none for exchange) and the parameters, if any, go in one frame
+    std::future<ClientReply> submit(ReplyKind kind, const uint8_t* command, const uint8_t* data, unsigned length, CacheUse cache = CacheUse::none);
+    void complete(uint8_t tag, const uint8_t* data, unsigned length);
+    void expire_overdue();
+    void fail_all();
+    void receive_loop();
+
+    // Interface takes plain functions; they reach the client of the calling thread
+    static bool bridge_getchar(int& ch);
+    static bool bridge_getbyte(int& ch);
+    static void bridge_putchar(int ch);
+    static void bridge_flush();
+
+    socket_stream_type Socket;
+    serial_port_type Serial;            // instead of Socket, when open
+    Interface Output;                   // callers, under SendLock
+    Interface Input;                    // receiving thread
+    std::vector<uint8_t> OutBuffer;     // frame being sent
+    std::vector<uint8_t> Frame;         // opcode and parameters, under SendLock
+    std::mutex SendLock;
+
+    std::mutex PendingLock;
+    std::condition_variable Room;       // signals when a request is answered
+    PendingRequest Pending[256];        // by request ID
+    unsigned InFlight = 0;
+    unsigned Limit = 16;
+    std::chrono::milliseconds ReplyTimeout{ REPLY_TIMEOUT_MS };
+    uint8_t NextTag = 0;
+
+    std::unique_ptr<exchange_cache_type> Cache;
+
+    std::atomic<bool> Running;
+    std::thread Receiver;
+    uint8_t InBuffer[Interface::read_buffer_size(REPLY_MAX)];
+};
@@ -0,0 +1,532 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <algorithm>
+
+#include <SKLib/sklib.hpp>
+#include "ekey_pool.h"
+
+static std::future<ClientReply> refused()
+{
+    std::promise<ClientReply> failed;
+    failed.set_value(ClientReply());
+    return failed.get_future();
+}
+
+ekey_pool_type::ekey_pool_type(PoolMode mode, unsigned partitions)
+    : Mode(mode)
+    , Partitions((mode == PoolMode::partitioned) ? std::max(1u, partitions) : 0)
+{}
+
+bool ekey_pool_type::add(const char* host, unsigned port, unsigned in_flight, unsigned share)
+{
+    std::unique_ptr<Device> D(new Device);
+    if (!D->Client.connect(host, port, in_flight)) return false;
+    D->Stats.Name = std::string(host) + ":" + std::to_string(port);
+    return start(std::move(D), share);
+}
+
+bool ekey_pool_type::add_serial(const char* path, unsigned baud, unsigned in_flight, unsigned share)
+{
+    std::unique_ptr<Device> D(new Device);
+    if (!D->Client.connect_serial(path, baud, in_flight)) return false;
+    D->Stats.Name = path;
+    return start(std::move(D), share);
+}
+
+unsigned ekey_pool_type::discover(const char* host, unsigned first_port, unsigned count, unsigned in_flight)
+{
+    if (Mode == PoolMode::partitioned && count != Partitions) return 0;
+
+    unsigned added = 0;
+    for (unsigned k = 0; k < count; k++) if (add(host, first_port + k, in_flight, k)) added++;
+    return added;
+}
+
+unsigned ekey_pool_type::discover_serial(unsigned baud, unsigned in_flight)
+{
+    if (Mode == PoolMode::partitioned) return 0;
+
+    std::vector<std::string> paths;
+    serial_port_type::find_devices(USB_VID, USB_PID, paths);
+
+    unsigned added = 0;
+    for (const auto& path : paths) if (add_serial(path.c_str(), baud, in_flight)) added++;
+    return added;
+}
+
+// partitioned: the devices are kept in the order of their shares
+bool ekey_pool_type::start(std::unique_ptr<Device> D, unsigned share)
+{
+    Device& R = *D;
+    {
+        std::lock_guard<std::mutex> L(Lock);     // sending threads of the others look for work to steal
+        auto at = Devices.end();
+        if (Mode == PoolMode::partitioned)
+        {
+            if (share >= Partitions) return false;
+            at = std::lower_bound(Devices.begin(), Devices.end(), share, [](const std::unique_ptr<Device>& E, unsigned s) { return E->Share < s; });
+            if (at != Devices.end() && (*at)->Share == share) return false;     // the share has its device
+            R.Share = share;
+        }
+        Devices.insert(at, std::move(D));
+    }
+    R.Sender = std::thread([this, &R]() { send_loop(R); });
+    R.Completer = std::thread([this, &R]() { complete_loop(R); });
+    return true;
+}
+
+void ekey_pool_type::close()
+{
+    {
+        std::lock_guard<std::mutex> L(Lock);
+        Stopping = true;
+    }
+    for (auto& D : Devices) D->Wake.notify_all();
+    for (auto& D : Devices) if (D->Sender.joinable()) D->Sender.join();
+
+    // nobody takes them any more
+    std::vector<Job> left;
+    {
+        std::lock_guard<std::mutex> L(Lock);
+        for (auto& D : Devices)
+        {
+            for (auto& J : D->Queue) left.push_back(std::move(J));
+            D->Queue.clear();
+        }
+    }
+    for (auto& J : left) finish(J, ClientReply());
+
+    for (auto& D : Devices)
+    {
+        {
+            std::lock_guard<std::mutex> F(D->FlightLock);
+            D->Closing = true;
+        }
+        D->FlightReady.notify_all();
+        if (D->Completer.joinable()) D->Completer.join();
+        D->Client.close();
+    }
+
+    Devices.clear();
+    Stopping = false;
+}
+
+bool ekey_pool_type::complete()
+{
+    std::lock_guard<std::mutex> L(Lock);
+    return Mode == PoolMode::partitioned ? Devices.size() == Partitions : !Devices.empty();
+}
+
+std::vector<PoolDeviceStats> ekey_pool_type::stats()
+{
+    std::vector<PoolDeviceStats> R;
+    std::lock_guard<std::mutex> L(Lock);
+    for (auto& D : Devices)
+    {
+        R.push_back(D->Stats);
+        R.back().Connected = D->Client.is_connected();
+    }
+    return R;
+}
+
+// -------------------------------------------------------------
+
+void ekey_pool_type::send_loop(Device& D)
+{
+    while (true)
+    {
+        Job J;
+        std::unique_lock<std::mutex> L(Lock);
+        while (!Stopping && D.Client.is_connected() && !take(D, J))
+        {
+            D.Idle = true;
+            D.Wake.wait(L);
+        }
+        D.Idle = false;
+        if (Stopping) return;
+
+        if (!D.Client.is_connected())
+        {
+            // lookups go to the other devices, the rest fails
+            D.Retired = true;
+            std::vector<Job> failed;
+            std::vector<Device*> woken;
+            for (auto& Q : D.Queue)
+            {
+                Device* T = (Mode == PoolMode::replicated && !Q.Bound) ? least_loaded() : nullptr;
+                if (!T)
+                {
+                    failed.push_back(std::move(Q));
+                    continue;
+                }
+                Device* thief = push(*T, std::move(Q));
+                woken.push_back(T);
+                if (thief) woken.push_back(thief);
+            }
+            D.Queue.clear();
+            L.unlock();
+
+            for (Device* T : woken) T->Wake.notify_one();
+            for (auto& Q : failed) finish(Q, ClientReply());
+            return;
+        }
+        L.unlock();
+
+        auto R = send(D.Client, J);     // waits while there is no room in flight
+        std::lock_guard<std::mutex> F(D.FlightLock);
+        D.Flight.push_back(Sent{ std::move(J), std::move(R) });
+        D.FlightReady.notify_one();
+    }
+}
+
+void ekey_pool_type::complete_loop(Device& D)
+{
+    while (true)
+    {
+        std::unique_lock<std::mutex> F(D.FlightLock);
+        D.FlightReady.wait(F, [&D]() { return D.Closing || !D.Flight.empty(); });
+        if (D.Flight.empty()) return;
+
+        Sent S = std::move(D.Flight.front());
+        D.Flight.pop_front();
+        F.unlock();
+
+        ClientReply R = S.Reply.get();
+        {
+            std::lock_guard<std::mutex> L(Lock);
+            D.Outstanding--;
+            if (R.Status == ReplyStatus::failed) D.Stats.Failed++;
+        }
+        finish(S.Work, std::move(R));
+    }
+}
+
+std::future<ClientReply> ekey_pool_type::send(ekey_client_type& C, const Job& J)
+{
+    const uint8_t* data = J.Data.data();
+    switch (J.Owner->Kind)
+    {
+    case JobKind::exchange:  return C.exchange(data);
+    case JobKind::batch:     return C.exchange_batch(data, J.Count);
+    case JobKind::write_key: return C.write_key(J.Index, data, data + KEY_SIZE);
+    case JobKind::erase:     return C.erase();
+    case JobKind::prime:     return C.prime(data);
+    }
+
+    return refused();
+}
+
+void ekey_pool_type::finish(Job& J, ClientReply&& R)
+{
+    Request& Q = *J.Owner;
+    {
+        std::lock_guard<std::mutex> L(Q.Lock);
+        Q.Parts[J.Part] = std::move(R);
+        if (--Q.Remaining) return;
+    }
+    Q.Promise.set_value(join(Q));
+}
+
+ClientReply ekey_pool_type::join(Request& Q)
+{
+    if (!Q.PartOf.empty())
+    {
+        // partitioned batch: answer k of every part is code, and payload if ACK
+        std::vector<unsigned> pos(Q.Parts.size(), 0);
+        for (auto& P : Q.Parts)
+        {
+            if (P.Status == ReplyStatus::failed) return ClientReply();
+            if (P.Status == ReplyStatus::nak) P.Data.assign(1, (uint8_t)KeyResponse::NAK);     // batch of one, not found
+        }
+
+        ClientReply R;
+        for (unsigned part : Q.PartOf)
+        {
+            const auto& data = Q.Parts[part].Data;
+            unsigned& p = pos[part];
+            if (p >= data.size()) return ClientReply();
+
+            const unsigned L = (data[p] == (uint8_t)KeyResponse::ACK) ? KEY_SIZE + 1 : 1;
+            if (p + L > data.size()) return ClientReply();
+            R.Data.insert(R.Data.end(), data.begin() + p, data.begin() + p + L);
+            p += L;
+        }
+
+        R.Status = ReplyStatus::ack;
+        if (R.Data.size() == 1 && R.Data[0] == (uint8_t)KeyResponse::NAK)
+        {
+            R.Status = ReplyStatus::nak;        // as the device answers the batch of one
+            R.Data.clear();
+        }
+        return R;
+    }
+
+    if (Q.Parts.size() == 1) return std::move(Q.Parts[0]);
+
+    // request to all devices
+    ClientReply R;
+    R.Status = ReplyStatus::ack;
+    for (const auto& P : Q.Parts)
+    {
+        if (P.Status == ReplyStatus::failed) return ClientReply();
+        if (P.Status == ReplyStatus::nak) R.Status = ReplyStatus::nak;
+    }
+    return R;
+}
+
+// -------------------------------------------------------------
+
+ekey_pool_type::Device* ekey_pool_type::least_loaded()
+{
+    Device* best = nullptr;
+    size_t best_load = 0;
+    const size_t N = Devices.size();
+
+    for (size_t k = 0; k < N; k++)
+    {
+        Device& D = *Devices[(Rotor + k) % N];     // ties go around
+        if (D.Retired || !D.Client.is_connected()) continue;
+
+        const size_t load = D.Queue.size() + D.Outstanding;
+        if (best && load >= best_load) continue;
+        best = &D;
+        best_load = load;
+    }
+
+    if (N) Rotor = (Rotor + 1) % N;
+    return best;
+}
+
+bool ekey_pool_type::take(Device& D, Job& J)
+{
+    if (!D.Queue.empty())
+    {
+        J = std::move(D.Queue.front());
+        D.Queue.pop_front();
+    }
+    else
+    {
+        if (Mode != PoolMode::replicated) return false;
+
+        // the longest queue of a busy device; its owner takes from the front, the newest lookup is stolen
+        Device* victim = nullptr;
+        std::deque<Job>::iterator loot;
+        for (auto& V : Devices)
+        {
+            if (V.get() == &D || V->Idle || (victim && V->Queue.size() <= victim->Queue.size())) continue;
+
+            auto it = V->Queue.end();
+            while (it != V->Queue.begin() && (it - 1)->Bound) --it;
+            if (it == V->Queue.begin()) continue;
+
+            victim = V.get();
+            loot = it - 1;
+        }
+        if (!victim) return false;
+
+        J = std::move(*loot);
+        victim->Queue.erase(loot);
+        D.Stats.Stolen++;
+    }
+
+    D.Outstanding++;
+    D.Stats.Sent++;
+    return true;
+}
+
+ekey_pool_type::Device* ekey_pool_type::push(Device& D, Job&& J)
+{
+    const bool stealable = (Mode == PoolMode::replicated && !J.Bound);
+    D.Queue.push_back(std::move(J));
+    if (!stealable || D.Idle) return nullptr;
+
+    // the owner is busy, other device may take it sooner
+    for (auto& T : Devices)
+    {
+        if (T.get() != &D && T->Idle && !T->Retired && T->Client.is_connected()) return T.get();
+    }
+    return nullptr;
+}
+
+void ekey_pool_type::enqueue(Job&& J, Device* D)
+{
+    std::unique_lock<std::mutex> L(Lock);
+    if (!D) D = least_loaded();
+    if (!D || Stopping || D->Retired || !D->Client.is_connected())
+    {
+        L.unlock();
+        finish(J, ClientReply());
+        return;
+    }
+
+    Device* thief = push(*D, std::move(J));
+    L.unlock();
+
+    D->Wake.notify_one();
+    if (thief) thief->Wake.notify_one();
+}
+
+std::shared_ptr<ekey_pool_type::Request> ekey_pool_type::request(JobKind kind, unsigned parts, std::future<ClientReply>& R)
+{
+    auto Q = std::make_shared<Request>();
+    Q->Kind = kind;
+    Q->Remaining = parts;
+    Q->Parts.resize(parts);
+    R = Q->Promise.get_future();
+
+    if (!parts) Q->Promise.set_value(ClientReply());    // no devices
+    return Q;
+}
+
+std::future<ClientReply> ekey_pool_type::to_all(JobKind kind, const uint8_t* data, unsigned length, unsigned index)
+{
+    if (Mode == PoolMode::partitioned && !complete()) return refused();
+
+    std::future<ClientReply> R;
+    auto Q = request(kind, size(), R);
+
+    for (unsigned k = 0; k < size(); k++)
+    {
+        Job J;
+        J.Owner = Q;
+        J.Part = k;
+        J.Bound = true;
+        J.Index = index;
+        J.Data.assign(data, data + length);
+        enqueue(std::move(J), Devices[k].get());
+    }
+    return R;
+}
+
+// -------------------------------------------------------------
+
+uint64_t ekey_pool_type::key_hash(const uint8_t* pattern)
+{
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (unsigned k = 0; k < KEY_SIZE; k++) h = (h ^ pattern[k]) * 0x100000001B3ull;
+    return h;
+}
+
+unsigned ekey_pool_type::device_of(const uint8_t* pattern) const
+{
+    if (Mode != PoolMode::partitioned) return 0;
+    return (unsigned)((key_hash(pattern) >> 32) % Partitions);     // high bits, low ones go to the buckets of exchange_cache_type
+}
+
+std::future<ClientReply> ekey_pool_type::exchange(const uint8_t* pattern)
+{
+    if (Mode == PoolMode::partitioned && !complete()) return refused();
+
+    std::future<ClientReply> R;
+    Job J;
+    J.Owner = request(JobKind::exchange, 1, R);
+    J.Bound = (Mode == PoolMode::partitioned);
+    J.Data.assign(pattern, pattern + KEY_SIZE);
+
+    Device* D = J.Bound ? Devices[device_of(pattern)].get() : nullptr;
+    enqueue(std::move(J), D);
+    return R;
+}
+
+std::future<ClientReply> ekey_pool_type::exchange_batch(const uint8_t* patterns, unsigned count)
+{
+    if (Mode == PoolMode::partitioned && !complete()) return refused();
+
+    std::future<ClientReply> R;
+
+    // whole batch to one device; count 0 asks for the batch size, which is the same on every device
+    if (Mode == PoolMode::replicated || size() < 2 || !count)
+    {
+        Job J;
+        J.Owner = request(JobKind::batch, 1, R);
+        J.Bound = (Mode == PoolMode::partitioned);
+        J.Count = count;
+        J.Data.assign(patterns, patterns + count * KEY_SIZE);
+
+        Device* D = J.Bound ? Devices[0].get() : nullptr;
+        enqueue(std::move(J), D);
+        return R;
+    }
+
+    std::vector<std::vector<unsigned>> of(size());
+    for (unsigned k = 0; k < count; k++) of[device_of(patterns + k * KEY_SIZE)].push_back(k);
+
+    unsigned parts = 0;
+    for (const auto& list : of) if (!list.empty()) parts++;
+
+    auto Q = request(JobKind::batch, parts, R);
+    Q->PartOf.resize(count);
+
+    // all parts are known before the first one is sent
+    std::vector<std::pair<Job, Device*>> jobs;
+    for (unsigned d = 0; d < size(); d++)
+    {
+        if (of[d].empty()) continue;
+
+        Job J;
+        J.Owner = Q;
+        J.Part = (unsigned)jobs.size();
+        J.Bound = true;
+        J.Count = (unsigned)of[d].size();
+        for (unsigned k : of[d])
+        {
+            Q->PartOf[k] = J.Part;
+            J.Data.insert(J.Data.end(), patterns + k * KEY_SIZE, patterns + (k+1) * KEY_SIZE);
+        }
+        jobs.emplace_back(std::move(J), Devices[d].get());
+    }
+
+    for (auto& P : jobs) enqueue(std::move(P.first), P.second);
+    return R;
+}
+
+std::future<ClientReply> ekey_pool_type::write_key(unsigned idx, const uint8_t* key, const uint8_t* payload)
+{
+    uint8_t data[2*KEY_SIZE];
+    memcpy(data, key, KEY_SIZE);
+    memcpy(data + KEY_SIZE, payload, KEY_SIZE);
+
+    if (Mode == PoolMode::replicated) return to_all(JobKind::write_key, data, sizeof(data), idx);
+    if (!complete() || idx >= KEY_COUNT) return refused();
+
+    // the slot of this device must be free, or have the same key (new payload)
+    const uint64_t h = key_hash(key);
+    Device* D = Devices[device_of(key)].get();
+    {
+        std::lock_guard<std::mutex> L(Lock);
+        auto it = D->Slots.find(idx);
+        if (it != D->Slots.end() && it->second != h) return refused();
+        D->Slots[idx] = h;
+    }
+
+    std::future<ClientReply> R;
+    Job J;
+    J.Owner = request(JobKind::write_key, 1, R);
+    J.Bound = true;
+    J.Index = idx;
+    J.Data.assign(data, data + sizeof(data));
+    enqueue(std::move(J), D);
+    return R;
+}
+
+std::future<ClientReply> ekey_pool_type::erase()
+{
+    if (Mode == PoolMode::partitioned && complete())
+    {
+        std::lock_guard<std::mutex> L(Lock);
+        for (auto& D : Devices) D->Slots.clear();
+    }
+    return to_all(JobKind::erase, nullptr, 0);
+}
+
+std::future<ClientReply> ekey_pool_type::prime(const uint8_t* permutation)
+{
+    return to_all(JobKind::prime, permutation, KEY_SIZE);
+}
@@ -0,0 +1,187 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// Host side client of several EKeys at once: devices on serial ports, or emulators on their TCP ports.
+// One device answers one request at a time, over a slow line; the pool spreads the lookups over the devices,
+// so they work in parallel and the throughput grows with their number.
+//
+// Every device has its own connection (ekey_client_type, requests in flight) and its own queue. The sending
+// thread of the device takes requests from the queue and sends them while there is room in flight, the completing
+// thread takes the answers in order and completes the futures that the pool has given out.
+//
+// Key table is either
+// - replicated: every device has all the keys. write_key goes to all devices, any device answers the lookup;
+//   the lookup goes to the queue of the device with the least work. A device that waits with nothing to do
+//   steals a lookup from the back of the queue of a busy one (such as the device on a slower line)
+// - partitioned: the keys are divided into a fixed number of shares, given to the constructor; the share of
+//   the key is chosen by the hash of the pattern, and each share is on one device. write_key and the lookups go
+//   there, batch is split into one batch per device and the answers are joined in the order of the patterns.
+//   Every device is added with its share, and it must be the same device at every run: emulator by its port,
+//   serial device by a stable name such as /dev/serial/by-id/... Requests fail until every share has its device.
+//   Index of write_key is the slot in the table of that device (0..KEY_COUNT-1): the caller either gives every
+//   key its own index, or counts the slots of every device with device_of(). The pool refuses to write a slot
+//   that it has written with another key since the last erase
+// erase and prime go to all devices in both modes. The answer of a request sent to several devices is ACK
+// if all of them answer ACK, NAK if some answer NAK, failed if some fail; partitioned batch fails if any part fails.
+//
+// Devices are added before the first request. A change of the table is not ordered against the lookups sent
+// before it is answered: the caller waits for the change, then asks. A device that disconnects takes no more
+// requests; its queue moves to other devices (replicated), or fails (partitioned).
+// Other commands, such as records or status: device(k) is the client of one device.
+
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ekey_client.h"
+
+enum class PoolMode { replicated, partitioned };
+
+struct PoolDeviceStats
+{
+    std::string Name;           // host:port, or the serial port
+    bool Connected = false;
+    uint64_t Sent = 0;          // requests sent to the device, parts of batch and of requests to all devices each count
+    uint64_t Stolen = 0;        // of them, taken from the queue of another device
+    uint64_t Failed = 0;
+};
+
+class ekey_pool_type
+{
+public:
+    // partitioned: number of shares (devices) the keys are divided into; it is the same for the life of the table
+    explicit ekey_pool_type(PoolMode mode = PoolMode::replicated, unsigned partitions = 1);
+    ~ekey_pool_type() { close(); }
+
+    ekey_pool_type(const ekey_pool_type&) = delete;
+    ekey_pool_type& operator=(const ekey_pool_type&) = delete;
+
+    // in_flight is per device, see ekey_client_type::connect; share is for partitioned: the device has that
+    // share of the keys, 0..partitions-1, one device each
+    bool add(const char* host, unsigned port, unsigned in_flight = 16, unsigned share = 0);
+    bool add_serial(const char* path, unsigned baud = SERIAL_SPEED, unsigned in_flight = 16, unsigned share = 0);
+
+    // emulators on count ports from first_port, and devices on serial ports by USB_VID:USB_PID;
+    // the ones that answer are added, returns how many.
+    // Partitioned: count must be the number of shares, port first_port+k has share k, and a port that does not
+    // answer leaves its share empty. discover_serial adds none: tty names follow the order the devices are
+    // plugged in, they do not tell which device is which
+    unsigned discover(const char* host, unsigned first_port, unsigned count, unsigned in_flight = 16);
+    unsigned discover_serial(unsigned baud = SERIAL_SPEED, unsigned in_flight = 16);
+
+    // requests that wait for answers fail
+    void close();
+
+    PoolMode mode() const { return Mode; }
+    unsigned size() const { return (unsigned)Devices.size(); }
+    ekey_client_type& device(unsigned k) { return Devices[k]->Client; }
+
+    // replicated: there is a device; partitioned: every share has its device
+    bool complete();
+
+    // partitioned: share of the key, which is also the device that has it in device(k) once complete
+    unsigned device_of(const uint8_t* pattern) const;
+
+    std::future<ClientReply> exchange(const uint8_t* pattern);
+    std::future<ClientReply> exchange_batch(const uint8_t* patterns, unsigned count);
+    std::future<ClientReply> write_key(unsigned idx, const uint8_t* key, const uint8_t* payload);
+    std::future<ClientReply> erase();
+    std::future<ClientReply> prime(const uint8_t* permutation);
+
+    std::vector<PoolDeviceStats> stats();
+
+private:
+    enum class JobKind : uint8_t { exchange, batch, write_key, erase, prime };
+
+    // request of the caller, answered when all its parts are
+    struct Request
+    {
+        JobKind Kind;
+        std::mutex Lock;
+        unsigned Remaining = 0;
+        std::vector<ClientReply> Parts;
+        std::vector<unsigned> PartOf;       // partitioned batch: part of every pattern
+        std::promise<ClientReply> Promise;
+    };
+
+    // part of the request for one device
+    struct Job
+    {
+        std::shared_ptr<Request> Owner;
+        unsigned Part = 0;
+        bool Bound = false;                 // for this device only, may not be stolen
+        unsigned Index = 0;                 // write_key
+        unsigned Count = 0;                 // batch
+        std::vector<uint8_t> Data;          // pattern(s), key and payload, permutation
+    };
+
+    struct Sent
+    {
+        Job Work;
+        std::future<ClientReply> Reply;
+    };
+
+    struct Device
+    {
+        ekey_client_type Client;
+        PoolDeviceStats Stats;
+        unsigned Share = 0;                 // partitioned
+        std::unordered_map<unsigned, uint64_t> Slots;  // partitioned: hash of the key written to the slot, under Lock
+
+        // under Lock of the pool
+        std::deque<Job> Queue;
+        unsigned Outstanding = 0;           // sent, not answered yet
+        bool Idle = false;                  // sending thread waits for work
+        bool Retired = false;               // disconnected, queue is given away
+        std::condition_variable Wake;
+
+        std::mutex FlightLock;
+        std::condition_variable FlightReady;
+        std::deque<Sent> Flight;            // in the order they are sent
+        bool Closing = false;
+
+        std::thread Sender;
+        std::thread Completer;
+    };
+
+    bool start(std::unique_ptr<Device> D, unsigned share);
+    void send_loop(Device& D);
+    void complete_loop(Device& D);
+
+    static std::future<ClientReply> send(ekey_client_type& C, const Job& J);
+    static void finish(Job& J, ClientReply&& R);
+    static ClientReply join(Request& Q);
+
+    std::shared_ptr<Request> request(JobKind kind, unsigned parts, std::future<ClientReply>& R);
+
+    // under Lock
+    Device* least_loaded();
+    bool take(Device& D, Job& J);
+    Device* push(Device& D, Job&& J);     // returns an idle device to wake, that may steal the job
+
+    // D is nullptr for any device; the job fails if there is none
+    void enqueue(Job&& J, Device* D);
+    std::future<ClientReply> to_all(JobKind kind, const uint8_t* data, unsigned length, unsigned index = 0);
+
+    static uint64_t key_hash(const uint8_t* pattern);
+
+    const PoolMode Mode;
+    const unsigned Partitions;
+    std::vector<std::unique_ptr<Device>> Devices;   // partitioned and complete: in the order of shares
+    std::mutex Lock;
+    bool Stopping = false;
+    size_t Rotor = 0;                       // first device to look at, under Lock
+};
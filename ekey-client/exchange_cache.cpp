@@ -0,0 +1,88 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <SKLib/sklib.hpp>
+#include "exchange_cache.h"
+
+// FNV-1a, 64 bit
+uint64_t exchange_cache_type::hash(const uint8_t* pattern)
+{
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (unsigned k = 0; k < KEY_SIZE; k++) h = (h ^ pattern[k]) * 0x100000001B3ull;
+    return h;
+}
+
+bool exchange_cache_type::find(const uint8_t* pattern, std::vector<uint8_t>& payload)
+{
+    const uint64_t h = hash(pattern);
+    std::lock_guard<std::mutex> L(Lock);
+
+    auto it = Index.find(h);
+    if (it == Index.end() || it->second->Epoch != Epoch || memcmp(it->second->Pattern, pattern, KEY_SIZE))
+    {
+        Stats.misses++;
+        return false;
+    }
+
+    Order.splice(Order.begin(), Order, it->second);
+    payload = it->second->Payload;
+    Stats.hits++;
+    return true;
+}
+
+void exchange_cache_type::store(const uint8_t* pattern, const uint8_t* payload, unsigned length, uint64_t epoch)
+{
+    if (!Capacity) return;
+
+    const uint64_t h = hash(pattern);
+    std::lock_guard<std::mutex> L(Lock);
+    if (epoch != Epoch) return;     // the table has changed since the request
+
+    auto it = Index.find(h);
+    if (it != Index.end())          // same pattern, or the other one with the same hash: replaced
+    {
+        Order.splice(Order.begin(), Order, it->second);
+    }
+    else
+    {
+        if (Index.size() >= Capacity)
+        {
+            if (Order.back().Epoch == Epoch) Stats.evictions++;
+            Index.erase(Order.back().Hash);
+            Order.pop_back();
+        }
+        Order.emplace_front();
+        it = Index.emplace(h, Order.begin()).first;
+    }
+
+    Entry& E = Order.front();
+    E.Hash = h;
+    E.Epoch = epoch;
+    memcpy(E.Pattern, pattern, KEY_SIZE);
+    E.Payload.assign(payload, payload + length);
+}
+
+uint64_t exchange_cache_type::epoch()
+{
+    std::lock_guard<std::mutex> L(Lock);
+    return Epoch;
+}
+
+void exchange_cache_type::invalidate()
+{
+    std::lock_guard<std::mutex> L(Lock);
+    Epoch++;
+    Stats.invalidations++;
+}
+
+ExchangeCacheStats exchange_cache_type::stats()
+{
+    std::lock_guard<std::mutex> L(Lock);
+    return Stats;
+}
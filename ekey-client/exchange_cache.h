@@ -0,0 +1,67 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// Answers of exchange by pattern, for ekey_client_type: payload, or NAK for pattern that is not in the table.
+// Least recently used entry goes out when the cache is full.
+// Epoch counts the changes of the key table made by this client (prime_keys, write_key, erase_keys);
+// entry is valid only in the epoch it was stored in, so a change drops everything at once. Answer to the request
+// sent before the change is stored with the old epoch, and is never used.
+// NB: changes made by other clients of the device are not seen.
+
+#pragma once
+#include <stdint.h>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "../ekey-model/interface.h"
+
+struct ExchangeCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;         // valid entries pushed out by newer ones
+    uint64_t invalidations = 0;     // epoch changes
+};
+
+class exchange_cache_type
+{
+public:
+    explicit exchange_cache_type(unsigned capacity) : Capacity(capacity) {}
+
+    // true if found; payload is empty for NAK
+    bool find(const uint8_t* pattern, std::vector<uint8_t>& payload);
+
+    // answer to the request that was sent in the given epoch
+    void store(const uint8_t* pattern, const uint8_t* payload, unsigned length, uint64_t epoch);
+
+    uint64_t epoch();
+    void invalidate();
+
+    ExchangeCacheStats stats();
+
+private:
+    struct Entry
+    {
+        uint64_t Hash;
+        uint64_t Epoch;
+        uint8_t Pattern[KEY_SIZE];
+        std::vector<uint8_t> Payload;
+    };
+
+    static uint64_t hash(const uint8_t* pattern);
+
+    std::mutex Lock;
+    const unsigned Capacity;
+    uint64_t Epoch = 0;
+    std::list<Entry> Order;                                             // most recent first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> Index;     // by hash, pattern is compared
+    ExchangeCacheStats Stats;
+};
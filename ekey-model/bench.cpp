@@ -0,0 +1,252 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <chrono>
+#include <random>
+
+#include <SKLib/sklib.hpp>
+#include "bench.h"
+#include "crc.h"
+#include "hardware_model.h"
+#include "key_index.h"
+#include "noise.h"
+#include "shared_state.h"
+
+static std::mt19937 Random(12345);     // fixed seed, runs are repeatable
+
+static double elapsed_ns(std::chrono::steady_clock::time_point since)
+{
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+static void fill_random(uint8_t* dest, unsigned length)
+{
+    for (unsigned k = 0; k < length; k++) dest[k] = (uint8_t)(Random() & sklib::OCTET_MASK);
+}
+
+static uint8_t Keys[KEY_COUNT][KEY_SIZE];      // copy of the keys, patterns for lookups
+
+// random key table of count keys and random rotator; keys only differ in the last "spread" bytes,
+// the rest is common (worst case for the search); the index is built once, as prime_keys does
+static void load_random_keys(unsigned spread, unsigned count = KEY_COUNT)
+{
+    KeyIndexState& S = key_index();
+    reset_key_index();
+
+    uint8_t payload[KEY_SIZE];
+    for (unsigned k = 0; k < count; k++)
+    {
+        memset(Keys[k], 0, KEY_SIZE - spread);
+        fill_random(Keys[k] + KEY_SIZE - spread, spread);
+        fill_random(payload, KEY_SIZE);
+        hdw_store_key_pair((key_addr_t)k, Keys[k], payload);
+        S.Present[k / 8] |= (uint8_t)(1 << (k % 8));
+    }
+
+    uint8_t permutation[KEY_SIZE];
+    for (unsigned k = 0; k < KEY_SIZE; k++) permutation[k] = (uint8_t)k;
+    std::shuffle(permutation, permutation + KEY_SIZE - spread, Random);   // keep the common part in front
+    std::shuffle(permutation + KEY_SIZE - spread, permutation + KEY_SIZE, Random);
+    prime_key_sorting(permutation);
+}
+
+// per-lookup cost of the exchange search: in-place comparator vs shadow table
+static void bench_lookup(unsigned spread, unsigned count = KEY_COUNT)
+{
+    static constexpr unsigned rounds = 200000;
+    static unsigned order[KEY_COUNT];
+    load_random_keys(spread, count);
+
+    for (unsigned k = 0; k < count; k++) order[k] = k;
+    std::shuffle(order, order + count, Random);
+
+    unsigned found = 0;
+    auto T = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < rounds; r++) found += (find_key_index_indirect(Keys[order[r % count]]) >= 0);
+    const double t_indirect = elapsed_ns(T) / rounds;
+
+    T = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < rounds; r++) found += (find_key_index(Keys[order[r % count]]) >= 0);
+    const double t_lookup = elapsed_ns(T) / rounds;
+
+    set_key_search(KeySearch::hashed);
+    const bool hashed = (get_key_search() == KeySearch::hashed);
+    T = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < rounds; r++) found += (find_key_index(Keys[order[r % count]]) >= 0);
+    const double t_hashed = elapsed_ns(T) / rounds;
+    set_key_search(KeySearch::sorted);
+
+    printf("lookup, %u keys differ in %u bytes: indirect %.1f ns, sorted %.1f ns (%.2fx), hashed%s %.1f ns (%.2fx), hits %u of %u\n",
+           count, spread, t_indirect, t_lookup, t_indirect / t_lookup, (hashed ? "" : " [NOT BUILT]"), t_hashed, t_indirect / t_hashed, found, 3 * rounds);
+}
+
+// the same as the table grows, up to KEY_COUNT (build with EKEY_KEY_ADDRESS_BYTES=2 for large tables)
+static void bench_lookup_scaling()
+{
+    for (unsigned count = 256; count < KEY_COUNT; count *= 4) bench_lookup(KEY_SIZE, count);
+    bench_lookup(KEY_SIZE);
+}
+
+// provisioning of the table one write_key at a time: index update vs full sort after every write
+// (the full sort is quadratic, the table is limited for it)
+static void bench_provision()
+{
+    static constexpr unsigned count = std::min(KEY_COUNT, 1024u);
+    uint8_t payload[KEY_SIZE] = {};
+    for (unsigned k = 0; k < count; k++) fill_random(Keys[k], KEY_SIZE);
+
+    reset_key_index();
+    auto T = std::chrono::steady_clock::now();
+    for (unsigned k = 0; k < count; k++)
+    {
+        hdw_store_key_pair((key_addr_t)k, Keys[k], payload);
+        update_key_index((key_addr_t)k);
+    }
+    const double t_update = elapsed_ns(T) / 1000;
+
+    reset_key_index();
+    T = std::chrono::steady_clock::now();
+    for (unsigned k = 0; k < count; k++)
+    {
+        hdw_store_key_pair((key_addr_t)k, Keys[k], payload);
+        update_key_index((key_addr_t)k);
+        recalculate_key_sorting();
+    }
+    const double t_resort = elapsed_ns(T) / 1000;
+
+    printf("provision, %u keys: update_key_index %.1f us, full sort per write %.1f us (%.1fx)\n",
+           count, t_update, t_resort, t_resort / t_update);
+}
+
+// prime_keys: rebuild of the order for full table with new rotator
+static void bench_prime(unsigned spread)
+{
+    static constexpr unsigned rounds = std::max(51200 / KEY_COUNT, 1u);
+    load_random_keys(spread);
+
+    uint8_t permutation[KEY_SIZE];
+    memcpy(permutation, key_index().Permutation, KEY_SIZE);
+
+    auto T = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < rounds; r++) prime_key_sorting(permutation);
+    const double t_prime = elapsed_ns(T) / rounds / 1000;
+
+    printf("prime, %u keys differ in %u bytes: %.1f us\n", KEY_COUNT, spread, t_prime);
+}
+
+static volatile uint32_t CrcSink;      // keeps the results alive
+
+// CRC over one record, all engines; check value is CRC of "123456789"
+template<class F>
+static void bench_crc_engine(const char* name, uint32_t expect, F crc_of)
+{
+    static constexpr unsigned rounds = 20000;
+    static uint8_t data[BLOCK_SIZE];
+    fill_random(data, BLOCK_SIZE);
+
+    const bool correct = (crc_of((const uint8_t*)"123456789", 9) == expect);
+
+    uint32_t sink = 0;
+    auto T = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < rounds; r++) sink ^= crc_of(data, BLOCK_SIZE);
+    CrcSink = sink;
+    const double t_crc = elapsed_ns(T);
+
+    printf("crc, %-20s %7.1f MB/s%s\n", name, (double)rounds * BLOCK_SIZE * 1000 / t_crc,
+           correct ? "" : " ** WRONG CHECK VALUE **");
+}
+
+static void bench_crc()
+{
+    bench_crc_engine("sklib crc_16_ccitt", 0x29B1, [](const uint8_t* d, unsigned n) -> uint32_t
+        { return sklib::crc_16_ccitt().update(d, n); });
+    bench_crc_engine("crc16 by byte", 0x29B1, [](const uint8_t* d, unsigned n) -> uint32_t
+        { crc16_ccitt_type c; for (unsigned k = 0; k < n; k++) c.update(d[k]); return c.get(); });
+    bench_crc_engine("crc16 nibble (M0+)", 0x29B1, [](const uint8_t* d, unsigned n) -> uint32_t
+        { crc16_ccitt_type c; for (unsigned k = 0; k < n; k++) c.update_nibble(d[k]); return c.get(); });
+    bench_crc_engine("crc16 slicing-by-8", 0x29B1, [](const uint8_t* d, unsigned n) -> uint32_t
+        { return crc16_ccitt_type().update_sliced(d, n).get(); });
+    bench_crc_engine("crc32 nibble (M0+)", 0xCBF43926u, [](const uint8_t* d, unsigned n) -> uint32_t
+        { crc32_type c; for (unsigned k = 0; k < n; k++) c.update_nibble(d[k]); return c.get(); });
+    bench_crc_engine("crc32 slicing-by-8", 0xCBF43926u, [](const uint8_t* d, unsigned n) -> uint32_t
+        { return crc32_type().update_sliced(d, n).get(); });
+}
+
+// get_noise: old per-byte rand() vs ChaCha20 pool, per 256-byte request and in bulk;
+// the keystream is checked against RFC 8439 A.1 test vector (zero key and nonce, blocks 0 and 1)
+static void bench_noise()
+{
+    static constexpr unsigned requests = 20000;
+    static constexpr size_t bulk_size = 1 << 20;
+    static constexpr unsigned bulk_rounds = 64;
+
+    static const uint8_t zero[CHACHA_KEY_SIZE] = {};
+    uint8_t block[2 * CHACHA_BLOCK_SIZE];
+    chacha20_type C;
+    C.set_key(zero, zero);
+    C.generate(block, sizeof(block));
+    const bool correct = (block[0] == 0x76 && block[1] == 0xB8 && block[63] == 0x86 &&
+                          block[64] == 0x9F && block[65] == 0x07 && block[127] == 0x6F);
+
+    uint8_t buffer[KEY_SIZE];
+    uint32_t sink = 0;
+
+    if (!noise_fill(buffer, KEY_SIZE))
+    {
+        printf("noise: no entropy source, the generator is not seeded\n");
+        return;
+    }
+
+    auto T = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < requests; r++)
+    {
+        for (unsigned k = 0; k < KEY_SIZE; k++) buffer[k] = (uint8_t)(rand() & sklib::OCTET_MASK);
+        sink ^= buffer[r % KEY_SIZE];
+    }
+    const double t_rand = elapsed_ns(T) / requests;
+
+    T = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < requests; r++)
+    {
+        noise_fill(buffer, KEY_SIZE);
+        noise_prepare(KEY_SIZE);
+        sink ^= buffer[r % KEY_SIZE];
+    }
+    const double t_pool = elapsed_ns(T) / requests;
+
+    std::unique_ptr<uint8_t[]> bulk(new uint8_t[bulk_size]);
+    T = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < bulk_rounds; r++)
+    {
+        noise_fill(bulk.get(), bulk_size);
+        sink ^= bulk[r];
+    }
+    const double t_bulk = elapsed_ns(T);
+    CrcSink = sink;
+
+    printf("noise, 256 bytes: rand() %7.0f ns, chacha20 pool %7.0f ns; bulk %7.1f MB/s%s\n",
+           t_rand, t_pool, (double)bulk_rounds * bulk_size * 1000 / t_bulk, correct ? "" : " ** WRONG KEYSTREAM **");
+}
+
+int run_benchmarks()
+{
+    StateUpdate Update;     // one private copy of the state for all measurements
+
+#ifndef EKEY_SHADOW_TABLE
+    fputs("NB: shadow table is disabled, both lookups use the in-place comparison\n", stdout);
+#endif
+    bench_lookup_scaling();
+    bench_lookup(KEY_SIZE / 16);
+    bench_provision();
+    bench_prime(KEY_SIZE);
+    bench_prime(KEY_SIZE / 16);
+    bench_crc();
+    bench_noise();
+    return 0;
+}
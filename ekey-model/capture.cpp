@@ -0,0 +1,184 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#include "capture.h"
+
+// the file is flushed at this interval and when a connection closes
+static constexpr auto CAPTURE_FLUSH_INTERVAL = std::chrono::milliseconds(100);
+static constexpr unsigned CAPTURE_FRAME_MAX = 4096;     // longer frame is split into records
+
+static std::mutex CAPTURE_LOCK;
+static FILE* CAPTURE_FILE = nullptr;
+static std::atomic<bool> CAPTURE_ON(false);
+static std::chrono::steady_clock::time_point CAPTURE_START, CAPTURE_FLUSHED;
+static uint64_t CAPTURE_LAST_US = 0;
+static uint32_t CAPTURE_CONNECTIONS = 0;
+
+// frame being collected, per direction, for the connection of the thread
+struct capture_thread_type
+{
+    uint32_t Connection = 0;
+    bool Open = false;
+    std::vector<uint8_t> Frame[2];
+};
+
+static thread_local capture_thread_type CAPTURE_THREAD;
+
+static void put_varint(uint64_t v)
+{
+    do
+    {
+        const uint8_t b = (uint8_t)((v & 0x7F) | ((v > 0x7F) ? 0x80 : 0));
+        fputc(b, CAPTURE_FILE);
+        v >>= 7;
+    }
+    while (v);
+}
+
+// takes CAPTURE_LOCK
+static void write_record(CaptureKind kind, uint32_t connection, const uint8_t* data, unsigned length, bool flush)
+{
+    std::lock_guard<std::mutex> L(CAPTURE_LOCK);
+    if (!CAPTURE_FILE) return;
+
+    const auto now = std::chrono::steady_clock::now();
+    const uint64_t us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - CAPTURE_START).count();
+
+    fputc((uint8_t)kind, CAPTURE_FILE);
+    put_varint(connection);
+    put_varint(us - CAPTURE_LAST_US);
+    put_varint(length);
+    if (length) fwrite(data, 1, length, CAPTURE_FILE);
+    CAPTURE_LAST_US = us;
+
+    if (flush || now - CAPTURE_FLUSHED >= CAPTURE_FLUSH_INTERVAL)
+    {
+        fflush(CAPTURE_FILE);
+        CAPTURE_FLUSHED = now;
+    }
+}
+
+bool capture_start(const char* path)
+{
+    std::lock_guard<std::mutex> L(CAPTURE_LOCK);
+    if (CAPTURE_FILE) return false;
+
+    CAPTURE_FILE = fopen(path, "wb");
+    if (!CAPTURE_FILE) return false;
+
+    fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), CAPTURE_FILE);
+    CAPTURE_START = CAPTURE_FLUSHED = std::chrono::steady_clock::now();
+    CAPTURE_LAST_US = 0;
+    CAPTURE_ON = true;
+    return true;
+}
+
+void capture_stop()
+{
+    std::lock_guard<std::mutex> L(CAPTURE_LOCK);
+    CAPTURE_ON = false;
+    if (CAPTURE_FILE) fclose(CAPTURE_FILE);
+    CAPTURE_FILE = nullptr;
+}
+
+void capture_opened()
+{
+    if (!CAPTURE_ON) return;
+
+    {
+        std::lock_guard<std::mutex> L(CAPTURE_LOCK);
+        CAPTURE_THREAD.Connection = CAPTURE_CONNECTIONS++;
+    }
+    CAPTURE_THREAD.Open = true;
+    for (auto& F : CAPTURE_THREAD.Frame) F.clear();
+    write_record(CaptureKind::opened, CAPTURE_THREAD.Connection, nullptr, 0, false);
+}
+
+void capture_closed()
+{
+    if (!CAPTURE_ON || !CAPTURE_THREAD.Open) return;
+
+    for (unsigned d = 0; d < 2; d++)     // unfinished frames
+    {
+        auto& F = CAPTURE_THREAD.Frame[d];
+        if (F.size()) write_record((CaptureKind)d, CAPTURE_THREAD.Connection, F.data(), (unsigned)F.size(), false);
+        F.clear();
+    }
+    write_record(CaptureKind::closed, CAPTURE_THREAD.Connection, nullptr, 0, true);
+    CAPTURE_THREAD.Open = false;
+}
+
+void capture_byte(CaptureKind direction, uint8_t c)
+{
+    if (!CAPTURE_ON || !CAPTURE_THREAD.Open) return;
+
+    auto& F = CAPTURE_THREAD.Frame[(unsigned)direction & 1];
+    F.push_back(c);
+
+    const bool end = (!c || c == '\n' || c == '\r' || c == 0xFF);
+    if (end || F.size() == CAPTURE_FRAME_MAX)
+    {
+        write_record(direction, CAPTURE_THREAD.Connection, F.data(), (unsigned)F.size(), false);
+        F.clear();
+    }
+}
+
+void capture_frame(CaptureKind direction, const uint8_t* data, unsigned length)
+{
+    if (!CAPTURE_ON || !CAPTURE_THREAD.Open || !length) return;
+    write_record(direction, CAPTURE_THREAD.Connection, data, length, false);
+}
+
+// -------------------------------------------------------------
+
+static bool get_varint(FILE* f, uint64_t& v)
+{
+    v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        const int b = fgetc(f);
+        if (b == EOF) return false;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+bool capture_load(const char* path, std::vector<CaptureRecord>& records)
+{
+    records.clear();
+
+    FILE* f = fopen(path, "rb");
+    if (!f) return false;
+
+    char magic[sizeof(CAPTURE_MAGIC)];
+    bool good = (fread(magic, 1, sizeof(magic), f) == sizeof(magic) && !memcmp(magic, CAPTURE_MAGIC, sizeof(magic)));
+
+    uint64_t time = 0;
+    int kind;
+    while (good && (kind = fgetc(f)) != EOF)
+    {
+        uint64_t connection = 0, dt = 0, length = 0;
+        good = kind <= (int)CaptureKind::closed && get_varint(f, connection) && get_varint(f, dt) && get_varint(f, length) && length <= CAPTURE_FRAME_MAX;
+        if (!good) break;
+
+        time += dt;
+        records.push_back(CaptureRecord{ (CaptureKind)kind, (uint32_t)connection, time, std::vector<uint8_t>((size_t)length) });
+        if (length) good = (fread(records.back().Data.data(), 1, (size_t)length, f) == length);
+    }
+
+    fclose(f);
+    return good;
+}
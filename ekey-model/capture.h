@@ -0,0 +1,57 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// Wire capture: frames as they pass the transport (hdw_ functions on the device side, ser_ functions on the host),
+// with time stamps, into a binary file that ekey-bench --replay plays back against the emulator.
+// Host programs only; the firmware does not capture.
+//
+// File: 8 bytes CAPTURE_MAGIC (last byte is the version), then records:
+//   1 byte CaptureKind, varint connection number, varint microseconds since the previous record,
+//   varint length, data; varint is 7 bits per byte, low first, bit 7 means more bytes follow
+// Directions are as seen by the device, on either side. A frame ends at 0, '\n', '\r' or 0xFF; a frame in COBS
+// may hold such bytes and then takes several records, replay joins consecutive records of the same direction.
+
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+static constexpr char CAPTURE_MAGIC[8] = { 'E', 'K', 'E', 'Y', 'C', 'A', 'P', 1 };
+
+enum class CaptureKind : uint8_t
+{
+    to_device,
+    from_device,
+    opened,         // connection, no data
+    closed
+};
+
+struct CaptureRecord
+{
+    CaptureKind Kind;
+    uint32_t Connection;
+    uint64_t Time_us;       // since the capture started
+    std::vector<uint8_t> Data;
+};
+
+// writing: functions below do nothing until capture_start() succeeds
+bool capture_start(const char* path);
+void capture_stop();
+
+// connection that the calling thread serves
+void capture_opened();
+void capture_closed();
+
+// bytes of a frame, one by one; the record is written when the frame ends
+void capture_byte(CaptureKind direction, uint8_t c);
+
+// whole frame at once (device output is collected by hdw_flush)
+void capture_frame(CaptureKind direction, const uint8_t* data, unsigned length);
+
+// reading: false if the file is not a capture or is cut short
+bool capture_load(const char* path, std::vector<CaptureRecord>& records);
@@ -0,0 +1,232 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// CRC for the framing layer, updated as the bytes go (one table lookup per byte), or over a block.
+// CRC16-CCITT: polynomial 0x1021, initial 0xFFFF, MSB first, no final XOR; same as sklib::crc_16_ccitt.
+// CRC32: IEEE 802.3, reflected polynomial 0xEDB88320, initial and final XOR 0xFFFFFFFF.
+// Block update on the host is slicing-by-8: eight 256-entry tables, 8 bytes per step.
+// Firmware uses 16-entry tables (4 bits per step), 32 and 64 bytes of flash.
+// Both variants are always compiled, update() selects one; the tables are built at compile time.
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(REAL_HARDRDWARE) && !defined(EKEY_CRC_COMPACT)
+#define EKEY_CRC_COMPACT
+#endif
+
+static constexpr unsigned CRC_SLICES = 8;
+
+// separate objects, so the firmware only links the small ones
+
+struct crc16_tables_type
+{
+    uint16_t sliced[CRC_SLICES][256] = {};
+
+    constexpr crc16_tables_type()
+    {
+        for (unsigned b = 0; b < 256; b++)
+        {
+            uint16_t c = (uint16_t)(b << 8);
+            for (unsigned k = 0; k < 8; k++) c = (uint16_t)((c & 0x8000) ? (c << 1) ^ 0x1021 : (c << 1));
+            sliced[0][b] = c;
+        }
+
+        // byte b followed by s zero bytes
+        for (unsigned s = 1; s < CRC_SLICES; s++)
+            for (unsigned b = 0; b < 256; b++)
+                sliced[s][b] = (uint16_t)((sliced[s-1][b] << 8) ^ sliced[0][sliced[s-1][b] >> 8]);
+    }
+};
+
+struct crc16_nibble_type
+{
+    uint16_t nibble[16] = {};
+
+    constexpr crc16_nibble_type()
+    {
+        for (unsigned n = 0; n < 16; n++)
+        {
+            uint16_t c = (uint16_t)(n << 12);
+            for (unsigned k = 0; k < 4; k++) c = (uint16_t)((c & 0x8000) ? (c << 1) ^ 0x1021 : (c << 1));
+            nibble[n] = c;
+        }
+    }
+};
+
+struct crc32_tables_type
+{
+    uint32_t sliced[CRC_SLICES][256] = {};
+
+    constexpr crc32_tables_type()
+    {
+        for (unsigned b = 0; b < 256; b++)
+        {
+            uint32_t c = b;
+            for (unsigned k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0xEDB88320u : (c >> 1);
+            sliced[0][b] = c;
+        }
+
+        for (unsigned s = 1; s < CRC_SLICES; s++)
+            for (unsigned b = 0; b < 256; b++)
+                sliced[s][b] = (sliced[s-1][b] >> 8) ^ sliced[0][sliced[s-1][b] & 0xFF];
+    }
+};
+
+struct crc32_nibble_type
+{
+    uint32_t nibble[16] = {};
+
+    constexpr crc32_nibble_type()
+    {
+        for (unsigned n = 0; n < 16; n++)
+        {
+            uint32_t c = n;
+            for (unsigned k = 0; k < 4; k++) c = (c & 1) ? (c >> 1) ^ 0xEDB88320u : (c >> 1);
+            nibble[n] = c;
+        }
+    }
+};
+
+inline const crc16_tables_type& crc16_tables()
+{
+    static constexpr crc16_tables_type Tables;
+    return Tables;
+}
+
+inline const crc32_tables_type& crc32_tables()
+{
+    static constexpr crc32_tables_type Tables;
+    return Tables;
+}
+
+inline const crc16_nibble_type& crc16_nibble()
+{
+    static constexpr crc16_nibble_type Table;
+    return Table;
+}
+
+inline const crc32_nibble_type& crc32_nibble()
+{
+    static constexpr crc32_nibble_type Table;
+    return Table;
+}
+
+class crc16_ccitt_type
+{
+public:
+    // when the received CRC (big endian) is passed through update() too, the result is 0 for correct frame
+    static constexpr uint16_t residue = 0;
+
+    void reset() { value = 0xFFFF; }
+    uint16_t get() const { return value; }
+
+    crc16_ccitt_type& update(uint8_t data)
+    {
+#ifdef EKEY_CRC_COMPACT
+        return update_nibble(data);
+#else
+        const auto& T = crc16_tables().sliced[0];
+        value = (uint16_t)((value << 8) ^ T[(value >> 8) ^ data]);
+        return *this;
+#endif
+    }
+
+    crc16_ccitt_type& update(const uint8_t* data, size_t length)
+    {
+#ifdef EKEY_CRC_COMPACT
+        for (size_t k = 0; k < length; k++) update_nibble(data[k]);
+        return *this;
+#else
+        return update_sliced(data, length);
+#endif
+    }
+
+    crc16_ccitt_type& update_nibble(uint8_t data)
+    {
+        const auto& N = crc16_nibble().nibble;
+        value = (uint16_t)((value << 4) ^ N[(value >> 12) ^ (data >> 4)]);
+        value = (uint16_t)((value << 4) ^ N[(value >> 12) ^ (data & 0xF)]);
+        return *this;
+    }
+
+    // CRC register goes over the first 2 bytes of every 8, the tables give contribution of the rest
+    crc16_ccitt_type& update_sliced(const uint8_t* data, size_t length)
+    {
+        const auto& T = crc16_tables().sliced;
+
+        for (; length >= CRC_SLICES; length -= CRC_SLICES, data += CRC_SLICES)
+        {
+            value = T[7][data[0] ^ (value >> 8)] ^ T[6][data[1] ^ (value & 0xFF)] ^
+                    T[5][data[2]] ^ T[4][data[3]] ^ T[3][data[4]] ^ T[2][data[5]] ^ T[1][data[6]] ^ T[0][data[7]];
+        }
+
+        while (length--) value = (uint16_t)((value << 8) ^ T[0][(value >> 8) ^ *data++]);
+        return *this;
+    }
+
+private:
+    uint16_t value = 0xFFFF;
+};
+
+class crc32_type
+{
+public:
+    void reset() { value = 0xFFFFFFFFu; }
+    uint32_t get() const { return ~value; }
+
+    crc32_type& update(uint8_t data)
+    {
+#ifdef EKEY_CRC_COMPACT
+        return update_nibble(data);
+#else
+        const auto& T = crc32_tables().sliced[0];
+        value = (value >> 8) ^ T[(value ^ data) & 0xFF];
+        return *this;
+#endif
+    }
+
+    crc32_type& update(const uint8_t* data, size_t length)
+    {
+#ifdef EKEY_CRC_COMPACT
+        for (size_t k = 0; k < length; k++) update_nibble(data[k]);
+        return *this;
+#else
+        return update_sliced(data, length);
+#endif
+    }
+
+    crc32_type& update_nibble(uint8_t data)
+    {
+        const auto& N = crc32_nibble().nibble;
+        value = (value >> 4) ^ N[(value ^ data) & 0xF];
+        value = (value >> 4) ^ N[(value ^ (data >> 4)) & 0xF];
+        return *this;
+    }
+
+    // reflected: CRC register goes over the first 4 bytes of every 8, little endian
+    crc32_type& update_sliced(const uint8_t* data, size_t length)
+    {
+        const auto& T = crc32_tables().sliced;
+
+        for (; length >= CRC_SLICES; length -= CRC_SLICES, data += CRC_SLICES)
+        {
+            const uint32_t c = value ^ (data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+            value = T[7][c & 0xFF] ^ T[6][(c >> 8) & 0xFF] ^ T[5][(c >> 16) & 0xFF] ^ T[4][c >> 24] ^
+                    T[3][data[4]] ^ T[2][data[5]] ^ T[1][data[6]] ^ T[0][data[7]];
+        }
+
+        while (length--) value = (value >> 8) ^ T[0][(value ^ *data++) & 0xFF];
+        return *this;
+    }
+
+private:
+    uint32_t value = 0xFFFFFFFFu;
+};
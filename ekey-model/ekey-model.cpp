@@ -18,174 +18,474 @@
 // I/O with hardware (or model), and with serial line
 #include "hardware_model.h"
 
-static_assert(KEY_SIZE == sklib::supplement::bits_data_mask<uint8_t>() + 1, "Key size and uint8_t range must be the same");
-static_assert(KEY_COUNT <= sklib::supplement::bits_data_mask<uint8_t>() + 1, "Key count must be addressable by uint8_t");
+// sorted key table, search
+#include "key_index.h"
+
+// snapshots of keys and index, when clients are served in parallel
+#include "shared_state.h"
+
+// ChaCha20 noise pool for get_noise
+#include "noise.h"
+
+// counters for get_status
+#include "telemetry.h"
+
+// put_record goes through the write cache
+#include "record_store.h"
+
+// ekey-model --bench
+#include "bench.h"
+
+// ekey-model --capture, for ekey-bench --replay
+#include "capture.h"
+
+// ekey-model --link, speed of USB-serial line for ekey-bench
+#include "link_model.h"
 
 static constexpr unsigned BUFFER_SIZE = 1536;
 
-// transformation of received 
-uint8_t KeyPermutation[KEY_SIZE];
-uint8_t KeyRedirect[KEY_COUNT];
-uint8_t BUFFER[std::max({ BUFFER_SIZE, Interface::read_buffer_size(KEY_SIZE), Interface::read_buffer_size(BLOCK_SIZE) })];
+// every client has its own BUFFER
+static constexpr unsigned BUFFER_LENGTH = std::max({ BUFFER_SIZE, Interface::read_buffer_size(KEY_SIZE), Interface::read_buffer_size(RECORD_ADDR_SIZE + BLOCK_SIZE) });
 
-// given the current Permutation and Hardware storage (received by hdw_get_key_ptr() function)
+// batch of exchanges: 1 byte count N, N patterns => N times: response code, payload if ACK
+// as many patterns as the BUFFER can take (after the opcode), N = 0 asks for this number
+static constexpr unsigned EXCHANGE_BATCH_MAX = (BUFFER_LENGTH - Interface::read_buffer_size(2)) / KEY_SIZE;
+static_assert(EXCHANGE_BATCH_MAX * (KEY_SIZE + 1) <= BUFFER_LENGTH - 1, "Batch response must fit into BUFFER");
+static_assert(EXCHANGE_BATCH_MAX <= sklib::supplement::bits_data_mask<uint8_t>(), "Batch size must fit into uint8_t");
+static_assert(STATUS_LENGTH <= BUFFER_LENGTH - 1, "Status must fit into BUFFER");
 
-bool compare_key_is_pattern_A_less_than_B(const uint8_t* pattern_A, uint8_t idx_B)
+// in place: pattern k is at 1+k*KEY_SIZE, response k is put to k*(KEY_SIZE+1); going from the last one,
+// the response only overwrites patterns already searched; then responses are packed, NAK has no payload
+static unsigned exchange_batch(uint8_t* BUFFER, unsigned count)
 {
-    uint8_t* key_B = hdw_get_key_ptr(idx_B);
+    for (unsigned k = count; k--; )
+    {
+        const int idx = find_key_index(BUFFER + 1 + k * KEY_SIZE);
+        uint8_t* response = BUFFER + k * (KEY_SIZE + 1);
+
+        if (idx >= 0) memcpy(response + 1, hdw_get_key_ptr((key_addr_t)idx) + KEY_SIZE, KEY_SIZE);
+        response[0] = (uint8_t)((idx >= 0) ? KeyResponse::ACK : KeyResponse::NAK);
+    }
 
-    for (unsigned k = 0; k < KEY_SIZE; k++)
+    unsigned length = 0;
+    for (unsigned k = 0; k < count; k++)
     {
-        if (pattern_A[KeyPermutation[k]] < key_B[KeyPermutation[k]]) return true;
+        const uint8_t* response = BUFFER + k * (KEY_SIZE + 1);
+        const unsigned L = (response[0] == (uint8_t)KeyResponse::ACK) ? KEY_SIZE + 1 : 1;
+        memmove(BUFFER + length, response, L);
+        length += L;
     }
 
-    return false;
+    return length;
 }
 
-bool compare_keys_is_A_less_than_B(uint8_t idx_A, uint8_t idx_B)
+/*
+* input/output: every command is one frame, opcode then the parameters; exchange has no opcode
+*   base64= string encoding 256 bytes + 4 byte CRC32 => find the match in table, if format and CRC are correct, and key is present, return response, another 256 bytes + their 4 byte CRC32
+*   framing=base64= 1 byte mode: 0 base64, 1 COBS, +0x80 request ID in every packet => ACK in current framing, then the connection uses the new one
+*   batch=base64= 1 byte count N, N times 256 bytes => N times response code, and 256 bytes if ACK, all in one packet; N=0 returns max N
+*   write=base64= 1 byte address (2 bytes, big endian, with EKEY_KEY_ADDRESS_BYTES=2), 256 bytes key, 256 bytes response, 4 byte CRC32 of the transmission => raw write into the key table (verifies CRC)
+*   erase= => delete all entries in the table
+*   prime=base64= 256 bytes vector + 4 byte CRC32 => loads precalculated 256 byte permutation vector for use (verified CRC), replacing old one if any
+*   noise= => calculates and prints 256 random bytes + 4 byte CRC32
+*   put=base64= 2 bytes address, 1024 bytes record, 4 bytes CRC32 => write to "file" memory (vierified CRC), granularity is 1 kb.
+*   get=base64= 2 bytes address, 4 bytes CRC32 => read from address 1024 bytes and return with 4 bytes CRC
+*   getrange=base64= 2 bytes address, 1 byte count N => N packets of 1024 bytes, back to back, then ACK; or one NAK for invalid range
+*   putrange=base64= 2 bytes address, 1 byte count N, then N packets of 1024 bytes without waiting => one ACK when all are stored, or NAK
+*   sync= => blocks in the write cache are stored, then ACK (see record_store.h)
+*   status= => counters: requests, NAKs and service time per command, receive errors, CRC self test (see telemetry.h)
+*/
+
+// record address is 2 bytes, big endian
+static unsigned record_address(const uint8_t* data)
 {
-    return compare_key_is_pattern_A_less_than_B(hdw_get_key_ptr(idx_A), idx_B);
+    return ((unsigned)data[0] << 8) | data[1];
 }
 
-void recalculate_key_sorting()
+// key address is KEY_ADDR_SIZE bytes, big endian
+static unsigned key_address(const uint8_t* data)
 {
-    for (unsigned k = 0; k < KEY_COUNT; k++) KeyRedirect[k] = k;
-    std::make_heap(KeyRedirect, KeyRedirect + KEY_COUNT, compare_keys_is_A_less_than_B);
-    std::sort_heap(KeyRedirect, KeyRedirect + KEY_COUNT, compare_keys_is_A_less_than_B);
+    unsigned R = 0;
+    for (unsigned k = 0; k < KEY_ADDR_SIZE; k++) R = (R << 8) | data[k];
+    return R;
 }
 
-// 0..KEY_COUNT-1 => index of the Key; payload is offset by KEY_SIZE
-// return NEGATIVE if not found
-int find_key_index(uint8_t* pattern)
+// range of blocks, count from 1 to the end of the store
+static bool record_range_valid(const uint8_t* data)
 {
-    int idx_K = (int)(std::upper_bound(KeyPermutation, KeyPermutation + KEY_COUNT, pattern, compare_key_is_pattern_A_less_than_B) - KeyPermutation);
-    return ((idx_K == KEY_COUNT) ? -1 : idx_K);
+    const unsigned address = record_address(data);
+    const unsigned count = data[RECORD_ADDR_SIZE];
+    return count && address < BLOCK_COUNT && count <= BLOCK_COUNT - address;
 }
 
-/*
-* input/output:
-*   base64= string encoding 256 bytes + 4 byte CRC32 => find the match in table, if format and CRC are correct, and key is present, return response, another 256 bytes + their 4 byte CRC32
-*   write=base64= 1 byte address, 256 bytes key, 256 bytes response, 4 byte CRC32 of the transmission => raw write into the key table (verifies CRC)
-*   erase= => delete all entries in the table
-*   prime=base64= 256 bytes vector + 4 byte CRC32 => loads precalculated 256 byte permutation vector for use (verified CRC), replacing old one if any
-*   noise= => calculates and prints 256 random bytes + 4 byte CRC32
-*   put=base64= 2 bytes address, 1024 bytes record, 4 bytes CRC32 => write to "file" memory (vierified CRC), granularity is 1 kb.
-*   get=base64= 2 bytes address, 4 bytes CRC32 => read from address 1024 bytes and return with 4 bytes CRC
-*   status= => return error status, including CRC test
-*/
+// -------------------------------------------------------------
 
-/* //sk delete
-static const int keySize        = 256;
-static const int keyAddrSize    = 1;
-static const int recordSize     = 1024;
-static const int recordAddrSize = 2;
-static const int crcSize        = 4;
-*/
+// command handlers: parameters are in data (BUFFER after the opcode), length is checked against the table;
+// data is also the space for the answer, up to BUFFER_LENGTH-1 bytes; return true for success (ACK)
+// commands that read keep the snapshot of the state (StateRead) until the answer is sent;
+// commands that write complete the change (StateUpdate) before the answer, so the next command sees it
 
+static bool cmd_prime_keys(Interface&, uint8_t* data, unsigned)               // remember rotator, build index
+{
+    StateUpdate Update;
+    prime_key_sorting(data);
+    return true;
+}
 
+static bool cmd_write_key(Interface&, uint8_t* data, unsigned)                // store key pair, move it in the index
+{
+    if (key_address(data) >= KEY_COUNT) return false;
 
-void func_prime_keys();
-void func_write_key();
-void func_erase_keys();
-void func_get_noise();
-void func_get_record();
-void func_put_record();
+    const key_addr_t idx = (key_addr_t)key_address(data);
+    StateUpdate Update;
+    hdw_store_key_pair(idx, data + KEY_ADDR_SIZE, data + KEY_ADDR_SIZE + KEY_SIZE);
+    update_key_index(idx);
+    return true;
+}
 
-/*
-struct FunctionDescr
+static bool cmd_erase_keys(Interface&, uint8_t*, unsigned)                    // forget all keys
 {
-    KeyFunction opcode;
-    const char* command;
-    size_t data_length;    // input data; not including CRC-32 or trailing '='
-};
+    StateUpdate Update;
+    reset_key_index();
+    return true;
+}
 
-static constexpr FunctionDescr Interface[] =
+static bool cmd_exchange_batch(Interface& Serial, uint8_t* data, unsigned)    // search N patterns, one packet each way
 {
-    { KeyFunction::exchange_key, "",       sklib::base64_type::encoded_length(keySize + crcSize)        },
-    { KeyFunction::write_key,    "write",  sklib::base64_type::encoded_length(keyAddrSize + 2*keySize + crcSize) },
-    { KeyFunction::erase_keys,   "erase",  0                                                            },
-    { KeyFunction::prime_keys,   "prime",  sklib::base64_type::encoded_length(keySize + crcSize)        },
-    { KeyFunction::get_noise,    "noise",  0                                                            },
-    { KeyFunction::put_record,   "put",    sklib::base64_type::encoded_length(recordAddrSize + recordSize + crcSize) },
-    { KeyFunction::get_record,   "get",    sklib::base64_type::encoded_length(recordAddrSize + crcSize) },
-    { KeyFunction::get_status,   "status", 0                                                            }
-};
+    if (!data[0])
+    {
+        data[0] = (uint8_t)EXCHANGE_BATCH_MAX;
+        Serial.write_output(data, 1);
+        return true;
+    }
 
-static const size_t InterfaceSize = sizeof(Interface) / sizeof(Interface[0]);
+    StateRead Snapshot;
+    Serial.write_output(data, exchange_batch(data, data[0]));
+    return true;
+}
+
+static bool cmd_get_noise(Interface& Serial, uint8_t* data, unsigned)         // 256 random bytes
+{
+    if (!noise_fill(data, KEY_SIZE)) return false;     // never seeded: no entropy source
+    Serial.write_output(data, KEY_SIZE);
+    noise_prepare(KEY_SIZE);    // while the client reads
+    return true;
+}
 
-static constexpr size_t svc_strlen(const char* str)
+static bool cmd_get_record(Interface& Serial, uint8_t* data, unsigned)        // address => 1024 bytes of the block
 {
-    const char* str_org = str;
-    while (*str) str++;
-    return str - str_org;
+    if (record_address(data) >= BLOCK_COUNT) return false;
+
+    StateRead Snapshot;
+    Serial.write_output(record_block((uint8_t)record_address(data)), BLOCK_SIZE);
+    return true;
 }
 
-static constexpr size_t svc_ifacedim()
+static bool cmd_put_record(Interface&, uint8_t* data, unsigned)               // address, 1024 bytes => store the block
 {
-    size_t R = 0;
-    for (size_t k=0; k<InterfaceSize; k++)
+    if (record_address(data) >= BLOCK_COUNT) return false;
+
+    StateUpdate Update;
+    record_store((uint8_t)record_address(data), data + RECORD_ADDR_SIZE);
+    return true;
+}
+
+static bool cmd_get_record_range(Interface& Serial, uint8_t* data, unsigned)  // every block is its own packet with CRC, no waiting between them
+{
+    if (!record_range_valid(data)) return false;
+
+    const unsigned address = record_address(data);
+    const unsigned count = data[RECORD_ADDR_SIZE];
+
+    StateRead Snapshot;     // whole range from one snapshot
+    for (unsigned k = 0; k < count; k++) Serial.write_output(record_block((uint8_t)(address + k)), BLOCK_SIZE);
+    return true;
+}
+
+static bool cmd_put_record_range(Interface& Serial, uint8_t* data, unsigned)  // blocks are stored as they arrive; after NAK, part of the range may be written
+{
+    if (!record_range_valid(data)) return false;
+
+    const unsigned address = record_address(data);
+    const unsigned count = data[RECORD_ADDR_SIZE];
+
+    bool good = true;
+    for (unsigned k = 0; k < count; k++)
     {
-        R = std::max(std::max<size_t>(Interface[k].data_length, svc_strlen(Interface[k].command)), R);
+        if (Serial.read_input_wait(data, BLOCK_SIZE) != BLOCK_SIZE)
+        {
+            good = false;   // the rest is still read, so it is not taken for commands
+            continue;
+        }
+
+        if (good)
+        {
+            StateUpdate Update;
+            record_store((uint8_t)(address + k), data);
+        }
     }
-    return R;
+    return good;
 }
 
-static const size_t MinBufferLength = svc_ifacedim();
-*/
+static bool cmd_sync_records(Interface&, uint8_t*, unsigned)                  // cached blocks => storage
+{
+    StateUpdate Update;
+    record_sync();
+    return true;
+}
+
+static bool cmd_set_framing(Interface& Serial, uint8_t* data, unsigned)       // answer in the old framing, then switch
+{
+    const FrameMode mode = (FrameMode)(data[0] & ~FRAME_TAGGED);
+    const bool good = Serial.has_frame_mode(mode);
 
+    const uint8_t Rcode = (uint8_t)(good ? KeyResponse::ACK : KeyResponse::NAK);
+    Serial.write_output(&Rcode, 1);
+    if (good)
+    {
+        Serial.set_frame_mode(mode);
+        Serial.set_tagged(data[0] & FRAME_TAGGED);
+    }
+    return good;
+}
 
-int main()
+static bool cmd_get_status(Interface& Serial, uint8_t* data, unsigned)        // counters, see telemetry.h
 {
-    // initialization
+    telemetry_link_errors(Serial.take_link_errors());
+    Serial.write_output(data, telemetry_report(data));
+    return true;
+}
 
-    Interface Serial(hdw_getchar, hwd_putchar);
+// -------------------------------------------------------------
 
-    for (unsigned k = 0; k < KEY_SIZE; k++) KeyPermutation[k] = (uint8_t)k;
-    recalculate_key_sorting();
+// what the handler sends itself
+enum class CommandReply : uint8_t
+{
+    code,       // nothing: ACK or NAK is sent after it
+    data,       // the answer after success: NAK is sent after failure
+    self        // everything
+};
 
-    // main loop
+struct CommandDescr
+{
+    KeyFunction opcode;
+    unsigned length;        // parameters after the opcode, not including CRC
+    unsigned element;       // variable length: 1 byte count N first, then N elements of this size; 0 for fixed length
+    unsigned count_max;
+    CommandReply reply;
+    bool (*run)(Interface& Serial, uint8_t* data, unsigned length);
+};
+
+// exchange has no opcode, it is the frame of KEY_SIZE bytes
+static constexpr CommandDescr COMMANDS[] =
+{
+    { KeyFunction::prime_keys,       KEY_SIZE,                         0,        0,                  CommandReply::code, cmd_prime_keys       },
+    { KeyFunction::write_key,        KEY_ADDR_SIZE + 2*KEY_SIZE,       0,        0,                  CommandReply::code, cmd_write_key        },
+    { KeyFunction::erase_keys,       0,                                0,        0,                  CommandReply::code, cmd_erase_keys       },
+    { KeyFunction::exchange_batch,   1,                                KEY_SIZE, EXCHANGE_BATCH_MAX, CommandReply::data, cmd_exchange_batch   },
+    { KeyFunction::get_noise,        0,                                0,        0,                  CommandReply::data, cmd_get_noise        },
+    { KeyFunction::get_record,       RECORD_ADDR_SIZE,                 0,        0,                  CommandReply::data, cmd_get_record       },
+    { KeyFunction::put_record,       RECORD_ADDR_SIZE + BLOCK_SIZE,    0,        0,                  CommandReply::code, cmd_put_record       },
+    { KeyFunction::get_record_range, RECORD_RANGE_SIZE,                0,        0,                  CommandReply::code, cmd_get_record_range },
+    { KeyFunction::put_record_range, RECORD_RANGE_SIZE,                0,        0,                  CommandReply::code, cmd_put_record_range },
+    { KeyFunction::set_framing,      1,                                0,        0,                  CommandReply::self, cmd_set_framing      },
+    { KeyFunction::get_status,       0,                                0,        0,                  CommandReply::data, cmd_get_status       },
+    { KeyFunction::sync_records,     0,                                0,        0,                  CommandReply::code, cmd_sync_records     },
+};
+
+static constexpr unsigned command_params_max(const CommandDescr& D) { return D.length + D.count_max * D.element; }
 
-    while (true)
+// longest command frame: opcode and parameters
+static constexpr unsigned command_frame_max()
+{
+    unsigned R = 0;
+    for (const auto& D : COMMANDS) R = std::max(R, 1 + command_params_max(D));
+    return R;
+}
+
+// frame of KEY_SIZE bytes is exchange, no command may have this length
+static constexpr bool command_lengths_distinct()
+{
+    for (const auto& D : COMMANDS)
     {
-        int sym_in = EOF;
+        if (!D.element && 1 + D.length == KEY_SIZE) return false;
+        if (D.element && KEY_SIZE >= 1 + D.length && (KEY_SIZE - 1 - D.length) % D.element == 0 &&
+            (KEY_SIZE - 1 - D.length) / D.element <= D.count_max) return false;
+    }
+    return true;
+}
 
-        // command loop
+static constexpr unsigned COMMAND_FRAME_MAX = std::max(command_frame_max(), KEY_SIZE);
+static_assert(Interface::read_buffer_size(COMMAND_FRAME_MAX) <= BUFFER_LENGTH, "Command frame must fit into BUFFER");
+static_assert(command_lengths_distinct(), "Command frame cannot have the length of exchange");
 
-        auto L = Serial.read_input(BUFFER, 1, KEY_SIZE);
-        if (!L) continue;
+static const CommandDescr* find_command(uint8_t opcode)
+{
+    for (const auto& D : COMMANDS) if ((uint8_t)D.opcode == opcode) return &D;
+    return nullptr;
+}
+
+static bool command_length_valid(const CommandDescr& D, const uint8_t* data, unsigned length)
+{
+    if (!D.element) return length == D.length;
+    return length >= D.length && data[0] <= D.count_max && length == D.length + data[0] * D.element;
+}
+
+// command loop for one client, until it disconnects
+// command is one frame: opcode, then the parameters; the older form in two frames, opcode, then parameters,
+// is also accepted (opcode frame of 1 byte for command that has parameters)
+static void serve_client()
+{
+    Interface Serial(hdw_getchar, hwd_putchar, hdw_flush, hdw_getbyte);
+    uint8_t BUFFER[BUFFER_LENGTH];
+
+    while (hdw_connected())
+    {
+        auto L = Serial.read_input_variable(BUFFER, COMMAND_FRAME_MAX);
+        if (!L)
+        {
+            telemetry_link_errors(Serial.take_link_errors());
+            record_idle();
+            continue;
+        }
+
+        const uint32_t started = hdw_get_micros();
+        Serial.set_output_tag(Serial.get_input_tag());      // answer has ID of the command
 
         if (L == KEY_SIZE)
         {
             // search
-            Serial.write_output(hdw_get_block_ptr(0), KEY_SIZE);
+            StateRead Snapshot;
+            int idx = find_key_index(BUFFER);
+            if (idx >= 0)
+            {
+                Serial.write_output(hdw_get_key_ptr((key_addr_t)idx) + KEY_SIZE, KEY_SIZE);
+            }
+            else
+            {
+                uint8_t Rcode = (uint8_t)KeyResponse::NAK;
+                Serial.write_output(&Rcode, 1);
+            }
+            telemetry_request(StatusSlot::exchange, idx < 0, hdw_get_micros() - started);
+            continue;
         }
-        else if (L == 1)
+
+        const uint8_t opcode = BUFFER[0];
+        const CommandDescr* D = find_command(opcode);
+        bool good = false;
+
+        if (D)
         {
-            uint8_t Rcode = (uint8_t)KeyResponse::NAK;
+            uint8_t* data = BUFFER + 1;
+            unsigned length = L - 1;
 
-            switch (BUFFER[0])
+            if (L == 1 && command_params_max(*D))   // two frames
             {
-            case (int)KeyFunction::prime_keys: // remember rotator, build index
-                if (Serial.read_input_wait(BUFFER, KEY_SIZE) == KEY_SIZE)
-                {
-                    for (unsigned k = 0; k < KEY_SIZE; k++) KeyPermutation[k] = BUFFER[k];
-                    recalculate_key_sorting();
-                    Rcode = (uint8_t)KeyResponse::ACK;
-                }
-                Serial.write_output(&Rcode, 1);
-                break;
+                length = D->element ? Serial.read_input_variable_wait(data, command_params_max(*D))
+                                    : Serial.read_input_wait(data, D->length);
             }
 
+            const bool valid = command_length_valid(*D, data, length);
+            good = valid && D->run(Serial, data, length);
+
+            if (!valid || D->reply == CommandReply::code || (D->reply == CommandReply::data && !good))
+            {
+                const uint8_t Rcode = (uint8_t)(good ? KeyResponse::ACK : KeyResponse::NAK);
+                Serial.write_output(&Rcode, 1);
+            }
         }
 
+        telemetry_request(status_slot(opcode), !good, hdw_get_micros() - started);
     }
+
+    StateUpdate Update;     // no one may be left to see the idle time
+    record_sync();
 }
 
-/*
-void func_prime_keys();
-void func_write_key();
-void func_erase_keys();
-void func_get_noise();
-void func_get_record();
-void func_put_record();
-*/
+int main(int argc, char* argv[])
+{
+    KeySearch search = KeySearch::sorted;
+    const char* store_path = nullptr;
+    const char* capture_path = nullptr;
+    bool pty = false;
+    const char* pty_link = nullptr;
+    bool link = false;
+    LinkModel Link;
+
+    for (int k = 1; k < argc; k++)
+    {
+        if (!strcmp(argv[k], "--bench")) return run_benchmarks();
+        if (!strcmp(argv[k], "--hash-index")) search = KeySearch::hashed;       // perfect hash lookup instead of binary search, see key_index.h
+        if (!strcmp(argv[k], "--trace")) hdw_set_trace(true);
+        if (!strcmp(argv[k], "--store") && k+1 < argc) store_path = argv[++k];
+        if (!strcmp(argv[k], "--capture") && k+1 < argc) capture_path = argv[++k];
+        if (!strcmp(argv[k], "--port") && k+1 < argc) hdw_set_port((unsigned)strtoul(argv[++k], nullptr, 0));     // one more simulator, for ekey_pool_type
+        if (!strcmp(argv[k], "--pty")) pty = true;
+        if (!strcmp(argv[k], "--pty-link") && k+1 < argc) { pty_link = argv[++k]; pty = true; }
+        if (!strcmp(argv[k], "--link")) link = true;
+        if (!strcmp(argv[k], "--baud") && k+1 < argc) { Link.Baud = (unsigned)strtoul(argv[++k], nullptr, 0); link = true; }
+        if (!strcmp(argv[k], "--usb-latency") && k+1 < argc) { Link.Latency_us = (unsigned)strtoul(argv[++k], nullptr, 0); link = true; }
+        if (!strcmp(argv[k], "--jitter") && k+1 < argc) { Link.Jitter_us = (unsigned)strtoul(argv[++k], nullptr, 0); link = true; }
+        if (!strcmp(argv[k], "--noise-seed") && k+1 < argc) noise_set_fixed_seed(strtoull(argv[++k], nullptr, 0));   // repeatable noise, for tests
+    }
+
+    // initialization
+
+    StoreOpen store = StoreOpen::created;
+    if (store_path)
+    {
+        store = open_state_store(store_path);
+        if (store == StoreOpen::failed)
+        {
+            fprintf(stderr, "EKey simulation: cannot map %s\n", store_path);
+            return -1;
+        }
+    }
+
+    {
+        StateUpdate Update;
+        if (store != StoreOpen::loaded)
+        {
+            uint8_t identity[KEY_SIZE];
+            for (unsigned k = 0; k < KEY_SIZE; k++) identity[k] = (uint8_t)k;
+            set_key_search(search);
+            prime_key_sorting(identity);
+        }
+        else if (key_index().SearchMode != search)      // image has the index ready, unless the method is changed
+        {
+            set_key_search(search);
+        }
+    }
+
+    if (capture_path && !capture_start(capture_path))
+    {
+        fprintf(stderr, "EKey simulation: cannot create %s\n", capture_path);
+        return -1;
+    }
+
+#ifdef _WIN32
+    if (pty)
+    {
+        fprintf(stderr, "EKey simulation: --pty needs a pseudo-terminal, Windows has none; clients connect over TCP\n");
+        return -1;
+    }
+#endif
+
+    if (pty && !hdw_open_pty(pty_link))
+    {
+        fprintf(stderr, "EKey simulation: cannot open pseudo-terminal%s%s\n", pty_link ? " as " : "", pty_link ? pty_link : "");
+        return -1;
+    }
+
+    if (link)
+    {
+        if (!Link.Baud) Link.Baud = SERIAL_SPEED;
+        link_enable(Link);
+        printf("EKey simulation: link %u baud, USB latency %u us, jitter %u us\n", Link.Baud, Link.Latency_us, Link.Jitter_us);
+        fflush(stdout);
+    }
+
+    // main loop
+
+    hdw_serve(serve_client);
+}
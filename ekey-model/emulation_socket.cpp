@@ -0,0 +1,197 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <chrono>
+#include <thread>
+
+#include <SKLib/sklib.hpp>
+#include "emulation_socket.h"
+
+#ifdef EMULATION_SOCKET
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+typedef SOCKET native_socket_type;
+typedef int socket_length_type;
+static constexpr int SEND_FLAGS = 0;
+static int socket_poll(pollfd* fds, unsigned count, int timeout_ms) { return WSAPoll(fds, count, timeout_ms); }
+static void socket_close(socket_handle_type h) { closesocket((SOCKET)h); }
+#else
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <unistd.h>
+typedef int native_socket_type;
+typedef socklen_t socket_length_type;
+static constexpr int SEND_FLAGS = MSG_NOSIGNAL;     // closed peer is reported by return value, not by signal
+static int socket_poll(pollfd* fds, unsigned count, int timeout_ms) { return poll(fds, count, timeout_ms); }
+static void socket_close(socket_handle_type h) { ::close((int)h); }
+#endif
+
+// true if the socket is ready for reading (data, connection, or close) within timeout_ms
+static bool socket_wait_input(socket_handle_type h, int timeout_ms)
+{
+    pollfd P = {};
+    P.fd = (native_socket_type)h;
+    P.events = POLLIN;
+    return socket_poll(&P, 1, timeout_ms) > 0;
+}
+
+static void socket_startup()
+{
+#ifdef _WIN32
+    static const bool Started = []() { WSADATA wsa; return !WSAStartup(MAKEWORD(2, 2), &wsa); }();
+    (void)Started;
+#endif
+}
+
+static void socket_no_delay(socket_handle_type h)
+{
+    int on = 1;   // frames are short, and answer is waited for
+    setsockopt((native_socket_type)h, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+}
+
+socket_listen_type::socket_listen_type(unsigned port)
+{
+    socket_startup();
+
+    auto h = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    handle = (socket_handle_type)h;
+    if (handle == SOCKET_NONE) return;
+
+    int on = 1;
+    setsockopt(h, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+
+    sockaddr_in A = {};
+    A.sin_family = AF_INET;
+    A.sin_addr.s_addr = htonl(INADDR_ANY);
+    A.sin_port = htons((uint16_t)port);
+
+    if (bind(h, (sockaddr*)&A, sizeof(A)) || listen(h, SOMAXCONN))
+    {
+        socket_close(handle);
+        handle = SOCKET_NONE;
+    }
+}
+
+socket_listen_type::~socket_listen_type()
+{
+    if (handle != SOCKET_NONE) socket_close(handle);
+}
+
+socket_handle_type socket_listen_type::accept_wait(int timeout_ms)
+{
+    if (handle == SOCKET_NONE || !socket_wait_input(handle, timeout_ms)) return SOCKET_NONE;
+
+    sockaddr_in A = {};
+    socket_length_type L = sizeof(A);
+    auto h = (socket_handle_type)accept((native_socket_type)handle, (sockaddr*)&A, &L);
+    if (h == SOCKET_NONE) return SOCKET_NONE;
+
+    socket_no_delay(h);
+    return h;
+}
+
+void socket_stream_type::attach(socket_handle_type h)
+{
+    close();
+    handle = h;
+}
+
+void socket_stream_type::close()
+{
+    if (handle != SOCKET_NONE) socket_close(handle);
+    handle = SOCKET_NONE;
+    input_pos = input_len = 0;
+}
+
+void socket_stream_type::shutdown()
+{
+#ifdef _WIN32
+    if (handle != SOCKET_NONE) ::shutdown((native_socket_type)handle, SD_BOTH);
+#else
+    if (handle != SOCKET_NONE) ::shutdown((native_socket_type)handle, SHUT_RDWR);
+#endif
+}
+
+bool socket_stream_type::connect(const char* host, unsigned port, int timeout_ms)
+{
+    close();
+    socket_startup();
+
+    sockaddr_in A = {};
+    A.sin_family = AF_INET;
+    A.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &A.sin_addr) != 1) return false;
+
+    // blocking connect; loopback and LAN answer at once, timeout_ms is for the retries when the server is starting
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (true)
+    {
+        auto h = (socket_handle_type)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (h == SOCKET_NONE) return false;
+
+        if (!::connect((native_socket_type)h, (sockaddr*)&A, sizeof(A)))
+        {
+            socket_no_delay(h);
+            handle = h;
+            return true;
+        }
+
+        socket_close(h);
+        if (std::chrono::steady_clock::now() >= deadline) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+
+bool socket_stream_type::read(uint8_t& c, int timeout_ms)
+{
+    if (input_pos >= input_len)
+    {
+        if (handle == SOCKET_NONE || !socket_wait_input(handle, timeout_ms)) return false;
+
+        const auto L = recv((native_socket_type)handle, (char*)input, sizeof(input), 0);
+        if (L <= 0)     // closed by peer, or error
+        {
+            close();
+            return false;
+        }
+
+        input_pos = 0;
+        input_len = (unsigned)L;
+    }
+
+    c = input[input_pos++];
+    return true;
+}
+
+bool socket_stream_type::write(const uint8_t* data, unsigned length)
+{
+    while (length && handle != SOCKET_NONE)
+    {
+        const auto L = send((native_socket_type)handle, (const char*)data, length, SEND_FLAGS);
+        if (L <= 0)
+        {
+            close();
+            return false;
+        }
+        data += L;
+        length -= (unsigned)L;
+    }
+
+    return !length;
+}
+
+#endif
@@ -0,0 +1,65 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// TCP transport of the simulator. Unlike polling of the stream, the calls below sleep in poll() until
+// the socket is ready or the timeout expires, so idle simulator does not take CPU time.
+
+#pragma once
+#include "interface.h"
+
+#ifdef EMULATION_SOCKET
+
+typedef intptr_t socket_handle_type;                    // SOCKET on Windows, int elsewhere
+static constexpr socket_handle_type SOCKET_NONE = -1;
+
+// listening socket on all local interfaces
+class socket_listen_type
+{
+public:
+    explicit socket_listen_type(unsigned port);
+    ~socket_listen_type();
+
+    bool is_listening() const { return handle != SOCKET_NONE; }
+
+    // waits for incoming connection up to timeout_ms; returns SOCKET_NONE if there is none
+    socket_handle_type accept_wait(int timeout_ms);
+
+private:
+    socket_handle_type handle = SOCKET_NONE;
+};
+
+// connected socket, input is received in chunks and given out by byte
+class socket_stream_type
+{
+public:
+    socket_stream_type() = default;
+    ~socket_stream_type() { close(); }
+
+    void attach(socket_handle_type h);
+    void close();
+
+    // ends the connection both ways, read() in other thread returns false; close() is still needed
+    void shutdown();
+
+    // client side: connects to host (IPv4 address) and port, waits up to timeout_ms
+    bool connect(const char* host, unsigned port, int timeout_ms);
+    bool is_connected() const { return handle != SOCKET_NONE; }
+
+    // returns false if nothing has arrived in timeout_ms, or connection is closed
+    bool read(uint8_t& c, int timeout_ms);
+    bool write(const uint8_t* data, unsigned length);
+
+private:
+    socket_handle_type handle = SOCKET_NONE;
+    uint8_t input[256];
+    unsigned input_pos = 0;
+    unsigned input_len = 0;
+};
+
+#endif
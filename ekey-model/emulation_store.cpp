@@ -0,0 +1,126 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <SKLib/sklib.hpp>
+#include "emulation_store.h"
+
+#ifdef EMULATION_SOCKET
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+bool mapped_file_type::open(const char* path, size_t length)
+{
+    close();
+
+    HANDLE f = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (f == INVALID_HANDLE_VALUE) return false;
+
+    // mapping of the given size extends the file with zeros
+    HANDLE m = CreateFileMappingA(f, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)length >> 32), (DWORD)(length & 0xFFFFFFFFu), nullptr);
+    void* p = m ? MapViewOfFile(m, FILE_MAP_ALL_ACCESS, 0, 0, length) : nullptr;
+    if (!p)
+    {
+        if (m) CloseHandle(m);
+        CloseHandle(f);
+        return false;
+    }
+
+    file = (intptr_t)f;
+    mapping = (intptr_t)m;
+    address = (uint8_t*)p;
+    mapped_length = length;
+    return true;
+}
+
+void mapped_file_type::close()
+{
+    if (address)
+    {
+        FlushViewOfFile(address, mapped_length);
+        UnmapViewOfFile(address);
+        CloseHandle((HANDLE)mapping);
+        CloseHandle((HANDLE)file);
+    }
+
+    address = nullptr;
+    mapped_length = 0;
+    file = -1;
+    mapping = 0;
+}
+
+void mapped_file_type::flush(size_t offset, size_t length)
+{
+    if (address) FlushViewOfFile(address + offset, length);
+}
+
+#else
+
+bool mapped_file_type::open(const char* path, size_t length)
+{
+    close();
+
+    int f = ::open(path, O_RDWR | O_CREAT, 0600);
+    if (f < 0) return false;
+
+    struct stat S = {};
+    if (fstat(f, &S) || ((size_t)S.st_size != length && ftruncate(f, (off_t)length)))     // extension reads as zeros
+    {
+        ::close(f);
+        return false;
+    }
+
+    void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+    if (p == MAP_FAILED)
+    {
+        ::close(f);
+        return false;
+    }
+
+    file = f;
+    address = (uint8_t*)p;
+    mapped_length = length;
+    return true;
+}
+
+void mapped_file_type::close()
+{
+    if (address)
+    {
+        msync(address, mapped_length, MS_SYNC);
+        munmap(address, mapped_length);
+        ::close((int)file);
+    }
+
+    address = nullptr;
+    mapped_length = 0;
+    file = -1;
+}
+
+void mapped_file_type::flush(size_t offset, size_t length)
+{
+    if (!address) return;
+
+    // msync wants page aligned start
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t start = offset - offset % page;
+    msync(address + start, length + (offset - start), MS_ASYNC);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,45 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// File mapped into memory, the persistent storage of the simulator (the firmware keeps keys and blocks in flash).
+// Writes to the mapped area reach the file without explicit I/O; flush() schedules them to disk.
+
+#pragma once
+#include "interface.h"
+
+#ifdef EMULATION_SOCKET
+
+class mapped_file_type
+{
+public:
+    mapped_file_type() = default;
+    ~mapped_file_type() { close(); }
+
+    mapped_file_type(const mapped_file_type&) = delete;
+    mapped_file_type& operator=(const mapped_file_type&) = delete;
+
+    // opens or creates the file, sets its size (new space is zero), maps it read-write
+    bool open(const char* path, size_t length);
+    void close();
+
+    bool is_open() const { return address != nullptr; }
+    uint8_t* data() const { return address; }
+    size_t size() const { return mapped_length; }
+
+    // asks the OS to write the range to disk, does not wait
+    void flush(size_t offset, size_t length);
+
+private:
+    uint8_t* address = nullptr;
+    size_t mapped_length = 0;
+    intptr_t file = -1;         // HANDLE on Windows, int elsewhere
+    intptr_t mapping = 0;       // Windows only
+};
+
+#endif
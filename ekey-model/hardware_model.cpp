@@ -7,8 +7,18 @@
 // Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 //
 
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+
 #include <SKLib/sklib.hpp>
 #include "hardware_model.h"
+#include "emulation_socket.h"
+#include "shared_state.h"
+#include "capture.h"
+#include "link_model.h"
+#include "serial_port.h"
 
 // -------------------------------------------------------------
 
@@ -20,77 +30,220 @@ static self_init CHECK;
 
 #ifdef EMULATION_SOCKET
 
-static std::shared_ptr<uint8_t> KEY_STORE_ROOT;
-static std::shared_ptr<uint8_t> BLOCK_STORE_ROOT;
-static sklib::stream_tcpip_type SOCKET_IO(true, SOCKET_EKEY_PORT);  // server mode
-static bool MODE_RECEIVE = false;
+#ifdef __linux__
+#include <errno.h>
+#include <sys/random.h>
+#endif
 
-void hdw_init()
+// key and block storage is in SharedState, see shared_state.h
+static unsigned SOCKET_PORT = SOCKET_EKEY_PORT;
+static thread_local socket_stream_type* SOCKET_IO = nullptr;     // client of the thread
+
+// --pty: one more client, on the serial line, served by its own thread like a TCP client, but forever
+static serial_port_type PTY;
+static thread_local serial_port_type* PTY_IO = nullptr;
+
+// output is collected per frame and sent by hdw_flush() in one write
+static constexpr unsigned OUTPUT_SIZE = 4096;
+static thread_local uint8_t OUTPUT[OUTPUT_SIZE];
+static thread_local unsigned OUTPUT_LENGTH = 0;
+
+// console echo of the traffic (--trace), one line per frame
+static bool TRACE = false;
+static thread_local char TRACE_INPUT[OUTPUT_SIZE];
+static thread_local unsigned TRACE_INPUT_LENGTH = 0;
+
+static void trace_line(const char* prefix, const uint8_t* data, unsigned length, bool complete)
 {
-    srand((unsigned)time(nullptr));
-    KEY_STORE_ROOT = std::shared_ptr<uint8_t>(new uint8_t[2*KEY_COUNT*KEY_SIZE]());      // arrays are initialized with all 0-s
-    BLOCK_STORE_ROOT = std::shared_ptr<uint8_t>(new uint8_t[BLOCK_COUNT*BLOCK_SIZE]());
+    std::string line(prefix);
+    for (unsigned k = 0; k < length; k++) line += (data[k] < ' ' || data[k] > '~') ? '.' : (char)data[k];
+    if (!complete) line += " ...";
+    line += '\n';
 
+    fwrite(line.data(), 1, line.size(), stdout);    // whole line at once, threads do not mix
+    fflush(stdout);
+}
+
+void hdw_init()
+{
     fputs("EKey simulation ON\n", stdout);
     fflush(stdout);
 }
 
-uint8_t* hdw_get_key_ptr(uint8_t idx)
+uint8_t* hdw_get_key_ptr(key_addr_t idx)
 {
-    return KEY_STORE_ROOT.get() + 2*KEY_SIZE*idx;
+    return shared_key_pair(idx);
 }
 
-void hdw_store_key_pair(uint8_t idx, uint8_t *key, uint8_t *payload)
+void hdw_store_key_pair(key_addr_t idx, uint8_t *key, uint8_t *payload)
 {
-    uint8_t *ptr = hdw_get_key_ptr(idx);
+    uint8_t *ptr = shared_key_pair_write(idx);
     memcpy(ptr, key, KEY_SIZE);
     memcpy(ptr+KEY_SIZE, payload, KEY_SIZE);
 }
 
-uint8_t hdw_get_noise()
+// OS generator: getrandom() on Linux, random_device elsewhere (RtlGenRandom in MSVC runtime)
+bool hdw_get_entropy(uint8_t* dest, unsigned length)
+{
+#ifdef __linux__
+    while (length)
+    {
+        const ssize_t n = getrandom(dest, length, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        dest += n;
+        length -= (unsigned)n;
+    }
+    return true;
+#else
+    try
+    {
+        std::random_device Source;
+        for (unsigned k = 0; k < length; k++) dest[k] = (uint8_t)(Source() & sklib::OCTET_MASK);
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+#endif
+}
+
+uint32_t hdw_get_micros()
 {
-    return (uint8_t)(rand() & sklib::OCTET_MASK);
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 uint8_t* hdw_get_block_ptr(uint8_t idx)
 {
-    return BLOCK_STORE_ROOT.get() + BLOCK_SIZE*idx;
+    return shared_block(idx);
 }
 
 void hdw_store_block(uint8_t idx, uint8_t *block)
 {
-    memcpy(hdw_get_block_ptr(idx), block, BLOCK_SIZE);
+    memcpy(shared_block_write(idx), block, BLOCK_SIZE);
 }
 
-bool hdw_getchar(int& ch)
+// waits for the character up to READ_DELAY_MS, which is the longest pause that Interface allows within packet
+bool hdw_getbyte(int& ch)
 {
+    if (!hdw_connected()) return false;
+
     uint8_t c = ' ';
-    auto R = SOCKET_IO.read(&c);
+    auto R = PTY_IO ? PTY_IO->read(c, READ_DELAY_MS) : SOCKET_IO->read(c, READ_DELAY_MS);
     if (!R) return false;
 
-    if (!MODE_RECEIVE)
+    link_receive_byte();
+    capture_byte(CaptureKind::to_device, c);
+
+    if (TRACE)
     {
-        MODE_RECEIVE = true;
-        fputs("\ninp> ", stdout);
+        const bool end = (!c || c == '\n' || c == '\r');     // base64 or COBS frame
+        if (!end) TRACE_INPUT[TRACE_INPUT_LENGTH++] = c;
+        if (end || TRACE_INPUT_LENGTH == OUTPUT_SIZE)
+        {
+            trace_line("inp> ", (const uint8_t*)TRACE_INPUT, TRACE_INPUT_LENGTH, end);
+            TRACE_INPUT_LENGTH = 0;
+        }
     }
 
-    putchar(c);
-    fflush(stdout);
+    ch = c;
+    return true;
+}
 
-    ch = ((c<' ') ? EOF : c);
+bool hdw_getchar(int& ch)
+{
+    if (!hdw_getbyte(ch)) return false;
+    if (ch < ' ') ch = EOF;
     return true;
 }
 
 void hwd_putchar(int ch)
 {
-    if (MODE_RECEIVE)
+    OUTPUT[OUTPUT_LENGTH++] = (uint8_t)ch;
+    if (OUTPUT_LENGTH == OUTPUT_SIZE) hdw_flush();
+}
+
+void hdw_flush()
+{
+    if (!OUTPUT_LENGTH) return;
+
+    bool sent = hdw_connected();
+    for (unsigned k = 0, n = 0; sent && k < OUTPUT_LENGTH; k += n)     // in one write, unless the link model splits it
     {
-        MODE_RECEIVE = false;
-        fputs("\nout> ", stdout);
+        n = link_send(OUTPUT_LENGTH - k, !k);
+        sent = PTY_IO ? PTY_IO->write(OUTPUT + k, n) : SOCKET_IO->write(OUTPUT + k, n);
     }
+    if (sent) capture_frame(CaptureKind::from_device, OUTPUT, OUTPUT_LENGTH);
+    if (TRACE) trace_line(sent ? "out> " : "out# ", OUTPUT, OUTPUT_LENGTH, true);
+    OUTPUT_LENGTH = 0;
+}
+
+void hdw_set_trace(bool on)
+{
+    TRACE = on;
+}
+
+void hdw_set_port(unsigned port)
+{
+    SOCKET_PORT = port;
+}
+
+bool hdw_open_pty(const char* link)
+{
+    if (!PTY.open_pty(link)) return false;
 
-    putc(SOCKET_IO.write(ch) ? ch : '#', stdout);
+    printf("EKey simulation: serial line on %s%s%s\n", PTY.path(), link ? " as " : "", link ? link : "");
     fflush(stdout);
+    return true;
+}
+
+void hdw_serve(void (*serve_client)())
+{
+    if (PTY.is_open())
+    {
+        std::thread([serve_client]()
+        {
+            PTY_IO = &PTY;
+            link_opened();
+            capture_opened();
+            while (true) serve_client();    // the line is always there; a client that goes away just stops talking
+        }).detach();
+    }
+
+    socket_listen_type Listen(SOCKET_PORT);
+    if (!Listen.is_listening())
+    {
+        fprintf(stderr, "EKey simulation: cannot listen on port %u\n", SOCKET_PORT);
+        return;
+    }
+
+    while (true)
+    {
+        auto h = Listen.accept_wait(-1);
+        if (h == SOCKET_NONE) continue;
+
+        std::thread([h, serve_client]()
+        {
+            socket_stream_type Client;
+            Client.attach(h);
+            SOCKET_IO = &Client;
+            link_opened();
+            capture_opened();
+            serve_client();
+            capture_closed();
+            OUTPUT_LENGTH = TRACE_INPUT_LENGTH = 0;
+            SOCKET_IO = nullptr;
+        }).detach();
+    }
+}
+
+bool hdw_connected()
+{
+    return PTY_IO || (SOCKET_IO && SOCKET_IO->is_connected());
 }
 
 #endif
@@ -102,16 +255,23 @@ void hwd_putchar(int ch)
 void hdw_init()
 {}
 
-uint8_t* hdw_get_key_ptr(uint8_t idx)
+uint8_t* hdw_get_key_ptr(key_addr_t idx)
 {
     return nullptr;
 }
 
-void hdw_store_key_pair(uint8_t idx, uint8_t *key, uint8_t *payload)
+void hdw_store_key_pair(key_addr_t idx, uint8_t *key, uint8_t *payload)
 {
 }
 
-uint8_t hdw_get_noise()
+// to be read from the TRNG of the chip
+bool hdw_get_entropy(uint8_t* dest, unsigned length)
+{
+    return false;
+}
+
+// to be read from the SysTick or TC counter
+uint32_t hdw_get_micros()
 {
     return 0;
 }
@@ -130,9 +290,41 @@ bool hdw_getchar(uint8_t& ch)
     return false;
 }
 
+bool hdw_getbyte(int& ch)
+{
+    return false;
+}
+
 void hwd_putchar(uint8_t ch);
 {
 }
 
+void hdw_flush()
+{
+}
+
+void hdw_set_trace(bool on)
+{
+}
+
+void hdw_set_port(unsigned port)
+{
+}
+
+bool hdw_open_pty(const char* link)
+{
+    return false;
+}
+
+void hdw_serve(void (*serve_client)())
+{
+    while (true) serve_client();
+}
+
+bool hdw_connected()
+{
+    return true;
+}
+
 #endif
 
@@ -18,10 +18,14 @@
 
 // will use autoinit by static instantination of a class wi all initializations
 
-uint8_t* hdw_get_key_ptr(uint8_t idx);
-void hdw_store_key_pair(uint8_t idx, uint8_t* key, uint8_t* payload);
+uint8_t* hdw_get_key_ptr(key_addr_t idx);
+void hdw_store_key_pair(key_addr_t idx, uint8_t* key, uint8_t* payload);
 
-uint8_t hdw_get_noise();
+// true random bytes that seed the noise generator (see noise.h); false if there is no source
+bool hdw_get_entropy(uint8_t* dest, unsigned length);
+
+// free running microsecond counter, for service time; wraps around
+uint32_t hdw_get_micros();
 
 uint8_t* hdw_get_block_ptr(uint8_t idx);
 void hdw_store_block(uint8_t idx, uint8_t* block);
@@ -32,3 +36,28 @@ void hdw_store_block(uint8_t idx, uint8_t* block);
 bool hdw_getchar(int& ch);
 void hwd_putchar(int ch);
 
+// same as getchar, but any byte value is data, for binary framing
+bool hdw_getbyte(int& ch);
+
+// putchar may only collect the frame, flush sends it out; Interface calls it after every frame
+void hdw_flush();
+
+// simulator: echo of all traffic to the console, one line per frame
+void hdw_set_trace(bool on);
+
+// simulator: TCP port to listen on, SOCKET_EKEY_PORT unless set before hdw_serve(); several simulators
+// on one machine are several devices for the client
+void hdw_set_port(unsigned port);
+
+// simulator: the device also on the serial line, master side of a new pseudo-terminal (Linux only);
+// link is a symbolic link to the slave for the client to open, may be null; as on the device, the line
+// is always there, and the framing set by one client stays for the next
+bool hdw_open_pty(const char* link);
+
+// runs serve_client() for every client; simulator accepts many clients, each in its own thread,
+// where hdw_getchar() and hwd_putchar() talk to that client; firmware has one client, forever
+void hdw_serve(void (*serve_client)());
+
+// false when the client of the calling thread has disconnected
+bool hdw_connected();
+
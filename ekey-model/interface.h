@@ -36,19 +36,60 @@ enum class KeyFunction {
     erase_keys = 0x33,
     get_noise  = 0x44,
     get_record = 0x55,
-    put_record = 0x66 };
+    put_record = 0x66,
+    exchange_batch = 0x77,
+    set_framing = 0x88,
+    get_record_range = 0x99,
+    put_record_range = 0xAA,
+    get_status = 0xBB,
+    sync_records = 0xCC };
 
 enum class KeyResponse {
     ACK = 0xA5,
     NAK = 0x5A };
 
+// framing of packets on the wire; connection starts in base64
+// set_framing: 1 byte FrameMode => ACK in the old framing, then both sides use the new one
+// cobs: packet and CRC are byte-stuffed (COBS), so 0x00 never appears inside, and 0x00 ends the frame;
+// overhead is 1 byte per 254 plus the delimiter, vs 1/3 for base64
+
+enum class FrameMode {
+    base64 = 0,
+    cobs   = 1 };
+
+// set_framing: mode | FRAME_TAGGED => every packet starts with 1 byte request ID (covered by CRC);
+// the answer carries the ID of the command packet, so the client may send more requests before the answers
+static constexpr uint8_t FRAME_TAGGED = 0x80;
+
 // data sizes
 
-static const unsigned KEY_COUNT = sklib::OCTET_ADDRESS_SPAN;    // keys are arranged in pairs
+// key address in the hardware API and in write_key: 1 byte on the hardware (256 pairs);
+// 2 bytes for larger tables, up to 65536 pairs: -DEKEY_KEY_ADDRESS_BYTES=2, and optionally -DEKEY_KEY_COUNT=N
+// for a smaller table: any N from 32 up to what the address can hold
+#ifndef EKEY_KEY_ADDRESS_BYTES
+#define EKEY_KEY_ADDRESS_BYTES 1
+#endif
+
+#if EKEY_KEY_ADDRESS_BYTES == 1
+typedef uint8_t key_addr_t;
+#elif EKEY_KEY_ADDRESS_BYTES == 2
+typedef uint16_t key_addr_t;
+#else
+#error EKEY_KEY_ADDRESS_BYTES must be 1 or 2
+#endif
+
+#ifndef EKEY_KEY_COUNT
+#define EKEY_KEY_COUNT (1u << (8 * EKEY_KEY_ADDRESS_BYTES))
+#endif
+
+static const unsigned KEY_ADDR_SIZE = EKEY_KEY_ADDRESS_BYTES;   // big endian on the wire
+static const unsigned KEY_COUNT = EKEY_KEY_COUNT;               // keys are arranged in pairs
 static const unsigned KEY_SIZE  = sklib::OCTET_ADDRESS_SPAN;
 
 static const unsigned BLOCK_COUNT = 32;         // blocks are "file"
 static const unsigned BLOCK_SIZE  = 1024;       // 1 kb
+static const unsigned RECORD_ADDR_SIZE = 2;     // block address in get/put record, big endian
+static const unsigned RECORD_RANGE_SIZE = RECORD_ADDR_SIZE + 1;    // address, 1 byte count of blocks
 
 // communications
 
@@ -56,6 +97,7 @@ static constexpr unsigned SOCKET_EKEY_PORT = 13579;
 static constexpr unsigned SERIAL_SPEED     = 9600;
 static constexpr unsigned USB_VID = 0xF055u;   // "FOSS"
 static constexpr unsigned USB_PID = 0xE4E7u;   // "EKEY"
+static constexpr unsigned READ_DELAY_MS    = 500;      // same as Interface::read_delay, for transports that can wait
 
 // configuration test
 
@@ -73,15 +115,65 @@ static constexpr unsigned USB_PID = 0xE4E7u;   // "EKEY"
 
 // functions
 
+#include "crc.h"
+
+// receive errors: frame with bad CRC, bad framing or length, pause within the frame longer than read_delay
+struct LinkErrors
+{
+    uint32_t crc = 0;
+    uint32_t framing = 0;
+    uint32_t timeout = 0;
+};
+
 class Interface
 {
 private:
     sklib::base64_type IO;  // will be initialized in constructor
+    void (*flush)();        // sends what cput has collected, once per frame; may be nullptr
+    bool (*bget)(int&);     // raw byte input, for binary framing; may be nullptr
+    void (*bput)(int);
+    FrameMode mode = FrameMode::base64;
+    bool tagged = false;
+    uint8_t input_tag = 0;      // ID of the last packet received
+    uint8_t output_tag = 0;     // ID of the packets sent
+    LinkErrors errors;
     static constexpr unsigned crc_size = 2;
-    static constexpr auto read_delay = 500_ms_sklib;
+    static constexpr auto read_delay = 500_ms_sklib;    // READ_DELAY_MS
 
 public:
-    Interface(bool (*cget)(int&), void (*cput)(int)) : IO(cget, cput) {}
+    Interface(bool (*cget)(int&), void (*cput)(int), void (*cflush)() = nullptr, bool (*cget_raw)(int&) = nullptr)
+        : IO(cget, cput), flush(cflush), bget(cget_raw), bput(cput) {}
+
+    // binary framing needs the raw input function
+    bool has_frame_mode(FrameMode new_mode) const
+    {
+        return new_mode == FrameMode::base64 || (new_mode == FrameMode::cobs && bget);
+    }
+
+    // switches framing of the following packets
+    bool set_frame_mode(FrameMode new_mode)
+    {
+        if (!has_frame_mode(new_mode)) return false;
+        mode = new_mode;
+        IO.reset();
+        return true;
+    }
+
+    FrameMode get_frame_mode() const { return mode; }
+
+    // request ID in every packet, see FRAME_TAGGED
+    void set_tagged(bool on) { tagged = on; }
+    bool is_tagged() const { return tagged; }
+    uint8_t get_input_tag() const { return input_tag; }
+    void set_output_tag(uint8_t tag) { output_tag = tag; }
+
+    // returns the receive errors since the last call, and clears them
+    LinkErrors take_link_errors()
+    {
+        const LinkErrors R = errors;
+        errors = LinkErrors();
+        return R;
+    }
 
     // helper function to provide offset between data payload and total packet size
     // caller shall only care about I/O data size, buffer size is calculated
@@ -92,6 +184,20 @@ public:
     // returns 0 for no read or length of data packet
     unsigned read_input(uint8_t* buffer, unsigned block_len, unsigned alt_len = 0)
     {
+        return read_frame(buffer, block_len, alt_len, false);
+    }
+
+    // reads packet of any length from 1 to max_len bytes
+    unsigned read_input_variable(uint8_t* buffer, unsigned max_len)
+    {
+        return read_frame(buffer, max_len, 0, true);
+    }
+
+private:
+    unsigned read_frame(uint8_t* buffer, unsigned block_len, unsigned alt_len, bool any_len)
+    {
+        if (mode == FrameMode::cobs) return read_frame_cobs(buffer, block_len, alt_len, any_len);
+
         block_len = read_buffer_size(block_len);
         alt_len = read_buffer_size(alt_len);       // now lengths include CRC size
 
@@ -103,35 +209,158 @@ public:
         if (!IO.read_decode(sym_in) || sym_in < 0) return 0;  // no wait if idle or EOF
 
         sklib::timer_stopwatch_type timeout(read_delay);
-        buffer[pos_in++] = sym_in;
+        crc16_ccitt_type crc;                                 // over data and received CRC, as it arrives
+        if (tagged) input_tag = (uint8_t)sym_in;     // packet starts with request ID
+        else buffer[pos_in++] = sym_in;
+        crc.update((uint8_t)sym_in);
 
+        uint32_t* fault = &errors.timeout;
         while (!timeout)  // break for error condition
         {
             if (IO.read_decode(sym_in))
             {
                 if (sym_in < 0)
                 {
-                    if (pos_in > crc_size && (pos_in == block_len || pos_in == alt_len) &&
-                        sklib::crc_16_ccitt().update(buffer, pos_in-crc_size) == stream_to_uint16(buffer+pos_in-crc_size))
+                    const bool length_ok = pos_in > crc_size && (any_len || pos_in == block_len || pos_in == alt_len);
+                    if (length_ok && crc.get() == crc16_ccitt_type::residue)
                     {
                         IO.reset();
                         return pos_in - crc_size;  // successfull receive
                     }
 
+                    fault = length_ok ? &errors.crc : &errors.framing;
                     break;
                 }
 
-                if (pos_in >= max_len || IO.have_errors()) break;
+                if (pos_in >= max_len || IO.have_errors())
+                {
+                    fault = &errors.framing;
+                    break;
+                }
 
                 buffer[pos_in++] = sym_in;
+                crc.update((uint8_t)sym_in);
                 timeout.reset();
             }
         }
 
+        (*fault)++;
         IO.reset();
         return 0;
     }
 
+    // same as above, COBS decoding: code byte N is followed by N-1 data bytes, and 0x00 unless N is 0xFF
+    unsigned read_frame_cobs(uint8_t* buffer, unsigned block_len, unsigned alt_len, bool any_len)
+    {
+        block_len = read_buffer_size(block_len);
+        alt_len = read_buffer_size(alt_len);
+
+        unsigned pos_in = 0;
+        const unsigned max_len = std::max(block_len, alt_len);
+
+        int sym_in = 0;
+        if (!bget(sym_in) || !sym_in) return 0;     // no wait if idle or empty frame
+
+        sklib::timer_stopwatch_type timeout(read_delay);
+        crc16_ccitt_type crc;
+        unsigned code = sym_in;
+        unsigned left = code - 1;                   // data bytes remaining in the group
+        bool want_tag = tagged;
+
+        // next decoded byte; false if the packet is too long
+        auto store = [&](uint8_t b)
+        {
+            crc.update(b);
+            if (want_tag)
+            {
+                want_tag = false;
+                input_tag = b;
+                return true;
+            }
+            if (pos_in >= max_len) return false;
+            buffer[pos_in++] = b;
+            return true;
+        };
+
+        uint32_t* fault = &errors.timeout;
+        while (!timeout)
+        {
+            if (bget(sym_in))
+            {
+                if (!sym_in)
+                {
+                    const bool length_ok = !left && pos_in > crc_size && (any_len || pos_in == block_len || pos_in == alt_len);
+                    if (length_ok && crc.get() == crc16_ccitt_type::residue)
+                    {
+                        return pos_in - crc_size;
+                    }
+
+                    (length_ok ? errors.crc : errors.framing)++;
+                    return 0;   // frame is over, bad CRC or length
+                }
+
+                fault = &errors.framing;
+                if (!left)
+                {
+                    if (code < 0xFF && !store(0)) break;
+                    code = sym_in;
+                    left = code - 1;
+                }
+                else
+                {
+                    if (!store((uint8_t)sym_in)) break;
+                    left--;
+                }
+
+                fault = &errors.timeout;
+                timeout.reset();
+            }
+        }
+
+        (*fault)++;
+        skip_cobs_frame();
+        return 0;
+    }
+
+    // after error, drops the rest of the frame, so the next read starts at the delimiter
+    void skip_cobs_frame()
+    {
+        sklib::timer_stopwatch_type timeout(read_delay);
+        int sym_in = 0;
+        while (!timeout)
+        {
+            if (bget(sym_in))
+            {
+                if (!sym_in) return;
+                timeout.reset();
+            }
+        }
+    }
+
+    void write_frame_cobs(const uint8_t* buffer, unsigned length, const uint8_t* crc)
+    {
+        const unsigned head = tagged ? 1 : 0;
+        const unsigned total = head + length + crc_size;
+        auto at = [=](unsigned k) { return (k < head) ? output_tag : (k < head + length) ? buffer[k-head] : crc[k-head-length]; };
+
+        unsigned pos = 0;
+        while (true)
+        {
+            unsigned run = 0;
+            while (pos+run < total && run < 0xFE && at(pos+run)) run++;
+
+            bput(run + 1);
+            for (unsigned k = 0; k < run; k++) bput(at(pos+k));
+
+            pos += run;
+            if (pos >= total) break;
+            if (run < 0xFE) pos++;      // zero byte is implied by the code
+        }
+
+        bput(0);
+    }
+
+public:
     // version with wait for the read to arrive
     unsigned read_input_wait(uint8_t* buffer, unsigned block_len)
     {
@@ -140,24 +369,45 @@ public:
         {
             if (read_input(buffer, block_len)) return block_len;
         }
+        errors.timeout++;   // the packet has not started
+        return 0;
+    }
+
+    unsigned read_input_variable_wait(uint8_t* buffer, unsigned max_len)
+    {
+        sklib::timer_stopwatch_type timeout(read_delay);
+        while (!timeout)
+        {
+            auto L = read_input_variable(buffer, max_len);
+            if (L) return L;
+        }
+        errors.timeout++;
         return 0;
     }
 
     // send data packet, length does not include CRC
-    void write_output(uint8_t* buffer, unsigned length)
+    // cput may only collect the characters, the frame is passed on by flush() at the end
+    void write_output(const uint8_t* buffer, unsigned length)
     {
+        crc16_ccitt_type crc;
+        if (tagged) crc.update(output_tag);
+        const uint16_t crcval = crc.update(buffer, length).get();
+
+        if (mode == FrameMode::cobs)
+        {
+            const uint8_t crc_bytes[crc_size] = { (uint8_t)((crcval >> 8) & 0xFF), (uint8_t)(crcval & 0xFF) };
+            write_frame_cobs(buffer, length, crc_bytes);
+            if (flush) flush();
+            return;
+        }
+
+        if (tagged) IO.write_encode(output_tag);
         for (unsigned i = 0; i < length; i++) IO.write_encode(buffer[i]);
 
-        const uint16_t crcval = sklib::crc_16_ccitt().update(buffer, length);
         IO.write_encode((crcval >> 8) & 0xFF);
         IO.write_encode(crcval & 0xFF);
         IO.write_encode(EOF);
-    }
-
-private:
-    uint16_t stream_to_uint16(const uint8_t* buffer)
-    {
-        return uint16_t(buffer[0]) << 8 | buffer[1];
+        if (flush) flush();
     }
 };
 
@@ -0,0 +1,522 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <SKLib/sklib.hpp>
+#include <type_traits>
+#include "key_index.h"
+#include "hardware_model.h"
+
+static_assert(KEY_SIZE == sklib::supplement::bits_data_mask<uint8_t>() + 1, "Key size and uint8_t range must be the same");
+static_assert(KEY_COUNT - 1 <= sklib::supplement::bits_data_mask<key_addr_t>(), "Key count must be addressable by key_addr_t");
+static_assert(KEY_COUNT >= 32, "Key count must be at least 32");
+
+#ifndef EMULATION_SOCKET
+// single instance on hardware; in the simulator, each thread works with its snapshot of the shared state
+static KeyIndexState KeyIndex;
+KeyIndexState& key_index() { return KeyIndex; }
+#endif
+
+// perfect hash: key goes to bucket by its hash, and to slot by its hash and the displacement of the bucket
+
+static_assert(!(HASH_SLOTS & (HASH_SLOTS - 1)) && !(HASH_BUCKETS & (HASH_BUCKETS - 1)), "Hash dimensions must be powers of 2");
+static_assert(!(KEY_SIZE % 4), "Key is hashed by 4 bytes");
+
+static constexpr unsigned HASH_SEED_TRIES = 8;     // new seed if displacement cannot be found
+static constexpr unsigned HASH_BUCKET_MAX = 16;    // distinct keys per bucket, more means bad seed
+
+// radix sort: ranges of this size or less are finished by insertion sort
+static constexpr unsigned RADIX_CUTOFF = 16;
+
+#ifdef EKEY_SHADOW_TABLE
+static const uint8_t* shadow_row(const KeyIndexState& S, key_addr_t idx)
+{
+    return S.Shadow[idx / KEY_CHUNK]->Row[idx % KEY_CHUNK];
+}
+
+// the chunk is copied if another snapshot has it too
+static uint8_t* shadow_row_write(KeyIndexState& S, key_addr_t idx)
+{
+    auto& chunk = S.Shadow[idx / KEY_CHUNK];
+    if (!chunk) chunk = std::make_shared<ShadowChunk>();
+    else if (chunk.use_count() > 1) chunk = std::make_shared<ShadowChunk>(*chunk);
+    return chunk->Row[idx % KEY_CHUNK];
+}
+
+// first bytes of the row as number, compares as memcmp() does
+static uint64_t shadow_prefix(const uint8_t* row)
+{
+    uint64_t R = 0;
+    for (unsigned k = 0; k < 8; k++) R = (R << 8) | row[k];
+    return R;
+}
+#endif
+
+// given the current Permutation and Hardware storage (received by hdw_get_key_ptr() function)
+
+static int compare_indirect(const KeyIndexState& S, const uint8_t* pattern, key_addr_t idx)
+{
+    const uint8_t* key = hdw_get_key_ptr(idx);
+
+    for (unsigned k = 0; k < KEY_SIZE; k++)
+    {
+        const uint8_t a = pattern[S.Permutation[k]];
+        const uint8_t b = key[S.Permutation[k]];
+        if (a != b) return (a < b) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+int compare_pattern_to_key_indirect(const uint8_t* pattern, key_addr_t idx)
+{
+    return compare_indirect(key_index(), pattern, idx);
+}
+
+static bool compare_keys_is_A_less_than_B(const KeyIndexState& S, key_addr_t idx_A, key_addr_t idx_B)
+{
+#ifdef EKEY_SHADOW_TABLE
+    return memcmp(shadow_row(S, idx_A), shadow_row(S, idx_B), KEY_SIZE) < 0;
+#else
+    return compare_indirect(S, hdw_get_key_ptr(idx_A), idx_B) < 0;
+#endif
+}
+
+static bool keys_are_equal(const KeyIndexState& S, key_addr_t idx_A, key_addr_t idx_B)
+{
+#ifdef EKEY_SHADOW_TABLE
+    return !memcmp(shadow_row(S, idx_A), shadow_row(S, idx_B), KEY_SIZE);
+#else
+    return !compare_indirect(S, hdw_get_key_ptr(idx_A), idx_B);
+#endif
+}
+
+static bool is_present(const KeyIndexState& S, key_addr_t idx)
+{
+    return S.Present[idx / 8] & (1 << (idx % 8));
+}
+
+bool key_is_present(key_addr_t idx)
+{
+    return is_present(key_index(), idx);
+}
+
+static void permute_key(const KeyIndexState& S, uint8_t* dest, const uint8_t* key)
+{
+    for (unsigned k = 0; k < KEY_SIZE; k++) dest[k] = key[S.Permutation[k]];
+}
+
+// byte of the key idx at the position in comparison order
+static uint8_t key_byte(const KeyIndexState& S, key_addr_t idx, unsigned pos)
+{
+#ifdef EKEY_SHADOW_TABLE
+    return shadow_row(S, idx)[pos];
+#else
+    return hdw_get_key_ptr(idx)[S.Permutation[pos]];
+#endif
+}
+
+// multiplicative hash over the key as stored, 4 bytes per step, then avalanche;
+// equal keys are equal in any order, so the hash does not go through the permutation
+
+static uint32_t hash_start(const KeyIndexState& S)
+{
+    return 2166136261u ^ S.HashSeed;
+}
+
+static uint32_t hash_update(uint32_t h, uint32_t w)
+{
+    h = (h ^ w) * 0x9E3779B1u;
+    return h ^ (h >> 15);
+}
+
+static uint32_t hash_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t hash_key(const KeyIndexState& S, const uint8_t* key)
+{
+    uint32_t h = hash_start(S);
+    for (unsigned k = 0; k < KEY_SIZE; k += 4)
+    {
+        h = hash_update(h, uint32_t(key[k]) | uint32_t(key[k + 1]) << 8 | uint32_t(key[k + 2]) << 16 | uint32_t(key[k + 3]) << 24);
+    }
+    return hash_mix(h);
+}
+
+// stored per slot: a pattern of another key is rejected without reading the key
+static uint16_t hash_check(uint32_t h)
+{
+    return (uint16_t)(h >> 16);
+}
+
+static unsigned hash_bucket(uint32_t h)
+{
+    return h & (HASH_BUCKETS - 1);
+}
+
+static unsigned hash_slot(uint32_t h, unsigned displace)
+{
+    return hash_mix(h + displace * 0x9E3779B9u) & (HASH_SLOTS - 1);
+}
+
+// place keys into the slots, largest bucket first; for each bucket, find displacement that puts
+// all its keys into free slots; identical keys occupy one slot
+// returns false if not possible with the current seed
+static bool build_key_hash_seeded(KeyIndexState& S)
+{
+    static uint32_t Hash[KEY_COUNT];
+    static key_addr_t Order[KEY_COUNT];             // key indices grouped by bucket
+    static unsigned BucketStart[HASH_BUCKETS + 1];
+    static key_addr_t Buckets[HASH_BUCKETS];        // in the order of placement
+    uint8_t Taken[HASH_SLOTS / 8] = {};
+
+    memset(BucketStart, 0, sizeof(BucketStart));
+    for (unsigned n = 0; n < S.Count; n++)
+    {
+        const key_addr_t k = S.Redirect[n];
+        Hash[k] = hash_key(S, hdw_get_key_ptr(k));
+        BucketStart[hash_bucket(Hash[k]) + 1]++;
+    }
+
+    for (unsigned b = 0; b < HASH_BUCKETS; b++) BucketStart[b + 1] += BucketStart[b];
+    for (unsigned n = S.Count; n--; ) Order[--BucketStart[hash_bucket(Hash[S.Redirect[n]]) + 1]] = S.Redirect[n];
+    for (unsigned b = 0; b < HASH_BUCKETS; b++) Buckets[b] = (key_addr_t)b;
+
+    // after the loop above, BucketStart[b+1] is where bucket b starts; restore to the usual meaning
+    for (unsigned b = 0; b < HASH_BUCKETS; b++) BucketStart[b] = BucketStart[b + 1];
+    BucketStart[HASH_BUCKETS] = S.Count;
+
+    std::sort(Buckets, Buckets + HASH_BUCKETS, [](key_addr_t a, key_addr_t b)
+        { return BucketStart[a + 1] - BucketStart[a] > BucketStart[b + 1] - BucketStart[b]; });
+
+    memset(S.HashSlot, 0, sizeof(S.HashSlot));
+    memset(S.HashCheck, 0, sizeof(S.HashCheck));
+    memset(S.HashDisplace, 0, sizeof(S.HashDisplace));
+
+    for (unsigned n = 0; n < HASH_BUCKETS; n++)
+    {
+        const unsigned b = Buckets[n];
+
+        key_addr_t member[HASH_BUCKET_MAX];
+        unsigned member_count = 0;
+
+        for (unsigned i = BucketStart[b]; i < BucketStart[b + 1]; i++)
+        {
+            const key_addr_t idx = Order[i];
+            bool dup = false;
+
+            for (unsigned j = 0; j < member_count && !dup; j++)
+            {
+                if (Hash[member[j]] != Hash[idx]) continue;
+                if (!keys_are_equal(S, member[j], idx)) return false;   // full hash collision, needs another seed
+                dup = true;
+            }
+
+            if (dup) continue;
+            if (member_count >= HASH_BUCKET_MAX) return false;
+            member[member_count++] = idx;
+        }
+
+        if (!member_count) break;    // the rest of buckets is empty
+
+        unsigned displace = 0;
+        for (; displace <= sklib::OCTET_MASK; displace++)
+        {
+            unsigned slot[HASH_BUCKET_MAX];
+            bool fit = true;
+
+            for (unsigned j = 0; j < member_count && fit; j++)
+            {
+                slot[j] = hash_slot(Hash[member[j]], displace);
+                fit = !(Taken[slot[j] / 8] & (1 << (slot[j] % 8)));
+                for (unsigned i = 0; i < j && fit; i++) fit = (slot[i] != slot[j]);
+            }
+
+            if (!fit) continue;
+
+            for (unsigned j = 0; j < member_count; j++)
+            {
+                Taken[slot[j] / 8] |= (1 << (slot[j] % 8));
+                S.HashSlot[slot[j]] = member[j];
+                S.HashCheck[slot[j]] = hash_check(Hash[member[j]]);
+            }
+            S.HashDisplace[b] = (uint8_t)displace;
+            break;
+        }
+
+        if (displace > sklib::OCTET_MASK) return false;
+    }
+
+    return true;
+}
+
+static void build_key_hash(KeyIndexState& S)
+{
+    S.HashStale = false;
+    S.HashReady = false;
+    for (unsigned n = 0; n < HASH_SEED_TRIES && !S.HashReady; n++)
+    {
+        S.HashSeed = n * 0x9E3779B9u;
+        S.HashReady = build_key_hash_seeded(S);
+    }
+}
+
+void set_key_search(KeySearch mode)
+{
+    KeyIndexState& S = key_index();
+    S.SearchMode = mode;
+    if (mode == KeySearch::hashed) build_key_hash(S);
+}
+
+void refresh_key_search()
+{
+    KeyIndexState& S = key_index();
+    if (S.SearchMode == KeySearch::hashed && S.HashStale) build_key_hash(S);
+}
+
+KeySearch get_key_search()
+{
+    const KeyIndexState& S = key_index();
+    return (S.SearchMode == KeySearch::hashed && S.HashReady) ? KeySearch::hashed : KeySearch::sorted;
+}
+
+void prime_key_sorting(const uint8_t* permutation)
+{
+    memcpy(key_index().Permutation, permutation, KEY_SIZE);
+    recalculate_key_sorting();
+}
+
+static void insertion_sort_keys(const KeyIndexState& S, key_addr_t* first, unsigned count)
+{
+    for (unsigned i = 1; i < count; i++)
+    {
+        const key_addr_t idx = first[i];
+        unsigned j = i;
+        for (; j > 0 && compare_keys_is_A_less_than_B(S, idx, first[j - 1]); j--) first[j] = first[j - 1];
+        first[j] = idx;
+    }
+}
+
+// position of the first difference between keys in comparison order, starting from depth (KEY_SIZE if none)
+static unsigned common_prefix_keys(const KeyIndexState& S, const key_addr_t* first, unsigned count, unsigned depth)
+{
+    unsigned limit = KEY_SIZE;
+
+    for (unsigned i = 1; i < count && depth < limit; i++)
+    {
+        unsigned pos = depth;
+#ifdef EKEY_SHADOW_TABLE
+        // 8 bytes at a time, rows are contiguous
+        for (; pos + 8 <= limit; pos += 8)
+        {
+            uint64_t a, b;
+            memcpy(&a, shadow_row(S, first[0]) + pos, 8);
+            memcpy(&b, shadow_row(S, first[i]) + pos, 8);
+            if (a != b) break;
+        }
+#endif
+        while (pos < limit && key_byte(S, first[0], pos) == key_byte(S, first[i], pos)) pos++;
+        limit = pos;
+    }
+
+    return limit;
+}
+
+// bucket bounds go up to KEY_COUNT inclusive: 2 bytes each unless the table has 65536 keys
+typedef std::conditional<(KEY_COUNT <= 0xFFFFu), uint16_t, uint32_t>::type radix_bound_t;
+
+// MSD radix sort of key indices, all keys in the range are equal in bytes before depth
+// one counting pass and one scatter pass per byte position; the largest bucket is sorted in the same loop,
+// the rest is recursion, so stack depth is log2(KEY_COUNT) at most, with a bucket table of 257 radix_bound_t
+// (514 bytes for tables below 65536 keys) per level; scratch is KEY_COUNT indices
+static void radix_sort_keys(const KeyIndexState& S, key_addr_t* first, unsigned count, unsigned depth)
+{
+    static key_addr_t Scratch[KEY_COUNT];
+
+    while (count > RADIX_CUTOFF && depth < KEY_SIZE)
+    {
+        radix_bound_t bound[sklib::OCTET_ADDRESS_SPAN + 1] = {};
+        for (unsigned i = 0; i < count; i++) bound[key_byte(S, first[i], depth) + 1]++;
+
+        unsigned largest = 0;
+        for (unsigned b = 1; b < sklib::OCTET_ADDRESS_SPAN; b++) if (bound[b + 1] > bound[largest + 1]) largest = b;
+
+        if (bound[largest + 1] == count)   // common byte, nothing to move, skip all common bytes
+        {
+            depth = common_prefix_keys(S, first, count, depth + 1);
+            continue;
+        }
+
+        for (unsigned b = 0; b < sklib::OCTET_ADDRESS_SPAN; b++) bound[b + 1] += bound[b];
+        for (unsigned i = count; i--; ) Scratch[--bound[key_byte(S, first[i], depth) + 1]] = first[i];
+        memcpy(first, Scratch, count * sizeof(key_addr_t));
+
+        // now bucket b starts at bound[b+1] and ends at bound[b+2]
+        for (unsigned b = 0; b < sklib::OCTET_ADDRESS_SPAN; b++) bound[b] = bound[b + 1];
+        bound[sklib::OCTET_ADDRESS_SPAN] = count;
+
+        for (unsigned b = 0; b < sklib::OCTET_ADDRESS_SPAN; b++)
+        {
+            const unsigned size = bound[b + 1] - bound[b];
+            if (b == largest || size < 2) continue;
+            if (size <= RADIX_CUTOFF) insertion_sort_keys(S, first + bound[b], size);
+            else radix_sort_keys(S, first + bound[b], size, depth + 1);
+        }
+
+        first += bound[largest];
+        count = bound[largest + 1] - bound[largest];
+        depth++;
+    }
+
+    if (count > 1) insertion_sort_keys(S, first, count);
+}
+
+void recalculate_key_sorting()
+{
+    KeyIndexState& S = key_index();
+
+    S.Count = 0;
+    for (unsigned k = 0; k < KEY_COUNT; k++)
+    {
+        if (!is_present(S, (key_addr_t)k)) continue;
+#ifdef EKEY_SHADOW_TABLE
+        permute_key(S, shadow_row_write(S, (key_addr_t)k), hdw_get_key_ptr((key_addr_t)k));
+#endif
+        S.Redirect[S.Count++] = (key_addr_t)k;
+    }
+
+    radix_sort_keys(S, S.Redirect, S.Count, 0);
+
+#ifdef EKEY_SHADOW_TABLE
+    for (unsigned n = 0; n < S.Count; n++) S.Prefix[n] = shadow_prefix(shadow_row(S, S.Redirect[n]));
+#endif
+
+    if (S.SearchMode == KeySearch::hashed) build_key_hash(S);
+}
+
+// take the key out of the order, and put it back into the new place by binary search
+// O(KEY_COUNT) moves, and log2(KEY_COUNT) key compares
+void update_key_index(key_addr_t idx)
+{
+    KeyIndexState& S = key_index();
+
+    if (is_present(S, idx))
+    {
+        const unsigned n = (unsigned)(std::find(S.Redirect, S.Redirect + S.Count, idx) - S.Redirect);
+        memmove(S.Redirect + n, S.Redirect + n + 1, (S.Count - n - 1) * sizeof(S.Redirect[0]));
+#ifdef EKEY_SHADOW_TABLE
+        memmove(S.Prefix + n, S.Prefix + n + 1, (S.Count - n - 1) * sizeof(S.Prefix[0]));
+#endif
+        S.Count--;
+    }
+
+#ifdef EKEY_SHADOW_TABLE
+    permute_key(S, shadow_row_write(S, idx), hdw_get_key_ptr(idx));
+#endif
+
+    const unsigned n = (unsigned)(std::upper_bound(S.Redirect, S.Redirect + S.Count, idx,
+        [&S](key_addr_t a, key_addr_t b) { return compare_keys_is_A_less_than_B(S, a, b); }) - S.Redirect);
+    memmove(S.Redirect + n + 1, S.Redirect + n, (S.Count - n) * sizeof(S.Redirect[0]));
+    S.Redirect[n] = idx;
+#ifdef EKEY_SHADOW_TABLE
+    memmove(S.Prefix + n + 1, S.Prefix + n, (S.Count - n) * sizeof(S.Prefix[0]));
+    S.Prefix[n] = shadow_prefix(shadow_row(S, idx));
+#endif
+    S.Count++;
+
+    S.Present[idx / 8] |= (uint8_t)(1 << (idx % 8));
+    S.HashStale = true;
+}
+
+// keys stay in the storage, but are not searched anymore
+void reset_key_index()
+{
+    KeyIndexState& S = key_index();
+    S.Count = 0;
+    memset(S.Present, 0, sizeof(S.Present));
+    S.HashStale = true;
+}
+
+// binary search over Redirect; cmp(idx) compares the pattern (captured) to the key idx
+template<class F>
+static int search_key_index(const KeyIndexState& S, F cmp)
+{
+    unsigned lo = 0, hi = S.Count;
+
+    while (lo < hi)
+    {
+        const unsigned mid = (lo + hi) / 2;
+        const int R = cmp(S.Redirect[mid]);
+        if (!R) return S.Redirect[mid];
+        if (R < 0) hi = mid; else lo = mid + 1;
+    }
+
+    return -1;
+}
+
+int find_key_index_indirect(const uint8_t* pattern)
+{
+    const KeyIndexState& S = key_index();
+    return search_key_index(S, [&S, pattern](key_addr_t idx) { return compare_indirect(S, pattern, idx); });
+}
+
+// one pass over the pattern to hash it, one compare to confirm; neither needs the permutation
+static int find_key_index_hashed(const KeyIndexState& S, const uint8_t* pattern)
+{
+    const uint32_t h = hash_key(S, pattern);
+    const unsigned slot = hash_slot(h, S.HashDisplace[hash_bucket(h)]);
+    if (S.HashCheck[slot] != hash_check(h)) return -1;
+
+    const key_addr_t idx = S.HashSlot[slot];
+    if (!is_present(S, idx)) return -1;    // empty slot
+
+    return memcmp(pattern, hdw_get_key_ptr(idx), KEY_SIZE) ? -1 : idx;
+}
+
+int find_key_index(const uint8_t* pattern)
+{
+    refresh_key_search();
+
+    const KeyIndexState& S = key_index();
+    if (S.SearchMode == KeySearch::hashed && S.HashReady) return find_key_index_hashed(S, pattern);
+
+#ifdef EKEY_SHADOW_TABLE
+    uint8_t permuted[KEY_SIZE];
+    permute_key(S, permuted, pattern);
+    const uint64_t prefix = shadow_prefix(permuted);
+
+    // over Prefix, same as search_key_index() otherwise
+    unsigned lo = 0, hi = S.Count;
+    while (lo < hi)
+    {
+        const unsigned mid = (lo + hi) / 2;
+        int R = (prefix < S.Prefix[mid]) ? -1 : (prefix > S.Prefix[mid]) ? 1 : 0;
+        if (!R) R = memcmp(permuted + 8, shadow_row(S, S.Redirect[mid]) + 8, KEY_SIZE - 8);
+        if (!R) return S.Redirect[mid];
+        if (R < 0) hi = mid; else lo = mid + 1;
+    }
+    return -1;
+#else
+    return search_key_index(S, [&S, pattern](key_addr_t idx) { return compare_indirect(S, pattern, idx); });
+#endif
+}
+
+void restore_key_shadow()
+{
+#ifdef EKEY_SHADOW_TABLE
+    KeyIndexState& S = key_index();
+    for (unsigned n = 0; n < S.Count; n++) permute_key(S, shadow_row_write(S, S.Redirect[n]), hdw_get_key_ptr(S.Redirect[n]));
+#endif
+}
@@ -0,0 +1,113 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// Lookup of the key table: the keys are ordered lexicographically after the permutation (rotator) is applied,
+// and the exchange command searches the received pattern in that order.
+
+#pragma once
+#include <memory>
+#include "interface.h"
+
+// Shadow table is the copy of all keys with bytes already rearranged by the permutation, one contiguous row per key.
+// Compare becomes plain memcmp() over two rows. It takes KEY_COUNT*KEY_SIZE bytes of RAM, which the hardware
+// does not have; there, the keys are compared in place, going through the permutation for every byte.
+
+#if defined(EMULATION_SOCKET) && !defined(EKEY_NO_SHADOW_TABLE)
+#define EKEY_SHADOW_TABLE
+#endif
+
+// Shadow rows (and the key storage of the simulator) are kept in chunks shared between snapshots of the state,
+// the chunk is copied when written (see shared_state.h), so write of one key does not copy the whole table.
+// Prefix is the first 8 bytes of the shadow row, big endian, in the sorted order: binary search runs over
+// this compact array, and the full row is compared only when prefixes are equal.
+
+static constexpr unsigned KEY_CHUNK = 256;      // key pairs per chunk
+static constexpr unsigned KEY_CHUNKS = (KEY_COUNT + KEY_CHUNK - 1) / KEY_CHUNK;
+
+#ifdef EKEY_SHADOW_TABLE
+struct ShadowChunk
+{
+    uint8_t Row[KEY_CHUNK][KEY_SIZE];
+};
+#endif
+
+// Search method for exchange command. Sorted order is binary search, log2(KEY_COUNT) compares per request.
+// Hashed is a perfect hash (hash and displace) over the keys as stored: one hash pass and one confirming compare,
+// without the permutation; 16 bits of the hash kept per slot turn away most misses before the compare.
+// It takes HASH_BUCKETS + HASH_SLOTS * (2 + KEY_ADDR_SIZE) bytes; the sorted order is always maintained and is
+// the fallback when the perfect hash cannot be built for the given keys.
+
+enum class KeySearch { sorted, hashed };
+
+// hash dimensions are powers of 2, for any KEY_COUNT
+static constexpr unsigned hash_size(unsigned n) { return (n <= 1) ? 1 : 2 * hash_size((n + 1) / 2); }
+
+static constexpr unsigned HASH_BUCKETS = hash_size(KEY_COUNT / 4);    // displacement per bucket
+static constexpr unsigned HASH_SLOTS   = hash_size(KEY_COUNT * 2);    // key index per slot
+
+// plain data, can be copied as bytes
+struct KeyIndexData
+{
+    uint8_t Permutation[KEY_SIZE];
+    key_addr_t Redirect[KEY_COUNT];     // key indices in the sorted order, only written keys
+    unsigned Count = 0;                 // number of entries in Redirect
+    uint8_t Present[(KEY_COUNT + 7) / 8] = {};
+
+#ifdef EKEY_SHADOW_TABLE
+    uint64_t Prefix[KEY_COUNT];         // along with Redirect
+#endif
+
+    KeySearch SearchMode = KeySearch::sorted;
+    bool HashReady = false;
+    bool HashStale = false;             // keys were written since the last build
+    uint32_t HashSeed = 0;
+    uint8_t HashDisplace[HASH_BUCKETS];
+    key_addr_t HashSlot[HASH_SLOTS];
+    uint16_t HashCheck[HASH_SLOTS];     // high bits of the hash of the key in the slot
+};
+
+struct KeyIndexState : KeyIndexData
+{
+#ifdef EKEY_SHADOW_TABLE
+    std::shared_ptr<ShadowChunk> Shadow[KEY_CHUNKS];
+#endif
+};
+
+// the index that functions below work with
+KeyIndexState& key_index();
+
+bool key_is_present(key_addr_t idx);
+
+void set_key_search(KeySearch mode);
+KeySearch get_key_search();     // returns sorted if hash is selected but not built
+void refresh_key_search();      // rebuilds the hash now, if it is selected and keys were written
+
+// compare in place, via Permutation and hdw_get_key_ptr(); returns <0, 0, >0 as memcmp()
+int compare_pattern_to_key_indirect(const uint8_t* pattern, key_addr_t idx);
+
+// loads the rotator and rebuilds the order (and hash, if selected)
+void prime_key_sorting(const uint8_t* permutation);
+void recalculate_key_sorting();
+
+// shadow rows from the keys, for KeyIndexData restored from the persistent image; no sorting
+void restore_key_shadow();
+
+// write_key: call after the pair is stored, moves one key in the order instead of full sort
+// (the hash, if selected, is rebuilt on the next search)
+void update_key_index(key_addr_t idx);
+
+// erase_keys: empty index, O(1)
+void reset_key_index();
+
+// 0..KEY_COUNT-1 => index of the Key; payload is offset by KEY_SIZE
+// return NEGATIVE if not found
+int find_key_index(const uint8_t* pattern);
+
+// same search, but always with the in-place comparison (reference implementation)
+int find_key_index_indirect(const uint8_t* pattern);
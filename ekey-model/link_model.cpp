@@ -0,0 +1,87 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+
+#include "link_model.h"
+
+typedef std::chrono::steady_clock link_clock;
+
+static LinkModel LINK;
+static std::atomic<bool> LINK_ON(false);
+static std::atomic<unsigned> LINK_CONNECTIONS(0);
+
+// per connection: when the line is free again, in each direction
+struct link_thread_type
+{
+    link_clock::time_point InputFree;
+    link_clock::time_point OutputFree;
+    std::minstd_rand Jitter;
+};
+
+static thread_local link_thread_type LINK_THREAD;
+
+static link_clock::duration byte_time(unsigned count)
+{
+    // in nanoseconds, 9600 baud is 1041667 ns per byte
+    return std::chrono::nanoseconds((uint64_t)count * LINK_BITS_PER_BYTE * 1000000000ull / LINK.Baud);
+}
+
+static link_clock::duration transfer_latency()
+{
+    unsigned us = LINK.Latency_us;
+    if (LINK.Jitter_us) us += (unsigned)(LINK_THREAD.Jitter() % (LINK.Jitter_us + 1));
+    return std::chrono::microseconds(us);
+}
+
+void link_enable(const LinkModel& model)
+{
+    LINK = model;
+    if (!LINK.Baud) LINK.Baud = SERIAL_SPEED;
+    LINK_ON = true;
+}
+
+void link_opened()
+{
+    if (!LINK_ON) return;
+
+    LINK_THREAD.InputFree = LINK_THREAD.OutputFree = link_clock::now();
+    LINK_THREAD.Jitter.seed(++LINK_CONNECTIONS);     // different per connection, same from run to run
+}
+
+void link_receive_byte()
+{
+    if (!LINK_ON) return;
+
+    auto& T = LINK_THREAD;
+    const auto now = link_clock::now();
+    if (now > T.InputFree + std::chrono::microseconds(LINK_IDLE_US)) T.InputFree = now + transfer_latency();    // new transfer
+
+    T.InputFree += byte_time(1);
+    std::this_thread::sleep_until(T.InputFree);     // absolute time, oversleep of one byte does not add up
+}
+
+unsigned link_send(unsigned length, bool start)
+{
+    if (!LINK_ON) return length;
+
+    auto& T = LINK_THREAD;
+    const auto now = link_clock::now();
+    if (T.OutputFree < now) T.OutputFree = now;
+
+    const unsigned packet = std::min(length, LINK_PACKET_SIZE);
+    if (start) T.OutputFree += transfer_latency();
+    T.OutputFree += byte_time(packet);
+    std::this_thread::sleep_until(T.OutputFree);
+    return packet;
+}
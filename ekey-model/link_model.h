@@ -0,0 +1,45 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// Link model for the simulator: makes the TCP client see the speed of USB-serial line of the device, so that
+// ekey-bench against ekey-model tells the throughput of the real thing. Off unless enabled (ekey-model --link).
+//
+// Every byte takes 10 bit times (8N1) at the given baud rate, in each direction. Every transfer also waits
+// for USB latency, plus random 0..jitter: the output frame of hdw_flush() is one transfer, which goes out
+// in packets of LINK_PACKET_SIZE as they would be on the wire; input bytes belong to one transfer while
+// they follow each other with no pause longer than LINK_IDLE_US.
+// Like the firmware loop, the device does one thing at a time: while the reply is going out, nothing is read.
+// Time is kept per connection (thread), so clients do not slow each other down.
+
+#pragma once
+#include "interface.h"
+
+static constexpr unsigned LINK_BITS_PER_BYTE = 10;
+static constexpr unsigned LINK_IDLE_US = 1000;              // one USB full speed frame
+static constexpr unsigned LINK_USB_LATENCY_US = 1000;       // default for --link
+static constexpr unsigned LINK_PACKET_SIZE = 64;            // USB full speed bulk endpoint
+
+struct LinkModel
+{
+    unsigned Baud = SERIAL_SPEED;
+    unsigned Latency_us = LINK_USB_LATENCY_US;
+    unsigned Jitter_us = 0;
+};
+
+void link_enable(const LinkModel& model);
+
+// connection of the calling thread starts
+void link_opened();
+
+// a byte has arrived from the client; returns when the line would have delivered it
+void link_receive_byte();
+
+// output of length bytes is to be sent, start is true for the first part of the transfer;
+// returns when the line would have sent the next packet, and how many bytes it has (all, if the model is off)
+unsigned link_send(unsigned length, bool start);
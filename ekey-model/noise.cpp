@@ -0,0 +1,233 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <algorithm>
+
+#include <SKLib/sklib.hpp>
+#include "noise.h"
+#include "hardware_model.h"
+
+#ifdef EMULATION_SOCKET
+#include <atomic>
+#endif
+
+static inline uint32_t load_le32(const uint8_t* p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store_le32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint32_t rotl32(uint32_t v, int n)
+{
+    return (v << n) | (v >> (32 - n));
+}
+
+static inline void quarter_round(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+    a += b; d = rotl32(d ^ a, 16);
+    c += d; b = rotl32(b ^ c, 12);
+    a += b; d = rotl32(d ^ a, 8);
+    c += d; b = rotl32(b ^ c, 7);
+}
+
+// -------------------------------------------------------------
+
+void chacha20_type::set_key(const uint8_t* key, const uint8_t* nonce)
+{
+    input[0] = 0x61707865;      // "expand 32-byte k"
+    input[1] = 0x3320646e;
+    input[2] = 0x79622d32;
+    input[3] = 0x6b206574;
+    for (unsigned k = 0; k < 8; k++) input[4+k] = load_le32(key + 4*k);
+    input[12] = input[13] = 0;
+    input[14] = load_le32(nonce);
+    input[15] = load_le32(nonce + 4);
+}
+
+void chacha20_type::generate(uint8_t* dest, size_t length)
+{
+    for (; length >= CHACHA_BLOCK_SIZE; length -= CHACHA_BLOCK_SIZE, dest += CHACHA_BLOCK_SIZE)
+    {
+        uint32_t x[16];
+        memcpy(x, input, sizeof(x));
+
+        for (unsigned r = 0; r < 10; r++)   // 20 rounds, column then diagonal
+        {
+            quarter_round(x[0], x[4], x[8],  x[12]);
+            quarter_round(x[1], x[5], x[9],  x[13]);
+            quarter_round(x[2], x[6], x[10], x[14]);
+            quarter_round(x[3], x[7], x[11], x[15]);
+            quarter_round(x[0], x[5], x[10], x[15]);
+            quarter_round(x[1], x[6], x[11], x[12]);
+            quarter_round(x[2], x[7], x[8],  x[13]);
+            quarter_round(x[3], x[4], x[9],  x[14]);
+        }
+
+        for (unsigned k = 0; k < 16; k++) store_le32(dest + 4*k, x[k] + input[k]);
+        if (!++input[12]) input[13]++;
+    }
+}
+
+// -------------------------------------------------------------
+
+void noise_pool_type::rekey(const uint8_t* key)
+{
+    static const uint8_t nonce[CHACHA_NONCE_SIZE] = {};
+    generator.set_key(key, nonce);
+}
+
+// new key is the next keystream block XOR fresh entropy. Without entropy the seeded generator only moves on
+// (and tries again at the next refill); unseeded one stays unseeded, it is never keyed from a known block
+bool noise_pool_type::reseed()
+{
+    uint8_t fresh[CHACHA_KEY_SIZE];
+    const bool good = hdw_get_entropy(fresh, CHACHA_KEY_SIZE);
+    if (!good && !seeded) return false;
+
+    uint8_t block[CHACHA_BLOCK_SIZE] = {};
+    if (seeded) generator.generate(block, CHACHA_BLOCK_SIZE);
+    if (good)
+        for (unsigned k = 0; k < CHACHA_KEY_SIZE; k++) block[k] ^= fresh[k];
+
+    rekey(block);
+    memset(block, 0, sizeof(block));
+    memset(fresh, 0, sizeof(fresh));
+
+    seeded = true;
+    if (good) output_count = 0;
+    return true;
+}
+
+bool noise_pool_type::refill()
+{
+    if (!fixed && (!seeded || output_count >= NOISE_RESEED_BYTES) && !reseed()) return false;
+
+    generator.generate(pool, NOISE_POOL_SIZE);
+    rekey(pool);
+    memset(pool, 0, CHACHA_KEY_SIZE);
+    position = CHACHA_KEY_SIZE;
+    output_count += NOISE_POOL_SIZE - CHACHA_KEY_SIZE;
+    return true;
+}
+
+void noise_pool_type::prepare(size_t length)
+{
+    if (length < NOISE_POOL_SIZE - CHACHA_KEY_SIZE && NOISE_POOL_SIZE - position < length) refill();    // failure is seen by fill()
+}
+
+void noise_pool_type::set_seed(const uint8_t* key, const uint8_t* nonce)
+{
+    generator.set_key(key, nonce);
+    position = NOISE_POOL_SIZE;
+    seeded = fixed = true;
+}
+
+bool noise_pool_type::fill(uint8_t* dest, size_t length)
+{
+    while (length)
+    {
+        if (position == NOISE_POOL_SIZE)
+        {
+            // bulk: whole blocks straight into the destination, then one block for the next key
+            if (length >= NOISE_POOL_SIZE)
+            {
+                if (!fixed && (!seeded || output_count >= NOISE_RESEED_BYTES) && !reseed()) return false;
+
+                const size_t bulk = length - length % CHACHA_BLOCK_SIZE;
+                generator.generate(dest, bulk);
+                dest += bulk;
+                length -= bulk;
+                output_count += bulk;
+
+                uint8_t next[CHACHA_BLOCK_SIZE];
+                generator.generate(next, CHACHA_BLOCK_SIZE);
+                rekey(next);
+                memset(next, 0, sizeof(next));
+                continue;
+            }
+
+            if (!refill()) return false;
+        }
+
+        const size_t part = std::min(length, (size_t)(NOISE_POOL_SIZE - position));
+        memcpy(dest, pool + position, part);
+        memset(pool + position, 0, part);     // given out, not kept
+        position += (unsigned)part;
+        dest += part;
+        length -= part;
+    }
+    return true;
+}
+
+// -------------------------------------------------------------
+
+#ifdef EMULATION_SOCKET
+
+static std::atomic<bool> FIXED_SEED(false);
+static std::atomic<uint64_t> SEED_VALUE(0);
+static std::atomic<uint64_t> SEED_ORDINAL(0);
+
+static noise_pool_type& thread_pool()
+{
+    static thread_local noise_pool_type Pool;
+    static thread_local bool initialized = false;
+
+    if (!initialized)
+    {
+        initialized = true;
+        if (FIXED_SEED)
+        {
+            uint8_t key[CHACHA_KEY_SIZE] = {};
+            uint8_t nonce[CHACHA_NONCE_SIZE];
+            const uint64_t seed = SEED_VALUE, ordinal = SEED_ORDINAL++;
+            for (unsigned k = 0; k < 8; k++) key[k] = (uint8_t)(seed >> 8*k);
+            for (unsigned k = 0; k < 8; k++) nonce[k] = (uint8_t)(ordinal >> 8*k);
+            Pool.set_seed(key, nonce);
+        }
+    }
+
+    return Pool;
+}
+
+void noise_set_fixed_seed(uint64_t seed)
+{
+    SEED_VALUE = seed;
+    SEED_ORDINAL = 0;
+    FIXED_SEED = true;
+}
+
+#else
+
+static noise_pool_type& thread_pool()
+{
+    static noise_pool_type Pool;
+    return Pool;
+}
+
+void noise_set_fixed_seed(uint64_t seed)
+{}
+
+#endif
+
+bool noise_fill(uint8_t* dest, size_t length)
+{
+    return thread_pool().fill(dest, length);
+}
+
+void noise_prepare(size_t length)
+{
+    thread_pool().prepare(length);
+}
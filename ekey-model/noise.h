@@ -0,0 +1,81 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// Noise (random bytes) for the get_noise command and key generation.
+// Generator is ChaCha20 keystream (RFC 8439 block function, 64-bit block counter), taken from a pool.
+// The pool is refilled NOISE_POOL_SIZE bytes at once; after every refill the first 32 bytes of the new
+// output become the next key and are never given out (fast key erasure), so earlier output cannot be
+// recovered from the state. The key is mixed with fresh entropy from hdw_get_entropy() at the start
+// and every NOISE_RESEED_BYTES of output. The first key comes from the entropy only: until hdw_get_entropy()
+// succeeds, there is no output and get_noise answers NAK (--noise-seed in the simulator is the only exception).
+
+#pragma once
+#include "interface.h"
+
+static constexpr unsigned CHACHA_KEY_SIZE   = 32;
+static constexpr unsigned CHACHA_NONCE_SIZE = 8;
+static constexpr unsigned CHACHA_BLOCK_SIZE = 64;
+
+#ifdef EMULATION_SOCKET
+static constexpr unsigned NOISE_POOL_SIZE    = 4096;
+static constexpr uint64_t NOISE_RESEED_BYTES = 1 << 20;
+#else
+static constexpr unsigned NOISE_POOL_SIZE    = 512;
+static constexpr uint64_t NOISE_RESEED_BYTES = 1 << 16;
+#endif
+
+static_assert(NOISE_POOL_SIZE % CHACHA_BLOCK_SIZE == 0 && NOISE_POOL_SIZE > CHACHA_KEY_SIZE, "pool is whole blocks");
+
+class chacha20_type
+{
+public:
+    // block counter starts at 0
+    void set_key(const uint8_t* key, const uint8_t* nonce);
+
+    // next length/CHACHA_BLOCK_SIZE blocks of the keystream; length must be multiple of CHACHA_BLOCK_SIZE
+    void generate(uint8_t* dest, size_t length);
+
+private:
+    uint32_t input[16] = {};
+};
+
+class noise_pool_type
+{
+public:
+    // copies from the pool, refills it as needed; requests of a pool size or more go straight to the generator;
+    // false if the generator was never seeded and there is still no entropy
+    bool fill(uint8_t* dest, size_t length);
+
+    // refills the pool now if it has less than length bytes, so the next fill() of that size is one memcpy
+    void prepare(size_t length);
+
+    // fixed key, the output is repeatable and is not reseeded (test mode)
+    void set_seed(const uint8_t* key, const uint8_t* nonce);
+
+private:
+    void rekey(const uint8_t* key);
+    bool reseed();
+    bool refill();
+
+    chacha20_type generator;
+    uint8_t pool[NOISE_POOL_SIZE];
+    unsigned position = NOISE_POOL_SIZE;    // first unused byte
+    uint64_t output_count = 0;              // since the last reseed
+    bool seeded = false;
+    bool fixed = false;
+};
+
+// pool of the calling thread (the simulator has one per client); false: no entropy, dest is not valid
+bool noise_fill(uint8_t* dest, size_t length);
+
+// called after the response is sent, refills the pool for the next request of that size
+void noise_prepare(size_t length);
+
+// simulator --noise-seed: pools of all threads are keyed from the number, in the order they are first used
+void noise_set_fixed_seed(uint64_t seed);
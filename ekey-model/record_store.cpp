@@ -0,0 +1,115 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <SKLib/sklib.hpp>
+#include "record_store.h"
+#include "hardware_model.h"
+#include "shared_state.h"
+#include "telemetry.h"
+
+// sequence of the cache when this client last wrote or timed out reading; if it is the same at the next
+// read timeout, the cache has been idle for all of it
+#ifdef EMULATION_SOCKET
+static RecordCache& record_cache() { return shared_state().Records; }
+static thread_local uint32_t IdleMark = 0;
+#else
+static RecordCache CACHE;
+static RecordCache& record_cache() { return CACHE; }
+static uint32_t IdleMark = 0;
+#endif
+
+static RecordCacheSlot* find_slot(RecordCache& C, uint8_t idx)
+{
+    for (auto& S : C.Slot) if (S.Dirty && S.Block == idx) return &S;
+    return nullptr;
+}
+
+// the block is stored, unless the storage has it already; the slot is free after
+static void write_back(RecordCacheSlot& S)
+{
+    if (memcmp(hdw_get_block_ptr(S.Block), S.Data, BLOCK_SIZE))
+    {
+        hdw_store_block(S.Block, S.Data);
+        telemetry_record(RecordEvent::physical);
+    }
+    else
+    {
+        telemetry_record(RecordEvent::identical);    // written back to what it was
+    }
+    S.Dirty = false;
+}
+
+const uint8_t* record_block(uint8_t idx)
+{
+    const RecordCacheSlot* S = find_slot(record_cache(), idx);
+    return S ? S->Data : hdw_get_block_ptr(idx);
+}
+
+void record_store(uint8_t idx, const uint8_t* data)
+{
+    RecordCache& C = record_cache();
+    telemetry_record(RecordEvent::stored);
+
+    RecordCacheSlot* S = find_slot(C, idx);
+    if (!memcmp(S ? S->Data : hdw_get_block_ptr(idx), data, BLOCK_SIZE))
+    {
+        telemetry_record(RecordEvent::identical);
+        return;
+    }
+
+    if (S)
+    {
+        telemetry_record(RecordEvent::replaced);    // the cached copy never goes to the storage
+    }
+    else
+    {
+        for (auto& F : C.Slot) if (!F.Dirty) { S = &F; break; }
+        if (!S)
+        {
+            S = &C.Slot[0];
+            for (auto& F : C.Slot) if ((int32_t)(F.Sequence - S->Sequence) < 0) S = &F;
+            write_back(*S);
+        }
+        S->Block = idx;
+        S->Dirty = true;
+    }
+
+    memcpy(S->Data, data, BLOCK_SIZE);
+    S->Sequence = IdleMark = ++C.Sequence;
+}
+
+void record_sync()
+{
+    for (auto& S : record_cache().Slot) if (S.Dirty) write_back(S);
+    telemetry_record(RecordEvent::sync);
+}
+
+void record_idle()
+{
+    auto due = []()
+    {
+        const RecordCache& C = record_cache();
+        if (C.Sequence != IdleMark)
+        {
+            IdleMark = C.Sequence;      // other client has written; idle from now
+            return false;
+        }
+        for (const auto& S : C.Slot) if (S.Dirty) return true;
+        return false;
+    };
+
+    {
+        StateRead Snapshot;
+        if (!due()) return;
+    }
+
+    StateUpdate Update;
+    if (!due()) return;     // other client has written meanwhile, or flushed
+    for (auto& S : record_cache().Slot) if (S.Dirty) write_back(S);
+}
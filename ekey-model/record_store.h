@@ -0,0 +1,52 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// Record storage between put_record and hdw_store_block, which on the device is flash erase and program
+// of the whole block.
+// - block that is the same as stored (or cached) is not written at all
+// - written block is kept in a small RAM cache; the following writes to it replace the cached copy. The block goes
+//   to the storage when its slot is needed for another block, when the line is idle (record_idle), at sync_records,
+//   or when the client disconnects
+// - idle is a read timeout of the command loop, READ_DELAY_MS without a command, with no block written since
+//   the last write or the last read timeout of this client; no clock is needed. One client: the cache is written
+//   READ_DELAY_MS (500 ms) after the last command. Simulator with several clients: the writes of the others
+//   delay it by up to one more read timeout
+// Reads see the cached copy. Cached block is lost at power off: the client that needs it stored sends sync_records.
+// Simulator: the cache is part of the shared state, under the same guards as the blocks (shared_state.h),
+// but not in the image file, like RAM.
+// The counters (stored, identical, replaced in cache, physical writes, syncs) are in get_status, see telemetry.h.
+
+#pragma once
+#include "interface.h"
+
+static constexpr unsigned RECORD_CACHE_SLOTS = 4;
+
+struct RecordCacheSlot
+{
+    bool Dirty = false;         // clean slot is free
+    uint8_t Block = 0;
+    uint32_t Sequence = 0;      // the oldest write goes out first
+    uint8_t Data[BLOCK_SIZE];
+};
+
+struct RecordCache
+{
+    RecordCacheSlot Slot[RECORD_CACHE_SLOTS];
+    uint32_t Sequence = 0;      // of the last write
+};
+
+// block as the client sees it; under StateRead or StateUpdate
+const uint8_t* record_block(uint8_t idx);
+
+// under StateUpdate
+void record_store(uint8_t idx, const uint8_t* data);
+void record_sync();
+
+// at the read timeout of the command loop; takes the guards itself
+void record_idle();
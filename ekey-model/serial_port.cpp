@@ -0,0 +1,394 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <SKLib/sklib.hpp>
+#include <algorithm>
+#include "serial_port.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+static bool serial_speed(unsigned baud, speed_t& speed)
+{
+    static const struct { unsigned baud; speed_t speed; } RATES[] =
+    {
+        { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+        { 230400, B230400 }, { 460800, B460800 }, { 500000, B500000 }, { 576000, B576000 }, { 921600, B921600 },
+        { 1000000, B1000000 }, { 1152000, B1152000 }, { 1500000, B1500000 }, { 2000000, B2000000 },
+        { 2500000, B2500000 }, { 3000000, B3000000 }, { 3500000, B3500000 }, { 4000000, B4000000 }
+    };
+
+    for (const auto& R : RATES)
+    {
+        if (R.baud != baud) continue;
+        speed = R.speed;
+        return true;
+    }
+    return false;
+}
+
+// raw 8N1: no echo, no line editing, no translation of CR/LF, no signals, no flow control
+static bool serial_raw(int h, speed_t speed)
+{
+    termios T = {};
+    if (tcgetattr(h, &T)) return false;
+
+    cfmakeraw(&T);
+    T.c_cflag |= CLOCAL | CREAD;
+    T.c_cflag &= ~(CSTOPB | CRTSCTS);
+    T.c_iflag &= ~(IXON | IXOFF | IXANY);
+    T.c_cc[VMIN] = 0;
+    T.c_cc[VTIME] = 0;
+    cfsetispeed(&T, speed);
+    cfsetospeed(&T, speed);
+
+    return !tcsetattr(h, TCSANOW, &T);
+}
+
+static bool serial_wait(int h, short events, int timeout_ms)
+{
+    pollfd P = {};
+    P.fd = h;
+    P.events = events;
+    return poll(&P, 1, timeout_ms) > 0 && !(P.revents & (POLLERR | POLLNVAL));
+}
+
+bool serial_port_type::open(const char* path, unsigned baud)
+{
+    close();
+
+    speed_t speed;
+    if (!serial_speed(baud, speed)) return false;
+
+    handle = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (handle < 0) return false;
+
+    if (!serial_raw(handle, speed))
+    {
+        close();
+        return false;
+    }
+
+    tcflush(handle, TCIOFLUSH);     // whatever the device said to the previous client
+    name = path;
+    return true;
+}
+
+bool serial_port_type::open_pty(const char* link)
+{
+    close();
+
+    handle = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (handle < 0) return false;
+
+    const char* slave = (!grantpt(handle) && !unlockpt(handle)) ? ptsname(handle) : nullptr;
+    if (slave) name = slave;
+    if (slave) pty_slave = ::open(slave, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+    speed_t speed;
+    serial_speed(SERIAL_SPEED, speed);
+    if (pty_slave < 0 || !serial_raw(pty_slave, speed))
+    {
+        close();
+        return false;
+    }
+
+    if (link)
+    {
+        unlink(link);       // left from the previous run
+        if (symlink(slave, link))
+        {
+            close();
+            return false;
+        }
+        link_name = link;
+    }
+    return true;
+}
+
+void serial_port_type::close()
+{
+    if (!link_name.empty()) unlink(link_name.c_str());
+    if (pty_slave >= 0) ::close(pty_slave);
+    if (handle >= 0) ::close(handle);
+
+    handle = pty_slave = -1;
+    name.clear();
+    link_name.clear();
+    input_pos = input_len = 0;
+}
+
+bool serial_port_type::read(uint8_t& c, int timeout_ms)
+{
+    if (input_pos == input_len)
+    {
+        if (handle < 0 || !serial_wait(handle, POLLIN, timeout_ms)) return false;
+
+        const ssize_t n = ::read(handle, input, sizeof(input));
+        if (n <= 0) return false;       // EAGAIN, or pty master with no slave (EIO)
+        input_pos = 0;
+        input_len = (unsigned)n;
+    }
+
+    c = input[input_pos++];
+    return true;
+}
+
+bool serial_port_type::write(const uint8_t* data, unsigned length)
+{
+    while (length)
+    {
+        if (handle < 0) return false;
+
+        const ssize_t n = ::write(handle, data, length);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN || !serial_wait(handle, POLLOUT, SERIAL_WRITE_WAIT_MS)) return false;
+            continue;
+        }
+        data += n;
+        length -= (unsigned)n;
+    }
+    return true;
+}
+
+// /sys/class/tty/<tty>/device is the USB interface; idVendor and idProduct are in the USB device above it
+unsigned serial_port_type::find_devices(unsigned vid, unsigned pid, std::vector<std::string>& paths)
+{
+    static constexpr unsigned SYSFS_LEVELS = 4;     // interface, device, and a hub or two, for other bus layouts
+
+    auto read_hex = [](const std::string& file, unsigned& value)
+    {
+        FILE* f = fopen(file.c_str(), "r");
+        if (!f) return false;
+        const bool good = (fscanf(f, "%x", &value) == 1);
+        fclose(f);
+        return good;
+    };
+
+    paths.clear();
+    DIR* D = opendir("/sys/class/tty");
+    if (!D) return 0;
+
+    while (const dirent* E = readdir(D))
+    {
+        if (E->d_name[0] == '.') continue;
+
+        char real[PATH_MAX];
+        const std::string device = std::string("/sys/class/tty/") + E->d_name + "/device";
+        if (!realpath(device.c_str(), real)) continue;     // virtual terminal, not a device
+
+        std::string dir = real;
+        for (unsigned k = 0; k < SYSFS_LEVELS; k++)
+        {
+            unsigned v = 0, p = 0;
+            if (read_hex(dir + "/idVendor", v) && read_hex(dir + "/idProduct", p))
+            {
+                if (v == vid && p == pid) paths.push_back(std::string("/dev/") + E->d_name);
+                break;      // the USB device of this tty, matching or not
+            }
+
+            const auto slash = dir.rfind('/');
+            if (slash == std::string::npos || !slash) break;
+            dir.resize(slash);
+        }
+    }
+
+    closedir(D);
+    std::sort(paths.begin(), paths.end());      // readdir order is arbitrary
+    return (unsigned)paths.size();
+}
+
+#elif defined(_WIN32)
+
+#include <ctype.h>
+#include <stdio.h>
+#include <windows.h>
+#include <setupapi.h>
+#include <devguid.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "setupapi.lib")
+#endif
+
+static constexpr unsigned SERIAL_BITS_PER_BYTE = 10;   // start, 8 data, stop
+
+bool serial_port_type::open(const char* path, unsigned baud)
+{
+    close();
+    if (baud < 9600 || baud > 4000000) return false;
+
+    // COM10 and up are reached only by the device name; it works for all of them
+    std::string device = path;
+    if (device.compare(0, 4, "\\\\.\\")) device = "\\\\.\\" + device;
+
+    HANDLE h = CreateFileA(device.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    handle = (intptr_t)h;
+
+    // raw 8N1: no parity check, no flow control, no special characters; DTR on, the USB CDC device may wait for it
+    DCB D = {};
+    D.DCBlength = sizeof(D);
+    bool good = SetupComm(h, SERIAL_CHUNK, SERIAL_CHUNK) && GetCommState(h, &D);
+    if (good)
+    {
+        D.BaudRate = baud;
+        D.ByteSize = 8;
+        D.Parity = NOPARITY;
+        D.StopBits = ONESTOPBIT;
+        D.fBinary = TRUE;
+        D.fParity = FALSE;
+        D.fOutxCtsFlow = D.fOutxDsrFlow = FALSE;
+        D.fDsrSensitivity = FALSE;
+        D.fDtrControl = DTR_CONTROL_ENABLE;
+        D.fRtsControl = RTS_CONTROL_ENABLE;
+        D.fOutX = D.fInX = FALSE;
+        D.fErrorChar = D.fNull = FALSE;
+        D.fAbortOnError = FALSE;
+        good = SetCommState(h, &D);
+    }
+
+    // write may take as long as the frame takes on the line, and SERIAL_WRITE_WAIT_MS more
+    COMMTIMEOUTS T = {};
+    T.ReadIntervalTimeout = MAXDWORD;
+    T.WriteTotalTimeoutMultiplier = 1 + SERIAL_BITS_PER_BYTE * 1000 / baud;
+    T.WriteTotalTimeoutConstant = SERIAL_WRITE_WAIT_MS;
+    if (!good || !SetCommTimeouts(h, &T))
+    {
+        close();
+        return false;
+    }
+    read_timeout = 0;
+
+    PurgeComm(h, PURGE_RXCLEAR | PURGE_TXCLEAR);   // whatever the device said to the previous client
+    name = path;
+    return true;
+}
+
+bool serial_port_type::open_pty(const char*)
+{
+    return false;
+}
+
+void serial_port_type::close()
+{
+    if (handle >= 0) CloseHandle((HANDLE)handle);
+
+    handle = -1;
+    read_timeout = -1;
+    name.clear();
+    input_pos = input_len = 0;
+}
+
+bool serial_port_type::read(uint8_t& c, int timeout_ms)
+{
+    if (input_pos == input_len)
+    {
+        if (handle < 0) return false;
+
+        // MAXDWORD, MAXDWORD, timeout: returns at once with what has arrived, or waits for the first byte
+        timeout_ms = std::max(0, timeout_ms);
+        if (timeout_ms != read_timeout)
+        {
+            COMMTIMEOUTS T = {};
+            if (!GetCommTimeouts((HANDLE)handle, &T)) return false;
+            T.ReadIntervalTimeout = MAXDWORD;
+            T.ReadTotalTimeoutMultiplier = timeout_ms ? MAXDWORD : 0;
+            T.ReadTotalTimeoutConstant = (DWORD)timeout_ms;
+            if (!SetCommTimeouts((HANDLE)handle, &T)) return false;
+            read_timeout = timeout_ms;
+        }
+
+        DWORD n = 0;
+        if (!ReadFile((HANDLE)handle, input, sizeof(input), &n, nullptr) || !n) return false;
+        input_pos = 0;
+        input_len = (unsigned)n;
+    }
+
+    c = input[input_pos++];
+    return true;
+}
+
+bool serial_port_type::write(const uint8_t* data, unsigned length)
+{
+    while (length)
+    {
+        DWORD n = 0;
+        if (handle < 0 || !WriteFile((HANDLE)handle, data, length, &n, nullptr) || !n) return false;
+        data += n;
+        length -= (unsigned)n;
+    }
+    return true;
+}
+
+// ports class of the present devices; instance ID of a USB device is USB\VID_xxxx&PID_xxxx\serial,
+// its COM name is PortName in the device key
+unsigned serial_port_type::find_devices(unsigned vid, unsigned pid, std::vector<std::string>& paths)
+{
+    paths.clear();
+    HDEVINFO S = SetupDiGetClassDevsA(&GUID_DEVCLASS_PORTS, nullptr, nullptr, DIGCF_PRESENT);
+    if (S == INVALID_HANDLE_VALUE) return 0;
+
+    char id[256] = {};     // MAX_DEVICE_ID_LEN is 200
+    snprintf(id, sizeof(id), "VID_%04X&PID_%04X", vid, pid);
+    const std::string wanted = id;
+
+    SP_DEVINFO_DATA E = {};
+    E.cbSize = sizeof(E);
+    for (DWORD k = 0; SetupDiEnumDeviceInfo(S, k, &E); k++)
+    {
+        if (!SetupDiGetDeviceInstanceIdA(S, &E, id, sizeof(id), nullptr)) continue;
+        std::string instance = id;
+        for (auto& ch : instance) ch = (char)toupper((unsigned char)ch);
+        if (instance.find(wanted) == std::string::npos) continue;
+
+        HKEY K = SetupDiOpenDevRegKey(S, &E, DICS_FLAG_GLOBAL, 0, DIREG_DEV, KEY_READ);
+        if (K == INVALID_HANDLE_VALUE) continue;
+
+        char port[64] = {};
+        DWORD size = sizeof(port) - 1, type = 0;
+        if (RegQueryValueExA(K, "PortName", nullptr, &type, (LPBYTE)port, &size) == ERROR_SUCCESS && type == REG_SZ)
+            paths.push_back(port);
+        RegCloseKey(K);
+    }
+
+    SetupDiDestroyDeviceInfoList(S);
+    std::sort(paths.begin(), paths.end());
+    return (unsigned)paths.size();
+}
+
+#else
+
+// no serial port on other systems
+
+bool serial_port_type::open(const char*, unsigned) { return false; }
+bool serial_port_type::open_pty(const char*) { return false; }
+void serial_port_type::close() {}
+bool serial_port_type::read(uint8_t&, int) { return false; }
+bool serial_port_type::write(const uint8_t*, unsigned) { return false; }
+unsigned serial_port_type::find_devices(unsigned, unsigned, std::vector<std::string>& paths) { paths.clear(); return 0; }
+
+#endif
+
+bool serial_port_type::find_device(unsigned vid, unsigned pid, std::string& path)
+{
+    std::vector<std::string> paths;
+    if (!find_devices(vid, pid, paths)) return false;
+    path = paths.front();
+    return true;
+}
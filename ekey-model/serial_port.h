@@ -0,0 +1,66 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// Serial port of the host: ekey-query talks to the device through it, ekey-bench --serial too; the simulator
+// serves the master side of a pseudo-terminal with the same class (ekey-model --pty), so the whole serial path
+// runs on one machine. Linux: termios, devices found in sysfs. Windows: COM ports, devices found by SetupAPI;
+// there are no pseudo-terminals, open_pty() fails.
+//
+// The port is raw 8N1, no flow control. The calls below wait until the port is ready or the timeout expires
+// (poll() on Linux, COMMTIMEOUTS on Windows). Input is read in chunks of SERIAL_CHUNK and given out by byte,
+// output goes in one write per frame.
+
+#pragma once
+#include <string>
+#include <vector>
+#include "interface.h"
+
+static constexpr unsigned SERIAL_CHUNK = 4096;
+static constexpr int SERIAL_WRITE_WAIT_MS = READ_DELAY_MS;     // the other side does not take the data
+
+class serial_port_type
+{
+public:
+    serial_port_type() = default;
+    ~serial_port_type() { close(); }
+    serial_port_type(const serial_port_type&) = delete;
+    serial_port_type& operator=(const serial_port_type&) = delete;
+
+    // device such as /dev/ttyACM0 or COM3; baud is one of the standard rates, 9600 up to 4000000
+    bool open(const char* path, unsigned baud);
+
+    // simulator: new pseudo-terminal, this is the master side; path() is the slave for the client to open,
+    // and link, if given, is made a symbolic link to it
+    bool open_pty(const char* link);
+
+    void close();
+    bool is_open() const { return handle >= 0; }
+    const char* path() const { return name.c_str(); }
+
+    // returns false if nothing has arrived in timeout_ms, or the port is gone
+    bool read(uint8_t& c, int timeout_ms);
+    bool write(const uint8_t* data, unsigned length);
+
+    // ports of all USB devices with this VID:PID, as /dev/<tty> (from sysfs) or COM<n> (from SetupAPI),
+    // in the order of the names; returns how many
+    static unsigned find_devices(unsigned vid, unsigned pid, std::vector<std::string>& paths);
+
+    // first of them
+    static bool find_device(unsigned vid, unsigned pid, std::string& path);
+
+private:
+    intptr_t handle = -1;   // HANDLE on Windows, int elsewhere
+    int pty_slave = -1;     // kept open, so the master does not see hangup while no client has the port
+    int read_timeout = -1;  // Windows: read timeout the port is set to
+    std::string name;
+    std::string link_name;
+    uint8_t input[SERIAL_CHUNK];
+    unsigned input_pos = 0;
+    unsigned input_len = 0;
+};
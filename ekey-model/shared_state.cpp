@@ -0,0 +1,339 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include <SKLib/sklib.hpp>
+#include "shared_state.h"
+#include "emulation_store.h"
+#include "crc.h"
+
+#ifdef EMULATION_SOCKET
+
+// created on first use, so it does not depend on the order of static initialization
+static std::shared_ptr<SharedState>& published_state()
+{
+    static std::shared_ptr<SharedState> Published = std::make_shared<SharedState>();
+    return Published;
+}
+
+static std::mutex UpdateLock;
+static thread_local std::shared_ptr<SharedState> Pinned;
+static thread_local bool Updating = false;          // Pinned is the private copy of StateUpdate
+static thread_local bool IndexCopied = false;       // and its index is not shared with the published state
+
+static uint64_t ChunkVersion = 0;      // under UpdateLock
+
+// image file: header, then two slots. Slot is the table of CRC32 of its parts, then the parts:
+// KeyIndexData by pages, blocks, key chunks. Every part starts at page boundary of the file
+struct StoreHeader
+{
+    char magic[8];
+    uint32_t slot_size;         // differs between builds, e.g. with and without shadow table
+    uint32_t reserved;
+    uint64_t generation[2];     // higher is newer, 0 is empty slot
+    uint32_t crc[2];            // CRC32 of the table of the slot
+};
+
+static constexpr size_t STORE_PAGE = 4096;
+static constexpr size_t store_align(size_t n) { return (n + STORE_PAGE - 1) / STORE_PAGE * STORE_PAGE; }
+
+static constexpr size_t CHUNK_DATA_SIZE = sizeof(KeyChunk::Pair);
+static constexpr size_t INDEX_PAGES = (sizeof(KeyIndexData) + STORE_PAGE - 1) / STORE_PAGE;
+
+static constexpr unsigned PART_BLOCKS = INDEX_PAGES;
+static constexpr unsigned PART_CHUNKS = PART_BLOCKS + BLOCK_COUNT;
+static constexpr unsigned PARTS = PART_CHUNKS + KEY_CHUNKS;
+
+static constexpr size_t SLOT_INDEX = store_align(PARTS * sizeof(uint32_t));
+static constexpr size_t SLOT_BLOCKS = SLOT_INDEX + INDEX_PAGES * STORE_PAGE;
+static constexpr size_t SLOT_CHUNKS = SLOT_BLOCKS + store_align(BLOCK_COUNT * BLOCK_SIZE);
+static constexpr size_t SLOT_SIZE = SLOT_CHUNKS + store_align(KEY_CHUNKS * CHUNK_DATA_SIZE);
+
+static constexpr char STORE_MAGIC[8] = { 'E', 'K', 'E', 'Y', 'I', 'M', 'G', '3' };
+static constexpr size_t STORE_SLOT_OFFSET = STORE_PAGE;
+static constexpr size_t STORE_SIZE = STORE_SLOT_OFFSET + 2 * SLOT_SIZE;
+
+static_assert(std::is_trivially_copyable<KeyIndexData>::value, "Index data is stored as bytes");
+static_assert(sizeof(StoreHeader) <= STORE_SLOT_OFFSET, "Header must fit its page");
+static_assert(!(STORE_PAGE % BLOCK_SIZE) && !(CHUNK_DATA_SIZE % STORE_PAGE), "Blocks and chunks must not share pages");
+
+static mapped_file_type Store;
+static uint64_t StoreGeneration = 0;
+static unsigned StoreSlot = 1;                      // written last; the next write goes to the other one
+static constexpr uint64_t UNKNOWN = ~(uint64_t)0;
+static std::vector<uint64_t> SlotVersion[2];        // version of every part in the slot
+
+static uint8_t* store_slot(unsigned slot)
+{
+    return Store.data() + STORE_SLOT_OFFSET + slot * SLOT_SIZE;
+}
+
+static size_t part_offset(unsigned part)
+{
+    if (part < PART_BLOCKS) return SLOT_INDEX + part * STORE_PAGE;
+    if (part < PART_CHUNKS) return SLOT_BLOCKS + (part - PART_BLOCKS) * BLOCK_SIZE;
+    return SLOT_CHUNKS + (part - PART_CHUNKS) * CHUNK_DATA_SIZE;
+}
+
+static size_t part_size(unsigned part)
+{
+    if (part + 1 < PART_BLOCKS) return STORE_PAGE;
+    if (part + 1 == PART_BLOCKS) return sizeof(KeyIndexData) - (INDEX_PAGES - 1) * STORE_PAGE;
+    if (part < PART_CHUNKS) return BLOCK_SIZE;
+    return CHUNK_DATA_SIZE;
+}
+
+static uint32_t crc32_of(const uint8_t* data, size_t length)
+{
+    return crc32_type().update(data, length).get();
+}
+
+// pages of the file to flush, joined when adjacent
+class dirty_ranges_type
+{
+public:
+    void add(size_t offset, size_t length)
+    {
+        if (!Ranges.empty() && Ranges.back().second == offset) Ranges.back().second += length;
+        else Ranges.emplace_back(offset, offset + length);
+    }
+    void flush()
+    {
+        for (auto& R : Ranges) Store.flush(R.first, R.second - R.first);
+        Ranges.clear();
+    }
+
+private:
+    std::vector<std::pair<size_t, size_t>> Ranges;
+};
+
+// copies the part into the slot; if the slot has it (known is the version there), only if it differs
+static void store_part(uint8_t* base, unsigned part, const uint8_t* data, bool known, dirty_ranges_type& dirty)
+{
+    const size_t offset = part_offset(part), length = part_size(part);
+    uint8_t* dest = base + offset;
+
+    if (known && (data ? !memcmp(dest, data, length) : std::all_of(dest, dest + length, [](uint8_t c) { return !c; }))) return;
+
+    if (data) memcpy(dest, data, length);
+    else memset(dest, 0, length);
+    ((uint32_t*)base)[part] = crc32_of(dest, length);
+    dirty.add((size_t)(base - Store.data()) + offset, length);
+}
+
+// under UpdateLock; parts of the same version as in the slot are not even compared
+static void store_state(const SharedState& state)
+{
+    if (!Store.is_open()) return;
+
+    auto H = (StoreHeader*)Store.data();
+    const unsigned slot = StoreSlot ^ 1;
+    uint8_t* base = store_slot(slot);
+    auto& version = SlotVersion[slot];
+    dirty_ranges_type dirty;
+
+    if (version[0] != state.IndexVersion)
+    {
+        auto index = (const uint8_t*)static_cast<const KeyIndexData*>(state.Index.get());
+        for (unsigned p = 0; p < PART_BLOCKS; p++)
+        {
+            store_part(base, p, index + p * STORE_PAGE, version[p] != UNKNOWN, dirty);
+            version[p] = state.IndexVersion;
+        }
+    }
+
+    for (unsigned b = 0; b < BLOCK_COUNT; b++)
+    {
+        const BlockChunk* block = state.Blocks[b].get();
+        const uint64_t v = block ? block->Version : 0;
+        if (version[PART_BLOCKS + b] == v) continue;
+        store_part(base, PART_BLOCKS + b, block ? block->Data : nullptr, version[PART_BLOCKS + b] != UNKNOWN, dirty);
+        version[PART_BLOCKS + b] = v;
+    }
+
+    for (unsigned c = 0; c < KEY_CHUNKS; c++)
+    {
+        const KeyChunk* chunk = state.Keys[c].get();
+        const uint64_t v = chunk ? chunk->Version : 0;
+        if (version[PART_CHUNKS + c] == v) continue;
+        store_part(base, PART_CHUNKS + c, chunk ? &chunk->Pair[0][0] : nullptr, version[PART_CHUNKS + c] != UNKNOWN, dirty);
+        version[PART_CHUNKS + c] = v;
+    }
+
+    // the table and the parts go first, the header that makes the slot current after them
+    dirty.add((size_t)(base - Store.data()), PARTS * sizeof(uint32_t));
+    dirty.flush();
+
+    H->crc[slot] = crc32_of(base, PARTS * sizeof(uint32_t));
+    H->generation[slot] = ++StoreGeneration;
+    StoreSlot = slot;
+    Store.flush(0, sizeof(StoreHeader));
+}
+
+static bool slot_valid(unsigned slot)
+{
+    auto H = (const StoreHeader*)Store.data();
+    const uint8_t* base = store_slot(slot);
+    const uint32_t* part_crc = (const uint32_t*)base;
+
+    if (!H->generation[slot] || H->crc[slot] != crc32_of(base, PARTS * sizeof(uint32_t))) return false;
+    for (unsigned p = 0; p < PARTS; p++)
+    {
+        if (part_crc[p] != crc32_of(base + part_offset(p), part_size(p))) return false;
+    }
+    return true;
+}
+
+StoreOpen open_state_store(const char* path)
+{
+    if (!Store.open(path, STORE_SIZE)) return StoreOpen::failed;
+
+    auto H = (StoreHeader*)Store.data();
+    for (auto& V : SlotVersion) V.assign(PARTS, UNKNOWN);
+
+    if (!memcmp(H->magic, STORE_MAGIC, sizeof(STORE_MAGIC)) && H->slot_size == SLOT_SIZE)
+    {
+        int newest = -1;
+        for (unsigned k = 0; k < 2; k++)
+        {
+            if (slot_valid(k) && (newest < 0 || H->generation[k] > H->generation[newest])) newest = (int)k;
+        }
+
+        if (newest >= 0)
+        {
+            const uint8_t* base = store_slot((unsigned)newest);
+            auto& version = SlotVersion[newest];
+            auto state = std::make_shared<SharedState>();
+
+            memcpy(static_cast<KeyIndexData*>(state->Index.get()), base + SLOT_INDEX, sizeof(KeyIndexData));
+            state->IndexVersion = ++ChunkVersion;
+            for (unsigned p = 0; p < PART_BLOCKS; p++) version[p] = state->IndexVersion;
+
+            for (unsigned b = 0; b < BLOCK_COUNT; b++)
+            {
+                state->Blocks[b] = std::make_shared<BlockChunk>();
+                memcpy(state->Blocks[b]->Data, base + part_offset(PART_BLOCKS + b), BLOCK_SIZE);
+                version[PART_BLOCKS + b] = state->Blocks[b]->Version = ++ChunkVersion;
+            }
+            for (unsigned c = 0; c < KEY_CHUNKS; c++)
+            {
+                state->Keys[c] = std::make_shared<KeyChunk>();
+                memcpy(state->Keys[c]->Pair, base + part_offset(PART_CHUNKS + c), CHUNK_DATA_SIZE);
+                version[PART_CHUNKS + c] = state->Keys[c]->Version = ++ChunkVersion;
+            }
+
+            Pinned = state;             // shadow rows are not in the image
+            restore_key_shadow();
+            Pinned.reset();
+
+            StoreGeneration = H->generation[newest];
+            StoreSlot = (unsigned)newest;
+            std::atomic_store(&published_state(), state);
+            return StoreOpen::loaded;
+        }
+    }
+
+    // new or foreign image; it is overwritten by the first update
+    memset(H, 0, sizeof(StoreHeader));
+    memcpy(H->magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+    H->slot_size = SLOT_SIZE;
+    StoreGeneration = 0;
+    StoreSlot = 1;
+    return StoreOpen::created;
+}
+
+SharedState& shared_state()
+{
+    if (!Pinned) Pinned = std::atomic_load(&published_state());
+    return *Pinned;
+}
+
+// the first call in the update copies the index; the update that does not call it shares the index
+KeyIndexState& key_index()
+{
+    SharedState& S = shared_state();
+    if (Updating && !IndexCopied)
+    {
+        S.Index = std::make_shared<KeyIndexState>(*S.Index);
+        S.IndexVersion = ++ChunkVersion;
+        IndexCopied = true;
+    }
+    return *S.Index;
+}
+
+uint8_t* shared_key_pair(key_addr_t idx)
+{
+    static KeyChunk Empty = {};     // for the pairs that were never written; not written through this pointer
+    const KeyChunk* chunk = shared_state().Keys[idx / KEY_CHUNK].get();
+    return const_cast<uint8_t*>((chunk ? chunk : &Empty)->Pair[idx % KEY_CHUNK]);
+}
+
+uint8_t* shared_key_pair_write(key_addr_t idx)
+{
+    auto& chunk = shared_state().Keys[idx / KEY_CHUNK];
+    if (!chunk) chunk = std::make_shared<KeyChunk>();
+    else if (chunk.use_count() > 1) chunk = std::make_shared<KeyChunk>(*chunk);
+    else return chunk->Pair[idx % KEY_CHUNK];
+
+    chunk->Version = ++ChunkVersion;
+    return chunk->Pair[idx % KEY_CHUNK];
+}
+
+uint8_t* shared_block(uint8_t idx)
+{
+    static BlockChunk Empty = {};
+    const BlockChunk* block = shared_state().Blocks[idx].get();
+    return const_cast<uint8_t*>((block ? block : &Empty)->Data);
+}
+
+uint8_t* shared_block_write(uint8_t idx)
+{
+    auto& block = shared_state().Blocks[idx];
+    if (!block) block = std::make_shared<BlockChunk>();
+    else if (block.use_count() > 1) block = std::make_shared<BlockChunk>(*block);
+    else return block->Data;
+
+    block->Version = ++ChunkVersion;
+    return block->Data;
+}
+
+StateRead::StateRead()
+{
+    Pinned = std::atomic_load(&published_state());
+}
+
+StateRead::~StateRead()
+{
+    Pinned.reset();
+}
+
+StateUpdate::StateUpdate()
+{
+    UpdateLock.lock();
+    Pinned = std::make_shared<SharedState>(*std::atomic_load(&published_state()));
+    Updating = true;
+    IndexCopied = false;
+}
+
+StateUpdate::~StateUpdate()
+{
+    if (IndexCopied) refresh_key_search();  // readers do not modify the snapshot, the hash must be ready
+    std::atomic_store(&published_state(), Pinned);
+    store_state(*Pinned);
+    Updating = false;
+    Pinned.reset();
+    UpdateLock.unlock();
+}
+
+#endif
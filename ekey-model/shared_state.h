@@ -0,0 +1,96 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// The simulator serves many clients at once, one thread each. Keys, blocks and the index are kept in snapshots:
+// command that only reads pins the current snapshot (StateRead) for its duration; command that writes (StateUpdate)
+// makes the private copy, changes it, and publishes it with one atomic store when done. Readers never wait,
+// writers wait for each other. The hardware has one client, and there the guards do nothing.
+
+#pragma once
+#include "interface.h"
+#include "key_index.h"
+#include "record_store.h"
+
+#ifdef EMULATION_SOCKET
+
+// key pairs are in chunks: snapshots share the chunks, StateUpdate copies the chunk it writes to
+struct KeyChunk
+{
+    uint8_t Pair[KEY_CHUNK][2 * KEY_SIZE];
+    uint64_t Version = 0;                       // new one for every copy, tells the image what to write
+};
+
+// same for the record blocks, one block each
+struct BlockChunk
+{
+    uint8_t Data[BLOCK_SIZE];
+    uint64_t Version = 0;
+};
+
+// the copy made by StateUpdate is small: the index, key chunks and blocks are shared with the published state
+// until the update writes to them (key_index() copies the index on first use in the update)
+struct SharedState
+{
+    std::shared_ptr<KeyIndexState> Index = std::make_shared<KeyIndexState>();
+    uint64_t IndexVersion = 0;
+    std::shared_ptr<KeyChunk> Keys[KEY_CHUNKS]; // nullptr: never written, all zeros
+    std::shared_ptr<BlockChunk> Blocks[BLOCK_COUNT];
+    RecordCache Records;                        // blocks written, not yet in Blocks; not in the image
+};
+
+// snapshot of the calling thread; if there is none, the latest one is pinned until the next guard
+SharedState& shared_state();
+
+// key pair in the snapshot, and the same for writing (under StateUpdate)
+uint8_t* shared_key_pair(key_addr_t idx);
+uint8_t* shared_key_pair_write(key_addr_t idx);
+
+// record block in the snapshot, and for writing
+uint8_t* shared_block(uint8_t idx);
+uint8_t* shared_block_write(uint8_t idx);
+
+// Persistent image: every published state is also written to the mapped file, so the simulator restarts
+// with keys, blocks, permutation and index as they were; only the shadow rows are recalculated, no sorting.
+// The file has two slots, written in turn, each with generation and CRC32; if the process dies while writing
+// one, the other is used. The slot is in parts (pages of the index, blocks, key chunks), each with own CRC32;
+// a part is copied into the slot only if changed since that slot was written, and only those pages are flushed.
+// Call before the first StateUpdate.
+
+enum class StoreOpen { failed, created, loaded };
+StoreOpen open_state_store(const char* path);
+
+class StateRead
+{
+public:
+    StateRead();
+    ~StateRead();
+};
+
+class StateUpdate
+{
+public:
+    StateUpdate();
+    ~StateUpdate();
+};
+
+#else
+
+class StateRead
+{
+public:
+    StateRead() {}
+};
+
+class StateUpdate
+{
+public:
+    StateUpdate() {}
+};
+
+#endif
@@ -0,0 +1,122 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+#include <SKLib/sklib.hpp>
+#include "telemetry.h"
+
+#ifdef EMULATION_SOCKET
+#include <atomic>
+
+typedef std::atomic<uint32_t> counter_type;
+static inline void counter_add(counter_type& c, uint32_t n) { c.fetch_add(n, std::memory_order_relaxed); }
+static inline uint32_t counter_get(const counter_type& c) { return c.load(std::memory_order_relaxed); }
+
+#else
+
+typedef uint32_t counter_type;
+static inline void counter_add(counter_type& c, uint32_t n) { c += n; }
+static inline uint32_t counter_get(const counter_type& c) { return c; }
+
+#endif
+
+struct SlotCounters
+{
+    counter_type Requests;
+    counter_type Nak;
+    counter_type Service[STATUS_BUCKETS];
+};
+
+static SlotCounters SLOT[STATUS_SLOTS];
+static counter_type LINK_CRC, LINK_FRAMING, LINK_TIMEOUT;
+static counter_type RECORD[RECORD_EVENTS];
+
+StatusSlot status_slot(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case (int)KeyFunction::prime_keys:       return StatusSlot::prime_keys;
+    case (int)KeyFunction::write_key:        return StatusSlot::write_key;
+    case (int)KeyFunction::erase_keys:       return StatusSlot::erase_keys;
+    case (int)KeyFunction::get_noise:        return StatusSlot::get_noise;
+    case (int)KeyFunction::get_record:       return StatusSlot::get_record;
+    case (int)KeyFunction::put_record:       return StatusSlot::put_record;
+    case (int)KeyFunction::exchange_batch:   return StatusSlot::exchange_batch;
+    case (int)KeyFunction::set_framing:      return StatusSlot::set_framing;
+    case (int)KeyFunction::get_record_range: return StatusSlot::get_record_range;
+    case (int)KeyFunction::put_record_range: return StatusSlot::put_record_range;
+    case (int)KeyFunction::get_status:       return StatusSlot::get_status;
+    case (int)KeyFunction::sync_records:     return StatusSlot::sync_records;
+    }
+    return StatusSlot::unknown;
+}
+
+static unsigned service_bucket(uint32_t us)
+{
+    unsigned b = 0;
+    for (us >>= STATUS_BUCKET_FIRST_BITS; us && b < STATUS_BUCKETS - 1; us >>= STATUS_BUCKET_STEP_BITS) b++;
+    return b;
+}
+
+void telemetry_request(StatusSlot slot, bool nak, uint32_t service_us)
+{
+    SlotCounters& S = SLOT[(unsigned)slot];
+    counter_add(S.Requests, 1);
+    if (nak) counter_add(S.Nak, 1);
+    counter_add(S.Service[service_bucket(service_us)], 1);
+}
+
+void telemetry_link_errors(const LinkErrors& errors)
+{
+    if (errors.crc) counter_add(LINK_CRC, errors.crc);
+    if (errors.framing) counter_add(LINK_FRAMING, errors.framing);
+    if (errors.timeout) counter_add(LINK_TIMEOUT, errors.timeout);
+}
+
+void telemetry_record(RecordEvent event)
+{
+    counter_add(RECORD[(unsigned)event], 1);
+}
+
+static uint8_t* put_counter(uint8_t* dest, const counter_type& c)
+{
+    const uint32_t v = counter_get(c);
+    dest[0] = (uint8_t)(v >> 24);
+    dest[1] = (uint8_t)(v >> 16);
+    dest[2] = (uint8_t)(v >> 8);
+    dest[3] = (uint8_t)v;
+    return dest + 4;
+}
+
+unsigned telemetry_report(uint8_t* dest)
+{
+    uint8_t* p = dest;
+
+    const bool crc16_good = crc16_ccitt_type().update((const uint8_t*)"123456789", 9).get() == 0x29B1;
+    const bool crc32_good = crc32_type().update((const uint8_t*)"123456789", 9).get() == 0xCBF43926u;
+
+    *p++ = STATUS_VERSION;
+    *p++ = (uint8_t)((crc16_good ? 1 : 0) | (crc32_good ? 2 : 0));
+    *p++ = (uint8_t)STATUS_SLOTS;
+    *p++ = (uint8_t)STATUS_BUCKETS;
+
+    p = put_counter(p, LINK_CRC);
+    p = put_counter(p, LINK_FRAMING);
+    p = put_counter(p, LINK_TIMEOUT);
+
+    for (const auto& S : SLOT)
+    {
+        p = put_counter(p, S.Requests);
+        p = put_counter(p, S.Nak);
+        for (const auto& c : S.Service) p = put_counter(p, c);
+    }
+
+    for (const auto& c : RECORD) p = put_counter(p, c);
+
+    return (unsigned)(p - dest);
+}
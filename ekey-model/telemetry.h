@@ -0,0 +1,77 @@
+// This file is part of E-Key project - hardware/software platform to support certain cryptography applications.
+// Copyright [2021] Secoh  https://github.com/Secoh/EKey
+// This application uses SKLib: https://github.com/Secoh/SKLib
+//
+// Licensed under the GNU General Public License, Version 3 or later. See: https://www.gnu.org/licenses/
+// You may not use this file except in compliance with the License. Any derivative work must retain the License.
+// Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//
+
+// Counters for get_status: requests and NAKs per command, receive errors, and service time histogram.
+// Fixed arrays of 32-bit counters, no allocation; the firmware adds to plain integers, the simulator uses
+// relaxed atomics because clients are served in parallel. Counters wrap around at 2^32.
+//
+// get_status response, all counters 4 bytes big endian:
+//   1 byte version (STATUS_VERSION), 1 byte self test (bit 0: CRC16 check value, bit 1: CRC32 check value),
+//   1 byte STATUS_SLOTS, 1 byte STATUS_BUCKETS,
+//   receive errors: CRC, framing/length, timeout,
+//   per slot (in StatusSlot order): requests, NAKs, STATUS_BUCKETS service time counts,
+//   record storage (in RecordEvent order, see record_store.h): blocks stored by the clients, of them identical
+//   to what was there, replaced in the cache before written; physical writes, syncs (sync_records, disconnect)
+
+#pragma once
+#include "interface.h"
+
+static constexpr uint8_t STATUS_VERSION = 2;
+
+// slot per command; exchange is the 256-byte packet without the command code
+enum class StatusSlot : uint8_t
+{
+    exchange,
+    prime_keys,
+    write_key,
+    erase_keys,
+    get_noise,
+    get_record,
+    put_record,
+    exchange_batch,
+    set_framing,
+    get_record_range,
+    put_record_range,
+    get_status,
+    sync_records,
+    unknown,
+    count
+};
+
+static constexpr unsigned STATUS_SLOTS = (unsigned)StatusSlot::count;
+
+// service time, from the command packet received to the response sent: below 16 us, then x4 per bucket
+// (64 us, 256 us, 1 ms, 4 ms, 16 ms, 65 ms), and the rest
+static constexpr unsigned STATUS_BUCKETS = 8;
+static constexpr unsigned STATUS_BUCKET_FIRST_BITS = 4;     // 16 us
+static constexpr unsigned STATUS_BUCKET_STEP_BITS = 2;      // x4
+
+// physical writes avoided: identical + replaced
+enum class RecordEvent : uint8_t
+{
+    stored,
+    identical,
+    replaced,
+    physical,
+    sync,
+    count
+};
+
+static constexpr unsigned RECORD_EVENTS = (unsigned)RecordEvent::count;
+
+static constexpr unsigned STATUS_LENGTH = 4 + 3*4 + STATUS_SLOTS * (2 + STATUS_BUCKETS) * 4 + RECORD_EVENTS * 4;
+
+StatusSlot status_slot(uint8_t opcode);
+
+void telemetry_request(StatusSlot slot, bool nak, uint32_t service_us);
+void telemetry_link_errors(const LinkErrors& errors);
+void telemetry_record(RecordEvent event);
+
+// writes the get_status response, STATUS_LENGTH bytes
+unsigned telemetry_report(uint8_t* dest);
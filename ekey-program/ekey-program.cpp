@@ -7,10 +7,503 @@
 // Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 //
 
-#include <iostream>
+// Bulk provisioning of EKey: key pairs and records are streamed from files, written with several requests
+// in flight, and read back for verification.
+//
+//   ekey-program [options]
+//   --host H, --port P    EKey to program (default: localhost, SOCKET_EKEY_PORT)
+//   --keys FILE           key pairs, 2*KEY_SIZE bytes each: key pattern, then payload
+//   --first-key N         table index of the first pair in the file (default 0)
+//   --records FILE        record image, BLOCK_SIZE bytes per record
+//   --first-record N      address of the first record in the file (default 0)
+//   --prime FILE          KEY_SIZE bytes permutation vector, sent before the keys
+//   --erase               erase the key table before writing (not when resuming)
+//   --journal FILE        progress file; entries already done are skipped on the next run, which must have
+//                         the same input files (size and CRC32) and --first-key, --first-record
+//   --pipeline N          requests in flight (default 32)
+//   --baud N              line speed of the EKey, such as ekey-model --link; the reply timeout then covers
+//                         the whole pipeline of the longest frames at that speed (default: fast link, 2 s)
+//   --no-verify           skip the read back
+//
+// Input files are read in chunks, one chunk at a time is written while the previous one is verified.
+// Key pairs are verified by exchange_batch: every pattern must give back its payload. Records are read
+// back by get_record. A chunk goes into the journal only after it is verified.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
 #include <SKLib/sklib.hpp>
 
-int main()
+// Shared IO settings, common IO functions, KEY, BLOCK sizes, counts
+#include "../ekey-model/interface.h"
+
+// pipelined client
+#include "../ekey-client/ekey_client.h"
+
+// input file identity in the journal
+#include "../ekey-model/crc.h"
+
+static constexpr unsigned KEY_PAIR_SIZE = 2 * KEY_SIZE;
+static constexpr unsigned KEY_CHUNK = 64;           // pairs per chunk; also the largest verification batch
+static constexpr unsigned RECORD_CHUNK = 4;         // records per chunk
+static constexpr unsigned CHUNKS_IN_FLIGHT = 2;     // chunk being written, chunk being verified
+
+static const char* HOST = "127.0.0.1";
+static unsigned PORT = SOCKET_EKEY_PORT;
+static unsigned PIPELINE = 32;
+static unsigned BAUD = 0;
+static bool VERIFY = true;
+static unsigned BATCH_MAX = 0;
+
+static ekey_client_type Client;
+
+// -------------------------------------------------------------
+
+// input file as the journal knows it: entries written and verified, and what they were taken from
+struct journal_input_type
+{
+    unsigned Done = 0;
+    unsigned First = 0;         // --first-key or --first-record
+    uint64_t Size = 0;
+    uint32_t Crc = 0;           // CRC32 of the whole file
+};
+
+// progress of every input file; the run resumes only with the same files and the same first entries
+struct journal_type
+{
+    std::string Path;
+    journal_input_type Keys;
+    journal_input_type Records;
+
+    // false if the file is there, but cannot be read (such as the older format without identity)
+    bool load()
+    {
+        if (Path.empty()) return true;
+        FILE* f = fopen(Path.c_str(), "r");
+        if (!f) return true;
+        const bool good = read(f, "keys", Keys) && read(f, "records", Records);
+        fclose(f);
+        if (!good) Keys = Records = journal_input_type();
+        return good;
+    }
+
+    // new file is written next to the old one, then replaces it; if the run breaks in between, it starts over
+    bool save() const
+    {
+        if (Path.empty()) return true;
+        const std::string temp = Path + ".new";
+        FILE* f = fopen(temp.c_str(), "w");
+        if (!f) return false;
+        const bool written = write(f, "keys", Keys) && write(f, "records", Records);
+        if (fclose(f) || !written) return false;
+        remove(Path.c_str());
+        return !rename(temp.c_str(), Path.c_str());
+    }
+
+    // takes the identity of the input file that is about to be written, or refuses it if it is not the one
+    // that the journal counted
+    bool resume(const char* name, journal_input_type& entry, const journal_input_type& input) const
+    {
+        if (!entry.Done)
+        {
+            entry = input;
+            return true;
+        }
+        if (entry.First == input.First && entry.Size == input.Size && entry.Crc == input.Crc) return true;
+
+        fprintf(stderr, "%s has %u %s done from another input: first %u, %llu bytes, CRC32 %08X; now first %u, %llu bytes, CRC32 %08X\n"
+                        "remove it to start over\n", Path.c_str(), entry.Done, name,
+                        entry.First, (unsigned long long)entry.Size, entry.Crc, input.First, (unsigned long long)input.Size, input.Crc);
+        return false;
+    }
+
+private:
+    static bool read(FILE* f, const char* name, journal_input_type& entry)
+    {
+        char word[16] = {};
+        unsigned long long size = 0;
+        if (fscanf(f, "%15s %u first %u size %llu crc %x", word, &entry.Done, &entry.First, &size, &entry.Crc) != 5) return false;
+        entry.Size = size;
+        return !strcmp(word, name);
+    }
+
+    static bool write(FILE* f, const char* name, const journal_input_type& entry)
+    {
+        return fprintf(f, "%s %u first %u size %llu crc %08X\n", name, entry.Done, entry.First, (unsigned long long)entry.Size, entry.Crc) > 0;
+    }
+};
+
+// size and CRC32 of the input file, for the journal
+static bool file_identity(const char* path, unsigned first, journal_input_type& input)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) return false;
+
+    input = journal_input_type();
+    input.First = first;
+    crc32_type crc;
+    std::vector<uint8_t> buffer(1 << 16);
+    while (const size_t n = fread(buffer.data(), 1, buffer.size(), f))
+    {
+        crc.update_sliced(buffer.data(), n);
+        input.Size += n;
+    }
+    input.Crc = crc.get();
+
+    const bool good = !ferror(f);
+    fclose(f);
+    return good;
+}
+
+static journal_type JOURNAL;
+
+// fixed size entries from the file, a chunk at a time, from the given entry on
+class chunk_reader_type
+{
+public:
+    chunk_reader_type(unsigned entry_size, unsigned chunk_entries) : Entry(entry_size), Buffer(entry_size * chunk_entries) {}
+    ~chunk_reader_type() { if (File) fclose(File); }
+
+    // checks that the file has whole entries, returns their count or -1
+    int open(const char* path, unsigned first_entry)
+    {
+        File = fopen(path, "rb");
+        if (!File || fseek(File, 0, SEEK_END)) return -1;
+        const long size = ftell(File);
+        if (size < 0 || size % Entry || fseek(File, (long)first_entry * Entry, SEEK_SET)) return -1;
+        return (int)(size / Entry);
+    }
+
+    // returns number of entries read, 0 at the end of file
+    unsigned next(const uint8_t*& data)
+    {
+        data = Buffer.data();
+        return (unsigned)(fread(Buffer.data(), Entry, Buffer.size() / Entry, File));
+    }
+
+private:
+    FILE* File = nullptr;
+    unsigned Entry;
+    std::vector<uint8_t> Buffer;
+};
+
+// -------------------------------------------------------------
+
+// chunk of the input on its way: copy of the data, answers to write requests, verification requests
+struct chunk_type
+{
+    unsigned First;         // first entry in the file
+    unsigned Count;
+    std::vector<uint8_t> Data;
+    std::vector<std::future<ClientReply>> Writes;
+    std::vector<std::future<ClientReply>> Reads;
+};
+
+struct progress_type
+{
+    const char* Name;
+    unsigned Total;
+    unsigned Entry;
+    unsigned Resumed;       // done by the previous runs
+    unsigned Done;
+    std::chrono::steady_clock::time_point Start, Shown;
+
+    void show(bool last)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (!last && now - Shown < std::chrono::seconds(1)) return;
+        Shown = now;
+
+        const double seconds = std::max(1e-6, std::chrono::duration<double>(now - Start).count());
+        const unsigned n = Done - Resumed;
+        printf("%s %u/%u, %.0f/s, %.2f MB/s%s", Name, Done, Total, n / seconds, n * (double)Entry / seconds / 1e6, (last ? "\n" : "\r"));
+        fflush(stdout);
+    }
+};
+
+static bool wait_ack(std::vector<std::future<ClientReply>>& replies)
+{
+    bool good = true;
+    for (auto& r : replies) good = (r.get().Status == ReplyStatus::ack) && good;     // every future is collected
+    return good;
+}
+
+// verification of the keys: answer of exchange_batch is ACK and payload, or NAK, per pattern
+static bool verify_keys(chunk_type& C, unsigned batch)
+{
+    for (unsigned b = 0; b < (unsigned)C.Reads.size(); b++)
+    {
+        const ClientReply R = C.Reads[b].get();
+        if (R.Status != ReplyStatus::ack) return false;
+
+        const unsigned first = b * batch, count = std::min(batch, C.Count - first);
+        unsigned pos = 0;
+        for (unsigned k = first; k < first + count; k++)
+        {
+            if (pos + 1 + KEY_SIZE > R.Data.size() || R.Data[pos] != (uint8_t)KeyResponse::ACK) return false;
+            if (memcmp(R.Data.data() + pos + 1, C.Data.data() + k * KEY_PAIR_SIZE + KEY_SIZE, KEY_SIZE)) return false;
+            pos += 1 + KEY_SIZE;
+        }
+    }
+    return true;
+}
+
+static bool verify_records(chunk_type& C)
+{
+    bool good = true;
+    for (unsigned k = 0; k < (unsigned)C.Reads.size(); k++)
+    {
+        const ClientReply R = C.Reads[k].get();
+        good = good && R.Status == ReplyStatus::ack && R.Data.size() == BLOCK_SIZE && !memcmp(R.Data.data(), C.Data.data() + k * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    return good;
+}
+
+static bool program_keys(const char* path, unsigned first_key)
+{
+    journal_input_type input;
+    if (!file_identity(path, first_key, input))
+    {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return false;
+    }
+    if (!JOURNAL.resume("key pairs", JOURNAL.Keys, input)) return false;
+
+    chunk_reader_type Reader(KEY_PAIR_SIZE, KEY_CHUNK);
+    const int total = Reader.open(path, JOURNAL.Keys.Done);
+    if (total < 0)
+    {
+        fprintf(stderr, "Cannot read %s, or its size is not a multiple of %u\n", path, KEY_PAIR_SIZE);
+        return false;
+    }
+    if (first_key + (unsigned)total > KEY_COUNT)
+    {
+        fprintf(stderr, "%d key pairs from %u do not fit into the table of %u\n", total, first_key, KEY_COUNT);
+        return false;
+    }
+
+    progress_type P = { "keys", (unsigned)total, KEY_PAIR_SIZE, JOURNAL.Keys.Done, JOURNAL.Keys.Done, std::chrono::steady_clock::now(), {} };
+    const unsigned batch = std::max(1u, std::min(BATCH_MAX, KEY_CHUNK));
+    std::deque<chunk_type> Flight;
+    unsigned next = JOURNAL.Keys.Done;
+
+    while (true)
+    {
+        const uint8_t* data = nullptr;
+        const unsigned count = (Flight.size() < CHUNKS_IN_FLIGHT) ? Reader.next(data) : 0;
+
+        if (count)
+        {
+            Flight.push_back(chunk_type{ next, count, std::vector<uint8_t>(data, data + count * KEY_PAIR_SIZE), {}, {} });
+            chunk_type& C = Flight.back();
+            next += count;
+
+            for (unsigned k = 0; k < count; k++)
+            {
+                const uint8_t* pair = C.Data.data() + k * KEY_PAIR_SIZE;
+                C.Writes.push_back(Client.write_key(first_key + C.First + k, pair, pair + KEY_SIZE));
+            }
+
+            // answers come in order, the batch sees the writes before it
+            std::vector<uint8_t> patterns(batch * KEY_SIZE);
+            for (unsigned b = 0; VERIFY && b < count; b += batch)
+            {
+                const unsigned n = std::min(batch, count - b);
+                for (unsigned k = 0; k < n; k++) memcpy(patterns.data() + k * KEY_SIZE, C.Data.data() + (b + k) * KEY_PAIR_SIZE, KEY_SIZE);
+                C.Reads.push_back(Client.exchange_batch(patterns.data(), n));
+            }
+
+            if (Flight.size() < CHUNKS_IN_FLIGHT) continue;
+        }
+
+        if (Flight.empty()) break;
+
+        chunk_type& C = Flight.front();
+        if (!wait_ack(C.Writes))
+        {
+            fprintf(stderr, "\nwrite_key failed in pairs %u..%u\n", C.First, C.First + C.Count - 1);
+            return false;
+        }
+        if (VERIFY && !verify_keys(C, batch))
+        {
+            fprintf(stderr, "\nverification failed in pairs %u..%u\n", C.First, C.First + C.Count - 1);
+            return false;
+        }
+
+        JOURNAL.Keys.Done = P.Done = C.First + C.Count;
+        if (!JOURNAL.save())
+        {
+            fprintf(stderr, "\nCannot write %s\n", JOURNAL.Path.c_str());
+            return false;
+        }
+        Flight.pop_front();
+        P.show(false);
+    }
+
+    P.show(true);
+    return true;
+}
+
+static bool program_records(const char* path, unsigned first_record)
+{
+    journal_input_type input;
+    if (!file_identity(path, first_record, input))
+    {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return false;
+    }
+    if (!JOURNAL.resume("records", JOURNAL.Records, input)) return false;
+
+    chunk_reader_type Reader(BLOCK_SIZE, RECORD_CHUNK);
+    const int total = Reader.open(path, JOURNAL.Records.Done);
+    if (total < 0)
+    {
+        fprintf(stderr, "Cannot read %s, or its size is not a multiple of %u\n", path, BLOCK_SIZE);
+        return false;
+    }
+    if (first_record + (unsigned)total > BLOCK_COUNT)
+    {
+        fprintf(stderr, "%d records from %u do not fit into %u\n", total, first_record, BLOCK_COUNT);
+        return false;
+    }
+
+    progress_type P = { "records", (unsigned)total, BLOCK_SIZE, JOURNAL.Records.Done, JOURNAL.Records.Done, std::chrono::steady_clock::now(), {} };
+    std::deque<chunk_type> Flight;
+    unsigned next = JOURNAL.Records.Done;
+
+    while (true)
+    {
+        const uint8_t* data = nullptr;
+        const unsigned count = (Flight.size() < CHUNKS_IN_FLIGHT) ? Reader.next(data) : 0;
+
+        if (count)
+        {
+            Flight.push_back(chunk_type{ next, count, std::vector<uint8_t>(data, data + count * BLOCK_SIZE), {}, {} });
+            chunk_type& C = Flight.back();
+            next += count;
+
+            for (unsigned k = 0; k < count; k++) C.Writes.push_back(Client.put_record(first_record + C.First + k, C.Data.data() + k * BLOCK_SIZE));
+            C.Writes.push_back(Client.sync_records());     // the device may hold them in RAM, the journal counts stored ones
+            for (unsigned k = 0; VERIFY && k < count; k++) C.Reads.push_back(Client.get_record(first_record + C.First + k));
+
+            if (Flight.size() < CHUNKS_IN_FLIGHT) continue;
+        }
+
+        if (Flight.empty()) break;
+
+        chunk_type& C = Flight.front();
+        if (!wait_ack(C.Writes))
+        {
+            fprintf(stderr, "\nput_record failed in records %u..%u\n", C.First, C.First + C.Count - 1);
+            return false;
+        }
+        if (VERIFY && !verify_records(C))
+        {
+            fprintf(stderr, "\nverification failed in records %u..%u\n", C.First, C.First + C.Count - 1);
+            return false;
+        }
+
+        JOURNAL.Records.Done = P.Done = C.First + C.Count;
+        if (!JOURNAL.save())
+        {
+            fprintf(stderr, "\nCannot write %s\n", JOURNAL.Path.c_str());
+            return false;
+        }
+        Flight.pop_front();
+        P.show(false);
+    }
+
+    P.show(true);
+    return true;
+}
+
+static bool send_prime(const char* path)
+{
+    uint8_t permutation[KEY_SIZE];
+    FILE* f = fopen(path, "rb");
+    const bool loaded = f && fread(permutation, 1, KEY_SIZE, f) == KEY_SIZE;
+    if (f) fclose(f);
+    if (!loaded)
+    {
+        fprintf(stderr, "Cannot read %u bytes from %s\n", KEY_SIZE, path);
+        return false;
+    }
+
+    if (Client.prime(permutation).get().Status != ReplyStatus::ack)
+    {
+        fprintf(stderr, "prime_keys failed\n");
+        return false;
+    }
+    return true;
+}
+
+// -------------------------------------------------------------
+
+int main(int argc, char* argv[])
 {
-    std::cout << "Hello World!\n";
+    const char* keys = nullptr;
+    const char* records = nullptr;
+    const char* prime = nullptr;
+    unsigned first_key = 0, first_record = 0;
+    bool erase = false;
+
+    for (int k = 1; k < argc; k++)
+    {
+        const bool more = (k + 1 < argc);
+        if (!strcmp(argv[k], "--host") && more) HOST = argv[++k];
+        else if (!strcmp(argv[k], "--port") && more) PORT = (unsigned)atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--keys") && more) keys = argv[++k];
+        else if (!strcmp(argv[k], "--first-key") && more) first_key = (unsigned)atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--records") && more) records = argv[++k];
+        else if (!strcmp(argv[k], "--first-record") && more) first_record = (unsigned)atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--prime") && more) prime = argv[++k];
+        else if (!strcmp(argv[k], "--journal") && more) JOURNAL.Path = argv[++k];
+        else if (!strcmp(argv[k], "--pipeline") && more) PIPELINE = (unsigned)std::max(1, atoi(argv[++k]));
+        else if (!strcmp(argv[k], "--baud") && more) BAUD = (unsigned)std::max(0, atoi(argv[++k]));
+        else if (!strcmp(argv[k], "--erase")) erase = true;
+        else if (!strcmp(argv[k], "--no-verify")) VERIFY = false;
+        else
+        {
+            fprintf(stderr, "Usage: ekey-program [--host H] [--port P] [--keys FILE] [--first-key N] [--records FILE] [--first-record N]\n"
+                            "                    [--prime FILE] [--erase] [--journal FILE] [--pipeline N] [--baud N] [--no-verify]\n");
+            return -1;
+        }
+    }
+
+    if (!JOURNAL.load())
+    {
+        fprintf(stderr, "Cannot read %s; remove it to start over\n", JOURNAL.Path.c_str());
+        return -1;
+    }
+    if (JOURNAL.Keys.Done || JOURNAL.Records.Done) printf("resuming: %u key pairs, %u records done\n", JOURNAL.Keys.Done, JOURNAL.Records.Done);
+
+    if (!Client.connect(HOST, PORT, PIPELINE, BAUD ? ekey_client_type::line_timeout_ms(BAUD, PIPELINE) : 0))
+    {
+        fprintf(stderr, "Cannot connect to EKey at %s:%u\n", HOST, PORT);
+        return -1;
+    }
+
+    // the largest batch the device takes
+    const uint8_t none = 0;
+    const ClientReply B = Client.exchange_batch(&none, 0).get();
+    BATCH_MAX = (B.Status == ReplyStatus::ack && B.Data.size() == 1) ? B.Data[0] : 1;
+
+    if (erase && JOURNAL.Keys.Done) printf("not erasing, the table is partly written\n");
+    else if (erase && Client.erase().get().Status != ReplyStatus::ack)
+    {
+        fprintf(stderr, "erase_keys failed\n");
+        return -1;
+    }
+
+    if (prime && !send_prime(prime)) return -1;
+    if (keys && !program_keys(keys, first_key)) return -1;
+    if (records && !program_records(records, first_record)) return -1;
+
+    Client.close();
+    return 0;
 }
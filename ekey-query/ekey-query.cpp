@@ -7,6 +7,7 @@
 // Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 //
 
+#include <cstring>
 #include <iostream>
 
 #include <SKLib/sklib.hpp>
@@ -17,31 +18,57 @@
 // serial I/O actual functions
 #include "serial_io.h"
 
+// ekey-query --capture FILE records the session
+// ekey-query --port DEV [--baud N] talks over the serial port, such as the one of ekey-model --pty
+#include "../ekey-model/capture.h"
+
 static constexpr unsigned BUFFER_SIZE = 1536;
 uint8_t BUFFER[std::max({ BUFFER_SIZE, Interface::read_buffer_size(KEY_SIZE), Interface::read_buffer_size(BLOCK_SIZE) })];
 
-int main()
+int main(int argc, char* argv[])
 {
     // initialization
 
+    const char* capture_path = nullptr;
+    const char* port = nullptr;
+    unsigned baud = SERIAL_SPEED;
+
+    for (int k = 1; k < argc; k++)
+    {
+        if (!strcmp(argv[k], "--capture") && k+1 < argc) capture_path = argv[++k];
+        if (!strcmp(argv[k], "--port") && k+1 < argc) port = argv[++k];
+        if (!strcmp(argv[k], "--baud") && k+1 < argc) baud = (unsigned)strtoul(argv[++k], nullptr, 0);
+    }
+
+    if (capture_path)
+    {
+        if (!capture_start(capture_path))
+        {
+            std::cout << "Cannot create " << capture_path << "\n";
+            return -1;
+        }
+        capture_opened();
+    }
+
+    ser_set_port(port, baud);
+
     if (!ser_autodetect())
     {
         std::cout << "Cannot connect to EKey, exiting...\n";
         return -1;
     }
 
-    Interface Serial(ser_getchar, ser_putchar);
-
-    std::cout << "Query: 1\n";
-    uint8_t Code = (uint8_t)KeyFunction::prime_keys;
-    Serial.write_output(&Code, 1);
+    Interface Serial(ser_getchar, ser_putchar, ser_flush, ser_getbyte);
 
-    std::cout << "Data: " << KEY_SIZE << "\n";
-    for (unsigned k = 0; k < KEY_SIZE; k++) BUFFER[k] = ~k;
-    Serial.write_output(BUFFER, KEY_SIZE);
+    std::cout << "Query: prime, " << KEY_SIZE << " bytes\n";
+    BUFFER[0] = (uint8_t)KeyFunction::prime_keys;
+    for (unsigned k = 0; k < KEY_SIZE; k++) BUFFER[1 + k] = ~k;
+    Serial.write_output(BUFFER, 1 + KEY_SIZE);
 
     std::cout << "Received: " << Serial.read_input_wait(BUFFER, 1) << "\n";
     std::cout << "Code = " << (unsigned)BUFFER[0] << "\n";
 
+    capture_closed();
+    capture_stop();
     return 0;
 }
@@ -7,8 +7,13 @@
 // Software is distributed on "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 //
 
+#include <string>
+#include <vector>
+
 #include <SKLib/sklib.hpp>
 #include "serial_io.h"
+#include "../ekey-model/capture.h"
+#include "../ekey-model/serial_port.h"
 
 // -------------------------------------------------------------
 
@@ -18,6 +23,35 @@ static self_init CHECK;
 
 // -------------------------------------------------------------
 
+static constexpr int SERIAL_POLL_MS = 1;        // read waits this long for the next chunk, Interface keeps asking
+
+static serial_port_type SERIAL_PORT;
+static std::string SERIAL_PATH;
+static unsigned SERIAL_BAUD = SERIAL_SPEED;
+static std::vector<uint8_t> SERIAL_OUTPUT;
+
+void ser_set_port(const char* path, unsigned baud)
+{
+    SERIAL_PATH = path ? path : "";
+    SERIAL_BAUD = baud;
+}
+
+bool ser_getchar(int& ch)
+{
+    if (!ser_getbyte(ch)) return false;
+    if (ch < ' ' || ch > '~') ch = EOF;     // the device ends the frame with (uint8_t)EOF
+    return true;
+}
+
+void ser_flush()
+{
+    if (SERIAL_OUTPUT.empty()) return;
+    SERIAL_PORT.write(SERIAL_OUTPUT.data(), (unsigned)SERIAL_OUTPUT.size());
+    SERIAL_OUTPUT.clear();
+}
+
+// -------------------------------------------------------------
+
 #ifdef EMULATION_SOCKET
 
 void hdw_init() {}
@@ -25,20 +59,25 @@ static sklib::stream_tcpip_type SOCKET_IO(false, SOCKET_EKEY_PORT);  // client m
 
 bool ser_autodetect()
 {
+    if (!SERIAL_PATH.empty()) return SERIAL_PORT.open(SERIAL_PATH.c_str(), SERIAL_BAUD);
     return SOCKET_IO.is_connected();
 }
 
-bool ser_getchar(int& ch)
+bool ser_getbyte(int& ch)
 {
     uint8_t c=0;
-    if (!SOCKET_IO.read(&c)) return false;
-    ch = ((c<' ') ? EOF : c);
+    if (!(SERIAL_PORT.is_open() ? SERIAL_PORT.read(c, SERIAL_POLL_MS) : SOCKET_IO.read(&c))) return false;
+    capture_byte(CaptureKind::from_device, c);
+    ch = c;
     return true;
 }
 
 void ser_putchar(int ch)
 {
-    SOCKET_IO.write((ch<0) ? '\n' : (uint8_t)ch);
+    const uint8_t c = (ch<0) ? '\n' : (uint8_t)ch;
+    capture_byte(CaptureKind::to_device, c);
+    if (SERIAL_PORT.is_open()) SERIAL_OUTPUT.push_back(c);
+    else SOCKET_IO.write(c);
 }
 
 #endif
@@ -47,24 +86,30 @@ void ser_putchar(int ch)
 
 #ifdef REAL_HARDRDWARE
 
-// TODO: implement communication via serial port
-
 void hdw_init()
 {
 }
 
 bool ser_autodetect()
 {
-    return false;
+    if (SERIAL_PATH.empty() && !serial_port_type::find_device(USB_VID, USB_PID, SERIAL_PATH)) return false;
+    return SERIAL_PORT.open(SERIAL_PATH.c_str(), SERIAL_BAUD);
 }
 
-bool ser_getchar(uint8_t& ch)
+bool ser_getbyte(int& ch)
 {
-    return false;
+    uint8_t c = 0;
+    if (!SERIAL_PORT.read(c, SERIAL_POLL_MS)) return false;
+    capture_byte(CaptureKind::from_device, c);
+    ch = c;
+    return true;
 }
 
-void ser_putchar(uint8_t ch);
+void ser_putchar(int ch)
 {
+    const uint8_t c = (ch<0) ? '\n' : (uint8_t)ch;
+    capture_byte(CaptureKind::to_device, c);
+    SERIAL_OUTPUT.push_back(c);
 }
 
 #endif
@@ -14,6 +14,13 @@
 // unlike file I/O, there is no EOF condition in USB-Serial terminal looking from inside
 // getchar returns true if charachter has arrived - stored in ch
 
+// serial port to use, see ekey-model/serial_port.h; real hardware: otherwise the port is found by USB_VID:USB_PID,
+// simulator: otherwise TCP; the serial port of the simulator is ekey-model --pty
+void ser_set_port(const char* path, unsigned baud);
+
 bool ser_autodetect();
 bool ser_getchar(int& ch);
 void ser_putchar(int ch);
+
+bool ser_getbyte(int& ch);      // any byte value is data, for binary framing
+void ser_flush();               // serial port: putchar collects the frame, flush writes it at once